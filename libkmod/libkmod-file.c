@@ -18,7 +18,10 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,7 +35,11 @@
 #ifdef ENABLE_ZLIB
 #include <zlib.h>
 #endif
+#ifdef ENABLE_ZSTD
+#include <zstd.h>
+#endif
 
+#include <shared/hash.h>
 #include <shared/util.h>
 
 #include "libkmod.h"
@@ -50,16 +57,42 @@ struct kmod_file {
 #endif
 #ifdef ENABLE_ZLIB
 	gzFile gzf;
+#endif
+#ifdef ENABLE_ZSTD
+	bool zstd_used;
 #endif
 	int fd;
-	bool direct;
+	enum kmod_file_compression_type compression;
+	bool loaded;
 	off_t size;
 	void *memory;
+	char *path; /* only kept with a file cache */
+	void *cache_map; /* the cache entry memory points into */
+	size_t cache_map_size;
 	const struct file_ops *ops;
 	const struct kmod_ctx *ctx;
 	struct kmod_elf *elf;
 };
 
+/* Output size to start with when the uncompressed size isn't known */
+#define UNCOMPRESS_STEP (4 * 1024 * 1024)
+
+#if defined(ENABLE_XZ) || defined(ENABLE_ZLIB) || defined(ENABLE_ZSTD)
+/* Larger than any module compresses, with room to spare */
+#define UNCOMPRESS_MAX_RATIO 64
+
+/*
+ * The uncompressed size is read from the file itself, so it may be corrupt
+ * or forged. If it doesn't look plausible it's not used to size the output,
+ * which then grows from UNCOMPRESS_STEP as the data is decoded.
+ */
+static bool uncompressed_size_plausible(uint64_t usize, uint64_t csize)
+{
+	return usize > 0 && usize < SIZE_MAX / 2 &&
+		usize / UNCOMPRESS_MAX_RATIO <= csize;
+}
+#endif
+
 #ifdef ENABLE_XZ
 static void xz_uncompress_belch(struct kmod_file *file, lzma_ret ret)
 {
@@ -85,59 +118,113 @@ static void xz_uncompress_belch(struct kmod_file *file, lzma_ret ret)
 	}
 }
 
+/*
+ * Uncompressed size from the index of the last stream in @buf, which is the
+ * size of the whole file unless streams were concatenated. 0 if unknown.
+ */
+static uint64_t xz_uncompressed_size(const uint8_t *buf, size_t size)
+{
+	uint64_t memlimit = UINT64_MAX, usize;
+	lzma_stream_flags flags;
+	lzma_index *idx = NULL;
+	size_t pos = 0;
+
+	/* stream padding, in multiples of 4 bytes */
+	while (size >= 4 && get_unaligned((const uint32_t *)(buf + size - 4)) == 0)
+		size -= 4;
+
+	if (size < 2 * LZMA_STREAM_HEADER_SIZE)
+		return 0;
+	if (lzma_stream_footer_decode(&flags,
+			buf + size - LZMA_STREAM_HEADER_SIZE) != LZMA_OK)
+		return 0;
+	if (flags.backward_size > size - 2 * LZMA_STREAM_HEADER_SIZE)
+		return 0;
+
+	buf += size - LZMA_STREAM_HEADER_SIZE - flags.backward_size;
+	if (lzma_index_buffer_decode(&idx, &memlimit, NULL, buf, &pos,
+					flags.backward_size) != LZMA_OK)
+		return 0;
+	usize = lzma_index_uncompressed_size(idx);
+	lzma_index_end(idx, NULL);
+
+	return usize;
+}
+
+/*
+ * The whole input is mapped and the output decoded in place, in a buffer
+ * sized from the index so that it's allocated only once.
+ */
 static int xz_uncompress(lzma_stream *strm, struct kmod_file *file)
 {
-	uint8_t in_buf[BUFSIZ], out_buf[BUFSIZ];
-	lzma_action action = LZMA_RUN;
+	struct stat st;
+	void *in, *p = NULL;
+	size_t size = 0;
+	uint64_t usize;
 	lzma_ret ret;
-	void *p = NULL;
-	size_t total = 0;
+	int err;
 
-	strm->avail_in  = 0;
-	strm->next_out  = out_buf;
-	strm->avail_out = sizeof(out_buf);
+	if (fstat(file->fd, &st) < 0)
+		return -errno;
+	if (st.st_size == 0) {
+		xz_uncompress_belch(file, LZMA_BUF_ERROR);
+		return -EINVAL;
+	}
 
-	while (true) {
-		if (strm->avail_in == 0) {
-			ssize_t rdret = read(file->fd, in_buf, sizeof(in_buf));
-			if (rdret < 0) {
-				ret = -errno;
-				goto out;
-			}
-			strm->next_in  = in_buf;
-			strm->avail_in = rdret;
-			if (rdret == 0)
-				action = LZMA_FINISH;
-		}
-		ret = lzma_code(strm, action);
-		if (strm->avail_out == 0 || ret != LZMA_OK) {
-			size_t write_size = BUFSIZ - strm->avail_out;
-			char *tmp = realloc(p, total + write_size);
+	in = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file->fd, 0);
+	if (in == MAP_FAILED)
+		return -errno;
+
+	usize = xz_uncompressed_size(in, st.st_size);
+	size = uncompressed_size_plausible(usize, st.st_size) ?
+						usize : UNCOMPRESS_STEP;
+
+	strm->next_in = in;
+	strm->avail_in = st.st_size;
+
+	for (;;) {
+		if (p == NULL || strm->avail_out == 0) {
+			size_t total = p == NULL ? 0 : size;
+			void *tmp;
+
+			if (p != NULL)
+				size *= 2;
+			tmp = realloc(p, size);
 			if (tmp == NULL) {
-				ret = -errno;
+				err = -errno;
 				goto out;
 			}
-			memcpy(tmp + total, out_buf, write_size);
-			total += write_size;
 			p = tmp;
-			strm->next_out = out_buf;
-			strm->avail_out = BUFSIZ;
+			strm->next_out = (uint8_t *)p + total;
+			strm->avail_out = size - total;
 		}
+
+		ret = lzma_code(strm, LZMA_FINISH);
 		if (ret == LZMA_STREAM_END)
 			break;
 		if (ret != LZMA_OK) {
 			xz_uncompress_belch(file, ret);
-			ret = -EINVAL;
+			err = -EINVAL;
 			goto out;
 		}
 	}
+
 	file->xz_used = true;
+	file->size = size - strm->avail_out;
 	file->memory = p;
-	file->size = total;
+	if (strm->avail_out > 0 && file->size > 0) {
+		/* the index was from the last of several streams */
+		void *tmp = realloc(p, file->size);
+		if (tmp != NULL)
+			file->memory = tmp;
+	}
+	munmap(in, st.st_size);
 	return 0;
- out:
+
+out:
 	free(p);
-	return ret;
+	munmap(in, st.st_size);
+	return err;
 }
 
 static int load_xz(struct kmod_file *file)
@@ -170,33 +257,81 @@ static const char magic_xz[] = {0xfd, '7', 'z', 'X', 'Z', 0};
 #endif
 
 #ifdef ENABLE_ZLIB
-#define READ_STEP (4 * 1024 * 1024)
+#define GZ_BUFFER_SIZE (128 * 1024)
+
+/*
+ * Uncompressed size modulo 2^32 from the trailer, of the last member if
+ * several were concatenated. 0 if unknown or not plausible.
+ */
+static size_t gz_uncompressed_size(int fd)
+{
+	uint8_t isize[4];
+	struct stat st;
+	size_t usize;
+
+	if (fstat(fd, &st) < 0 || st.st_size < 18)
+		return 0;
+	if (pread(fd, isize, sizeof(isize), st.st_size - 4) != sizeof(isize))
+		return 0;
+
+	usize = (size_t)isize[0] | (size_t)isize[1] << 8 |
+		(size_t)isize[2] << 16 | (size_t)isize[3] << 24;
+
+	return uncompressed_size_plausible(usize, st.st_size) ? usize : 0;
+}
+
+/*
+ * The output buffer is sized from the gzip trailer, plus a byte to see the
+ * end of the input without growing it, so it's allocated only once.
+ */
 static int load_zlib(struct kmod_file *file)
 {
 	int err = 0;
-	off_t did = 0, total = 0;
+	size_t did = 0, total;
 	_cleanup_free_ unsigned char *p = NULL;
+	int fd;
 
-	errno = 0;
-	file->gzf = gzdopen(file->fd, "rb");
-	if (file->gzf == NULL)
+	total = gz_uncompressed_size(file->fd);
+	total = total > 0 ? total + 1 : UNCOMPRESS_STEP;
+
+	/* keep file->fd, it may still be handed to the kernel */
+	fd = dup(file->fd);
+	if (fd < 0)
 		return -errno;
-	file->fd = -1; /* now owned by gzf due gzdopen() */
+
+	errno = 0;
+	file->gzf = gzdopen(fd, "rb");
+	if (file->gzf == NULL) {
+		err = errno != 0 ? -errno : -ENOMEM;
+		close(fd);
+		return err;
+	}
+
+	/* larger reads than the default of 8KiB */
+	gzbuffer(file->gzf, GZ_BUFFER_SIZE);
+
+	p = malloc(total);
+	if (p == NULL) {
+		err = -errno;
+		goto error;
+	}
 
 	for (;;) {
+		unsigned int len;
 		int r;
 
 		if (did == total) {
-			void *tmp = realloc(p, total + READ_STEP);
+			void *tmp = realloc(p, total * 2);
 			if (tmp == NULL) {
 				err = -errno;
 				goto error;
 			}
-			total += READ_STEP;
+			total *= 2;
 			p = tmp;
 		}
 
-		r = gzread(file->gzf, p + did, total - did);
+		len = total - did < INT_MAX ? total - did : INT_MAX;
+		r = gzread(file->gzf, p + did, len);
 		if (r == 0)
 			break;
 		else if (r < 0) {
@@ -219,6 +354,7 @@ static int load_zlib(struct kmod_file *file)
 
 error:
 	gzclose(file->gzf);
+	file->gzf = NULL;
 	return err;
 }
 
@@ -227,24 +363,135 @@ static void unload_zlib(struct kmod_file *file)
 	if (file->gzf == NULL)
 		return;
 	free(file->memory);
-	gzclose(file->gzf); /* closes file->fd */
+	gzclose(file->gzf); /* closes the dup()ed fd */
 }
 
 static const char magic_zlib[] = {0x1f, 0x8b};
 #endif
 
+#ifdef ENABLE_ZSTD
+/*
+ * The output buffer is allocated with the content size stored in the frame
+ * header, so for modules compressed in a single frame, as kmod and the kernel
+ * do, it's never resized. Otherwise it grows as needed.
+ */
+static int load_zstd(struct kmod_file *file)
+{
+	ZSTD_inBuffer in = { NULL, 0, 0 };
+	ZSTD_outBuffer out = { NULL, 0, 0 };
+	size_t in_size = ZSTD_DStreamInSize();
+	size_t r = 1; /* 0 once a frame is complete and flushed */
+	ZSTD_DStream *dstr;
+	struct stat st;
+	void *in_buf;
+	int err;
+
+	in_buf = malloc(in_size);
+	dstr = ZSTD_createDStream();
+	if (in_buf == NULL || dstr == NULL) {
+		err = -ENOMEM;
+		ERR(file->ctx, "zstd: %s\n", strerror(ENOMEM));
+		goto out;
+	}
+	in.src = in_buf;
+
+	for (;;) {
+		if (in.pos == in.size &&
+		    (out.dst == NULL || r == 0 || out.pos < out.size)) {
+			ssize_t rdret = read(file->fd, in_buf, in_size);
+
+			if (rdret < 0) {
+				err = -errno;
+				ERR(file->ctx, "zstd: %m\n");
+				goto out;
+			}
+			if (rdret == 0)
+				break;
+			in.size = rdret;
+			in.pos = 0;
+		}
+
+		if (out.dst == NULL) {
+			unsigned long long size;
+
+			size = ZSTD_getFrameContentSize(in_buf, in.size);
+			if (size == ZSTD_CONTENTSIZE_UNKNOWN ||
+			    size == ZSTD_CONTENTSIZE_ERROR ||
+			    fstat(file->fd, &st) < 0 ||
+			    !uncompressed_size_plausible(size, st.st_size))
+				size = ZSTD_DStreamOutSize();
+			out.size = size;
+			out.dst = malloc(out.size);
+			if (out.dst == NULL) {
+				err = -errno;
+				ERR(file->ctx, "zstd: %m\n");
+				goto out;
+			}
+		} else if (out.pos == out.size) {
+			void *tmp = realloc(out.dst, out.size * 2);
+
+			if (tmp == NULL) {
+				err = -errno;
+				ERR(file->ctx, "zstd: %m\n");
+				goto out;
+			}
+			out.dst = tmp;
+			out.size *= 2;
+		}
+
+		r = ZSTD_decompressStream(dstr, &out, &in);
+		if (ZSTD_isError(r)) {
+			err = -EINVAL;
+			ERR(file->ctx, "zstd: %s\n", ZSTD_getErrorName(r));
+			goto out;
+		}
+	}
+
+	if (out.dst == NULL || r != 0) {
+		err = -EINVAL;
+		ERR(file->ctx, "zstd: Unexpected end of input\n");
+		goto out;
+	}
+
+	file->zstd_used = true;
+	file->memory = out.dst;
+	file->size = out.pos;
+	out.dst = NULL;
+	err = 0;
+
+out:
+	free(out.dst);
+	free(in_buf);
+	ZSTD_freeDStream(dstr);
+	return err;
+}
+
+static void unload_zstd(struct kmod_file *file)
+{
+	if (!file->zstd_used)
+		return;
+	free(file->memory);
+}
+
+static const char magic_zstd[] = {0x28, 0xB5, 0x2F, 0xFD};
+#endif
+
 static const struct comp_type {
 	size_t magic_size;
+	enum kmod_file_compression_type compression;
 	const char *magic_bytes;
 	const struct file_ops ops;
 } comp_types[] = {
 #ifdef ENABLE_XZ
-	{sizeof(magic_xz), magic_xz, {load_xz, unload_xz}},
+	{sizeof(magic_xz), KMOD_FILE_COMPRESSION_XZ, magic_xz, {load_xz, unload_xz}},
 #endif
 #ifdef ENABLE_ZLIB
-	{sizeof(magic_zlib), magic_zlib, {load_zlib, unload_zlib}},
+	{sizeof(magic_zlib), KMOD_FILE_COMPRESSION_ZLIB, magic_zlib, {load_zlib, unload_zlib}},
 #endif
-	{0, NULL, {NULL, NULL}}
+#ifdef ENABLE_ZSTD
+	{sizeof(magic_zstd), KMOD_FILE_COMPRESSION_ZSTD, magic_zstd, {load_zstd, unload_zstd}},
+#endif
+	{0, KMOD_FILE_COMPRESSION_NONE, NULL, {NULL, NULL}}
 };
 
 static int load_reg(struct kmod_file *file)
@@ -259,7 +506,6 @@ static int load_reg(struct kmod_file *file)
 			    file->fd, 0);
 	if (file->memory == MAP_FAILED)
 		return -errno;
-	file->direct = true;
 	return 0;
 }
 
@@ -272,11 +518,201 @@ static const struct file_ops reg_ops = {
 	load_reg, unload_reg
 };
 
+/*
+ * Cache of decompressed modules, enabled with kmod_set_file_cache_dir(). Each
+ * entry is the header, the key and, aligned, the decompressed module. The key
+ * has the path, device, inode, mtime and size of the compressed file, so a
+ * changed module never matches, and the entry's name is a hash of it. Entries
+ * are published with rename(), so readers never see partial ones.
+ */
+#define FILE_CACHE_MAGIC "KMODFC01"
+#define FILE_CACHE_ALIGN 64
+
+struct file_cache_header {
+	char magic[8];
+	uint32_t keylen;
+	uint32_t data_offset;
+	uint64_t data_size;
+};
+
+static int file_cache_key(const struct kmod_file *file, char *key,
+							size_t keysize)
+{
+	struct stat st;
+	int len;
+
+	if (fstat(file->fd, &st) < 0)
+		return -errno;
+
+	len = snprintf(key, keysize, "%llx:%llx:%lld.%09ld:%lld:%s",
+			(unsigned long long)st.st_dev,
+			(unsigned long long)st.st_ino,
+			(long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+			(long long)st.st_size, file->path);
+	if (len < 0 || (size_t)len >= keysize)
+		return -ENAMETOOLONG;
+
+	return len;
+}
+
+/*
+ * Entries not written by us or root, or that someone else could have
+ * modified, are ignored
+ */
+static bool file_cache_entry_trusted(const struct stat *st)
+{
+	if (!S_ISREG(st->st_mode))
+		return false;
+	if (st->st_uid != geteuid() && st->st_uid != 0)
+		return false;
+	if (st->st_mode & (S_IWGRP | S_IWOTH))
+		return false;
+
+	return true;
+}
+
+static bool file_cache_load(struct kmod_file *file, int dfd, const char *name,
+					const char *key, size_t keylen)
+{
+	const struct file_cache_header *hdr;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = openat(dfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) < 0 || !file_cache_entry_trusted(&st) ||
+			(size_t)st.st_size < sizeof(*hdr) + keylen) {
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	hdr = map;
+	if (memcmp(hdr->magic, FILE_CACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+			hdr->keylen != keylen ||
+			memcmp((const char *)map + sizeof(*hdr), key, keylen) != 0 ||
+			hdr->data_offset < sizeof(*hdr) + keylen ||
+			hdr->data_size != (uint64_t)st.st_size - hdr->data_offset) {
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	file->cache_map = map;
+	file->cache_map_size = st.st_size;
+	file->memory = (char *)map + hdr->data_offset;
+	file->size = hdr->data_size;
+
+	return true;
+}
+
+static void file_cache_store(const struct kmod_file *file, int dfd,
+			const char *name, const char *key, size_t keylen)
+{
+	/* DBG() needs it non-const when debug is disabled */
+	struct kmod_ctx *ctx = (struct kmod_ctx *)file->ctx;
+	static unsigned int counter;
+	struct file_cache_header hdr = {
+		.keylen = keylen,
+		.data_size = file->size,
+	};
+	char pad[FILE_CACHE_ALIGN] = { };
+	char tmp[64];
+	struct stat st;
+	size_t padlen;
+	int fd;
+
+	memcpy(hdr.magic, FILE_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.data_offset = (sizeof(hdr) + keylen + FILE_CACHE_ALIGN - 1) &
+						~(FILE_CACHE_ALIGN - 1);
+	padlen = hdr.data_offset - sizeof(hdr) - keylen;
+
+	snprintf(tmp, sizeof(tmp), ".%s.%d.%u", name, getpid(),
+		 __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+	fd = openat(dfd, tmp, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,
+									0600);
+	if (fd < 0) {
+		DBG(ctx, "could not create cache entry: %m\n");
+		return;
+	}
+
+	if (write_str_safe(fd, (const char *)&hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write_str_safe(fd, key, keylen) != (ssize_t)keylen ||
+	    write_str_safe(fd, pad, padlen) != (ssize_t)padlen ||
+	    write_str_safe(fd, file->memory, file->size) != file->size)
+		goto fail;
+
+	/* as readable as the module it comes from */
+	if (fstat(file->fd, &st) < 0 || fchmod(fd, st.st_mode & 0644) < 0)
+		goto fail;
+
+	if (close(fd) < 0) {
+		fd = -1;
+		goto fail;
+	}
+	if (renameat(dfd, tmp, dfd, name) < 0) {
+		fd = -1;
+		goto fail;
+	}
+
+	DBG(ctx, "cached '%s' as %s\n", file->path, name);
+	return;
+
+fail:
+	DBG(ctx, "could not write cache entry for '%s'\n", file->path);
+	if (fd >= 0)
+		close(fd);
+	unlinkat(dfd, tmp, 0);
+}
+
+/* Load the file from the cache, or decompress and add it there */
+static int file_cache_load_contents(struct kmod_file *file, int dfd)
+{
+	struct kmod_ctx *ctx = (struct kmod_ctx *)file->ctx;
+	char key[PATH_MAX + 128];
+	char name[32];
+	int keylen, err;
+
+	keylen = file_cache_key(file, key, sizeof(key));
+	if (keylen < 0)
+		return file->ops->load(file);
+
+	snprintf(name, sizeof(name), "%08x%08x", hash_str_seeded(key, 0),
+						hash_str_seeded(key, 1));
+
+	if (file_cache_load(file, dfd, name, key, keylen)) {
+		DBG(ctx, "'%s' found in the cache as %s\n", file->path,
+									name);
+		return 0;
+	}
+
+	err = file->ops->load(file);
+	if (err < 0)
+		return err;
+
+	file_cache_store(file, dfd, name, key, keylen);
+	return 0;
+}
+
 struct kmod_elf *kmod_file_get_elf(struct kmod_file *file)
 {
+	int err;
+
 	if (file->elf)
 		return file->elf;
 
+	err = kmod_file_load_contents(file);
+	if (err < 0) {
+		errno = -err;
+		return NULL;
+	}
+
 	file->elf = kmod_elf_new(file->memory, file->size);
 	return file->elf;
 }
@@ -292,6 +728,7 @@ struct kmod_file *kmod_file_open(const struct kmod_ctx *ctx,
 	if (file == NULL)
 		return NULL;
 
+	file->ctx = ctx;
 	file->fd = open(filename, O_RDONLY|O_CLOEXEC);
 	if (file->fd < 0) {
 		err = -errno;
@@ -303,7 +740,6 @@ struct kmod_file *kmod_file_open(const struct kmod_ctx *ctx,
 			magic_size_max = itr->magic_size;
 	}
 
-	file->direct = false;
 	if (magic_size_max > 0) {
 		char *buf = alloca(magic_size_max + 1);
 		ssize_t sz;
@@ -326,15 +762,22 @@ struct kmod_file *kmod_file_open(const struct kmod_ctx *ctx,
 			if (memcmp(buf, itr->magic_bytes, itr->magic_size) == 0)
 				break;
 		}
-		if (itr->ops.load != NULL)
+		if (itr->ops.load != NULL) {
 			file->ops = &itr->ops;
+			file->compression = itr->compression;
+		}
 	}
 
 	if (file->ops == NULL)
 		file->ops = &reg_ops;
 
-	err = file->ops->load(file);
-	file->ctx = ctx;
+	err = 0;
+	if (file->compression != KMOD_FILE_COMPRESSION_NONE &&
+			kmod_get_file_cache_dirfd(ctx) >= 0) {
+		file->path = strdup(filename);
+		if (file->path == NULL)
+			err = -ENOMEM;
+	}
 error:
 	if (err < 0) {
 		if (file->fd >= 0)
@@ -347,6 +790,34 @@ error:
 	return file;
 }
 
+/*
+ * Decompress or map the file. Deferred until the contents are needed, so a
+ * module handed to the kernel by fd is never decompressed here.
+ *
+ * Compressed modules are always decompressed whole, even to read a single
+ * section: the linker places the section header table at the end of the file,
+ * so a sequential decoder only learns where .modinfo or __versions are once
+ * it has produced everything.
+ */
+int kmod_file_load_contents(struct kmod_file *file)
+{
+	int err;
+
+	if (file->loaded)
+		return 0;
+
+	if (file->path != NULL)
+		err = file_cache_load_contents(file,
+					kmod_get_file_cache_dirfd(file->ctx));
+	else
+		err = file->ops->load(file);
+	if (err < 0)
+		return err;
+
+	file->loaded = true;
+	return 0;
+}
+
 void *kmod_file_get_contents(const struct kmod_file *file)
 {
 	return file->memory;
@@ -359,7 +830,12 @@ off_t kmod_file_get_size(const struct kmod_file *file)
 
 bool kmod_file_get_direct(const struct kmod_file *file)
 {
-	return file->direct;
+	return file->ops == &reg_ops;
+}
+
+enum kmod_file_compression_type kmod_file_get_compression(const struct kmod_file *file)
+{
+	return file->compression;
 }
 
 int kmod_file_get_fd(const struct kmod_file *file)
@@ -372,8 +848,12 @@ void kmod_file_unref(struct kmod_file *file)
 	if (file->elf)
 		kmod_elf_unref(file->elf);
 
-	file->ops->unload(file);
+	if (file->cache_map != NULL)
+		munmap(file->cache_map, file->cache_map_size);
+	else if (file->loaded)
+		file->ops->unload(file);
 	if (file->fd >= 0)
 		close(file->fd);
+	free(file->path);
 	free(file);
 }
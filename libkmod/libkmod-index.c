@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <shared/hash.h>
 #include <shared/macro.h>
 #include <shared/strbuf.h>
 #include <shared/util.h>
@@ -50,6 +51,18 @@
 #define INDEX_VERSION_MINOR 0x0001
 #define INDEX_VERSION ((INDEX_VERSION_MAJOR<<16)|INDEX_VERSION_MINOR)
 
+/* Aligned format with child bitmaps, see "Disk format v3" below */
+#define INDEX_VERSION_MAJOR_V3 0x0003
+
+/* First minor versions with a perfect hash table, see "Hash table" below */
+#define INDEX_VERSION_MINOR_HASH 0x0002
+#define INDEX_VERSION_MINOR_V3_HASH 0x0001
+
+/* All the indexes in a single file, see "Bundle" below */
+#define INDEX_BUNDLE_MAGIC 0xB007F4B1
+#define INDEX_BUNDLE_VERSION 0x00010000
+#define INDEX_ALIGN(x) (((x) + 3U) & ~3U)
+
 /* The index file maps keys to values. Both keys and values are ASCII strings.
  * Each key can have multiple values. Values are sorted by an integer priority.
  *
@@ -59,7 +72,7 @@
  */
 #define INDEX_CHILDMAX 128
 
-/* Disk format:
+/* Disk format (v2):
  *
  *  uint32_t magic = INDEX_MAGIC;
  *  uint32_t version = INDEX_VERSION;
@@ -82,8 +95,88 @@
  *  (node_offset & INDEX_NODE_FLAGS) indicates which fields are present.
  *  Empty prefixes are omitted, leaf nodes omit the three child-related fields.
  *
- *  This could be optimised further by adding a sparse child format
- *  (indicated using a new flag).
+ *  Disk format v3:
+ *
+ *  Same header, flags and trie as v2, but every field is aligned to 4 bytes
+ *  and nodes are packed in breadth-first order, so siblings (and the top
+ *  levels of the tree) are contiguous in the file. All the values are stored
+ *  after the last node so they don't get in the way while descending.
+ *
+ *       uint32_t values_offset; // file offset of the node's values
+ *
+ *       uint32_t child_map[4]; // bit (c % 32) of child_map[c / 32] is
+ *                              // set if there is a child for char c
+ *       uint32_t children[popcount(child_map)]; // sorted by char
+ *
+ *       char[] prefix; // nul terminated, zero padded to 4 bytes
+ *
+ *  At values_offset:
+ *       uint32_t value_count;
+ *       struct {
+ *           uint32_t priority;
+ *           char[] value; // nul terminated, zero padded to 4 bytes
+ *       } values[value_count];
+ *
+ *  The child for char c is found by counting the bits set in child_map
+ *  below c, instead of indexing a [first, last] array padded with empty
+ *  entries.
+ *
+ *  Precompiled wildcards (v3 only):
+ *
+ *  When INDEX_NODE_WILDCARDS is set, the node is followed by
+ *       uint32_t wildcards_offset;
+ *  pointing to a bucket with all the patterns the wildcard search would
+ *  otherwise find by walking the subtrees right below the node: the ones
+ *  starting at the first wildcard of the node's prefix or, if it has none,
+ *  under its '*', '?' and '[' children. Patterns are stored in the same
+ *  order as that walk, each with the values of its node:
+ *
+ *       uint32_t n_entries;
+ *       struct {
+ *           uint32_t values_offset; // same as the node's values_offset
+ *           uint32_t len;           // | INDEX_WILD_FNMATCH
+ *           uint8_t code[len];      // zero padded to 4 bytes
+ *       } entries[n_entries];
+ *
+ *  code is a program of enum index_wild_op matched against the rest of the
+ *  key or, with INDEX_WILD_FNMATCH, a nul terminated pattern for fnmatch().
+ *  Readers not knowing about it never look past the prefix.
+ *
+ *  Hash table:
+ *
+ *  Since version 2.2 and 3.1 the header has a fourth word, hash_offset. If
+ *  it's not zero, it's the offset of a minimal perfect hash table of all the
+ *  keys, used for exact lookups. Readers not knowing about it just follow
+ *  root_offset. It's written only for indexes that are never searched with
+ *  wildcards (modules.dep.bin and modules.builtin.bin).
+ *
+ *  At hash_offset (aligned to 4 bytes):
+ *       uint32_t n_keys;
+ *       uint32_t n_buckets;
+ *       uint32_t seeds[n_buckets];
+ *       struct {
+ *           uint32_t key_offset;  // nul terminated key
+ *           uint32_t node_offset; // node holding its values, with flags
+ *       } slots[n_keys];
+ *
+ *  A key is in slot hash_str_seeded(key, seeds[b]) % n_keys, with bucket
+ *  b = hash_str_seeded(key, 0) % n_buckets. Keys not in the index also map
+ *  to some slot, so the key stored there must be compared.
+ *
+ *  Bundle:
+ *
+ *  modules.idx has all the indexes libkmod keeps loaded, so they can be
+ *  opened with a single open() and mmap(). Each section is a whole index
+ *  file, with offsets relative to its start, aligned to 8 bytes:
+ *
+ *       uint32_t magic = INDEX_BUNDLE_MAGIC;
+ *       uint32_t version = INDEX_BUNDLE_VERSION;
+ *       uint32_t n_sections;
+ *       struct {
+ *           uint32_t id;     // enum kmod_index
+ *           uint32_t offset;
+ *           uint32_t size;
+ *       } sections[n_sections];
  *
  *
  * Implementation is based on a radix tree, or "trie".
@@ -144,10 +237,21 @@ enum node_offset {
 	INDEX_NODE_PREFIX   = 0x80000000,
 	INDEX_NODE_VALUES = 0x40000000,
 	INDEX_NODE_CHILDS   = 0x20000000,
+	INDEX_NODE_WILDCARDS = 0x10000000, /* v3 only */
 
 	INDEX_NODE_MASK     = 0x0FFFFFFF, /* Offset value */
 };
 
+/* Program of a precompiled wildcard pattern */
+enum index_wild_op {
+	INDEX_WILD_END = 0,
+	INDEX_WILD_LITERAL, /* followed by the char */
+	INDEX_WILD_ANY,
+	INDEX_WILD_STAR,
+	INDEX_WILD_CLASS, /* followed by a 256-bit bitmap */
+};
+#define INDEX_WILD_FNMATCH 0x80000000 /* not compiled, use fnmatch() */
+
 void index_values_free(struct index_value *values)
 {
 	while (values) {
@@ -226,6 +330,7 @@ static unsigned buf_freadchars(struct strbuf *buf, FILE *in)
  */
 struct index_node_f {
 	FILE *file;
+	unsigned int version;	/* major version of the file format */
 	char *prefix;		/* path compression */
 	struct index_value *values;
 	unsigned char first;	/* range of child nodes */
@@ -233,7 +338,99 @@ struct index_node_f {
 	uint32_t children[0];
 };
 
-static struct index_node_f *index_read(FILE *in, uint32_t offset)
+static struct index_node_f *index_read_v3(FILE *in, uint32_t offset)
+{
+	struct index_node_f *node;
+	char *prefix;
+	uint32_t values_offset = 0;
+	uint32_t child_map[4];
+	uint32_t children[INDEX_CHILDMAX];
+	int i, ch, child_count = 0;
+	int first = INDEX_CHILDMAX, last = 0;
+
+	if (fseek(in, offset & INDEX_NODE_MASK, SEEK_SET) < 0)
+		return NULL;
+
+	if (offset & INDEX_NODE_VALUES)
+		values_offset = read_long(in);
+
+	if (offset & INDEX_NODE_CHILDS) {
+		for (i = 0; i < 4; i++)
+			child_map[i] = read_long(in);
+
+		for (ch = 0; ch < INDEX_CHILDMAX; ch++) {
+			if (!(child_map[ch / 32] & (1U << (ch % 32))))
+				continue;
+			if (first == INDEX_CHILDMAX)
+				first = ch;
+			last = ch;
+			child_count++;
+		}
+
+		for (i = 0; i < child_count; i++)
+			children[i] = read_long(in);
+	}
+
+	if (offset & INDEX_NODE_PREFIX) {
+		struct strbuf buf;
+		strbuf_init(&buf);
+		buf_freadchars(&buf, in);
+		prefix = strbuf_steal(&buf);
+	} else
+		prefix = NOFAIL(strdup(""));
+
+	/* Expand to the [first, last] range used by the v2 reader */
+	if (child_count > 0) {
+		node = NOFAIL(calloc(1, sizeof(struct index_node_f) +
+				     sizeof(uint32_t) * (last - first + 1)));
+
+		for (ch = first, i = 0; ch <= last; ch++) {
+			if (child_map[ch / 32] & (1U << (ch % 32)))
+				node->children[ch - first] = children[i++];
+		}
+	} else
+		node = NOFAIL(calloc(1, sizeof(struct index_node_f)));
+
+	node->first = first;
+	node->last = last;
+
+	node->values = NULL;
+	if (offset & INDEX_NODE_VALUES) {
+		int value_count;
+		struct strbuf buf;
+		const char *value;
+		unsigned int priority;
+
+		if (fseek(in, values_offset, SEEK_SET) < 0)
+			value_count = 0;
+		else
+			value_count = read_long(in);
+
+		strbuf_init(&buf);
+		while (value_count--) {
+			unsigned int len;
+
+			priority = read_long(in);
+			len = buf_freadchars(&buf, in) + 1;
+			value = strbuf_str(&buf);
+			add_value(&node->values, value, buf.used, priority);
+			strbuf_clear(&buf);
+
+			/* skip padding */
+			for (; len % 4; len++)
+				read_char(in);
+		}
+		strbuf_release(&buf);
+	}
+
+	node->prefix = prefix;
+	node->file = in;
+	node->version = INDEX_VERSION_MAJOR_V3;
+	return node;
+}
+
+static struct index_node_f *index_read(FILE *in, unsigned int version,
+							uint32_t offset)
 {
 	struct index_node_f *node;
 	char *prefix;
@@ -242,6 +439,9 @@ static struct index_node_f *index_read(FILE *in, uint32_t offset)
 	if ((offset & INDEX_NODE_MASK) == 0)
 		return NULL;
 
+	if (version == INDEX_VERSION_MAJOR_V3)
+		return index_read_v3(in, offset);
+
 	if (fseek(in, offset & INDEX_NODE_MASK, SEEK_SET) < 0)
 		return NULL;
 
@@ -294,6 +494,7 @@ static struct index_node_f *index_read(FILE *in, uint32_t offset)
 
 	node->prefix = prefix;
 	node->file = in;
+	node->version = version;
 	return node;
 }
 
@@ -306,6 +507,7 @@ static void index_close(struct index_node_f *node)
 
 struct index_file {
 	FILE *file;
+	unsigned int version;
 	uint32_t root_offset;
 };
 
@@ -327,13 +529,15 @@ struct index_file *index_file_open(const char *filename)
 	}
 
 	version = read_long(file);
-	if (version >> 16 != INDEX_VERSION_MAJOR) {
+	if (version >> 16 != INDEX_VERSION_MAJOR &&
+			version >> 16 != INDEX_VERSION_MAJOR_V3) {
 		fclose(file);
 		return NULL;
 	}
 
 	new = NOFAIL(malloc(sizeof(struct index_file)));
 	new->file = file;
+	new->version = version >> 16;
 	new->root_offset = read_long(new->file);
 
 	errno = 0;
@@ -348,14 +552,14 @@ void index_file_close(struct index_file *idx)
 
 static struct index_node_f *index_readroot(struct index_file *in)
 {
-	return index_read(in->file, in->root_offset);
+	return index_read(in->file, in->version, in->root_offset);
 }
 
 static struct index_node_f *index_readchild(const struct index_node_f *parent,
 					    int ch)
 {
 	if (parent->first <= ch && ch <= parent->last) {
-		return index_read(parent->file,
+		return index_read(parent->file, parent->version,
 		                       parent->children[ch - parent->first]);
 	}
 
@@ -610,31 +814,45 @@ struct index_value *index_searchwild(struct index_file *in, const char *key)
 
 static const char _idx_empty_str[] = "";
 
+/* Mapping shared by all the indexes of a bundle */
+struct index_mm_bundle {
+	void *mm;
+	size_t size;
+	int refcount;
+};
+
 struct index_mm {
 	struct kmod_ctx *ctx;
+	struct index_mm_bundle *bundle;
 	void *mm;
 	uint32_t root_offset;
+	unsigned int version;
 	size_t size;
-};
-
-struct index_mm_value {
-	unsigned int priority;
-	unsigned int len;
-	const char *value;
-};
 
-struct index_mm_value_array {
-	struct index_mm_value *values;
-	unsigned int len;
+	/* perfect hash table, if n_keys > 0 */
+	struct {
+		const uint32_t *seeds;
+		const uint32_t *slots;
+		uint32_t n_keys;
+		uint32_t n_buckets;
+	} hash;
 };
 
+/*
+ * Node decoded in place: all the pointers point inside the mmap'ed area, so
+ * nodes can live on the stack and no allocation is needed while traversing
+ * the trie.
+ */
 struct index_mm_node {
 	struct index_mm *idx;
 	const char *prefix; /* mmape'd value */
-	struct index_mm_value_array values;
+	const void *children; /* mmape'd, unaligned uint32_t[] */
+	const void *values; /* mmape'd {priority, value} pairs */
+	const void *wildcards; /* mmape'd, v3 only */
+	unsigned int value_count;
 	unsigned char first;
 	unsigned char last;
-	uint32_t children[];
+	uint32_t child_map[4]; /* v3 only */
 };
 
 static inline uint32_t read_long_mm(void **p)
@@ -665,94 +883,200 @@ static inline char *read_chars_mm(void **p, unsigned *rlen)
 	return addr;
 }
 
-static struct index_mm_node *index_mm_read_node(struct index_mm *idx,
-							uint32_t offset) {
+/* v3 fields are aligned, no need to go through get_unaligned() */
+static inline uint32_t read_long_aligned_mm(void **p)
+{
+	uint32_t *addr = *(uint32_t **)p;
+
+	*p = addr + 1;
+	return ntohl(*addr);
+}
+
+static inline char *read_chars_aligned_mm(void **p, unsigned *rlen)
+{
+	char *addr = *(char **)p;
+	size_t len = *rlen = strlen(addr);
+	*p = addr + INDEX_ALIGN(len + 1);
+	return addr;
+}
+
+static void index_mm_read_node_v3(struct index_mm_node *node, void *p,
+							uint32_t offset)
+{
+	uint32_t values_offset = 0;
+	int i;
+
+	if (offset & INDEX_NODE_VALUES)
+		values_offset = read_long_aligned_mm(&p);
+
+	node->first = INDEX_CHILDMAX;
+	node->last = 0;
+	node->children = NULL;
+	if (offset & INDEX_NODE_CHILDS) {
+		for (i = 0; i < 4; i++) {
+			uint32_t map = read_long_aligned_mm(&p);
+
+			node->child_map[i] = map;
+			if (map == 0)
+				continue;
+			if (node->first == INDEX_CHILDMAX)
+				node->first = i * 32 + __builtin_ctz(map);
+			node->last = i * 32 + 31 - __builtin_clz(map);
+		}
+		node->children = p;
+		for (i = 0; i < 4; i++)
+			p = (uint32_t *)p + __builtin_popcount(node->child_map[i]);
+	}
+
+	if (offset & INDEX_NODE_PREFIX) {
+		unsigned len;
+		node->prefix = read_chars_aligned_mm(&p, &len);
+	} else
+		node->prefix = _idx_empty_str;
+
+	if (offset & INDEX_NODE_WILDCARDS)
+		node->wildcards = (char *)node->idx->mm +
+						read_long_aligned_mm(&p);
+
+	if (offset & INDEX_NODE_VALUES) {
+		p = (char *)node->idx->mm + values_offset;
+		node->value_count = read_long_aligned_mm(&p);
+	} else
+		node->value_count = 0;
+
+	node->values = p;
+}
+
+static bool index_mm_read_node(struct index_mm *idx, uint32_t offset,
+						struct index_mm_node *node)
+{
 	void *p = idx->mm;
-	struct index_mm_node *node;
-	const char *prefix;
-	int i, child_count, value_count, children_padding;
-	uint32_t children[INDEX_CHILDMAX];
-	char first, last;
 
 	if ((offset & INDEX_NODE_MASK) == 0)
-		return NULL;
+		return false;
 
 	p = (char *)p + (offset & INDEX_NODE_MASK);
 
+	node->idx = idx;
+	node->wildcards = NULL;
+
+	if (idx->version == INDEX_VERSION_MAJOR_V3) {
+		index_mm_read_node_v3(node, p, offset);
+		return true;
+	}
+
 	if (offset & INDEX_NODE_PREFIX) {
 		unsigned len;
-		prefix = read_chars_mm(&p, &len);
+		node->prefix = read_chars_mm(&p, &len);
 	} else
-		prefix = _idx_empty_str;
+		node->prefix = _idx_empty_str;
 
 	if (offset & INDEX_NODE_CHILDS) {
-		first = read_char_mm(&p);
-		last = read_char_mm(&p);
-		child_count = last - first + 1;
-		for (i = 0; i < child_count; i++)
-			children[i] = read_long_mm(&p);
+		node->first = read_char_mm(&p);
+		node->last = read_char_mm(&p);
+		node->children = p;
+		p = (char *)p + sizeof(uint32_t) * (node->last - node->first + 1);
 	} else {
-		first = (char)INDEX_CHILDMAX;
-		last = 0;
-		child_count = 0;
+		node->first = INDEX_CHILDMAX;
+		node->last = 0;
+		node->children = NULL;
 	}
 
-	children_padding = (sizeof(struct index_mm_node) +
-			    (sizeof(uint32_t) * child_count)) % sizeof(void *);
-
 	if (offset & INDEX_NODE_VALUES)
-		value_count = read_long_mm(&p);
+		node->value_count = read_long_mm(&p);
 	else
-		value_count = 0;
+		node->value_count = 0;
 
-	node = malloc(sizeof(struct index_mm_node)
-		      + sizeof(uint32_t) * child_count + children_padding
-		      + sizeof(struct index_mm_value) * value_count);
-	if (node == NULL)
-		return NULL;
+	node->values = p;
 
-	node->idx = idx;
-	node->prefix = prefix;
-	if (value_count == 0)
-		node->values.values = NULL;
-	else {
-		node->values.values = (struct index_mm_value *)
-			((char *)node + sizeof(struct index_mm_node) +
-			 sizeof(uint32_t) * child_count + children_padding);
-	}
-	node->values.len = value_count;
-	node->first = first;
-	node->last = last;
-	memcpy(node->children, children, sizeof(uint32_t) * child_count);
+	return true;
+}
 
-	for (i = 0; i < value_count; i++) {
-		struct index_mm_value *v = node->values.values + i;
-		v->priority = read_long_mm(&p);
-		v->value = read_chars_mm(&p, &v->len);
-	}
+/*
+ * Decode the value at *p and advance it to the next one. Must be called at
+ * most node->value_count times, starting from node->values.
+ */
+static inline void index_mm_read_value(const struct index_mm_node *node,
+				const void **p, struct index_mm_value *v)
+{
+	void *q = (void *)*p;
 
-	return node;
+	if (node->idx->version == INDEX_VERSION_MAJOR_V3) {
+		v->priority = read_long_aligned_mm(&q);
+		v->value = read_chars_aligned_mm(&q, &v->len);
+	} else {
+		v->priority = read_long_mm(&q);
+		v->value = read_chars_mm(&q, &v->len);
+	}
+	*p = q;
 }
 
-static void index_mm_free_node(struct index_mm_node *node)
+/*
+ * The hash table is only an optimization: if it doesn't look sane, ignore it
+ * and use the trie.
+ */
+static void index_mm_open_hash(struct index_mm *idx, uint32_t offset)
 {
-	free(node);
+	const uint32_t *p;
+	uint64_t end;
+	uint32_t n_keys, n_buckets;
+
+	if (offset % sizeof(uint32_t) != 0 ||
+	    (uint64_t) offset + 2 * sizeof(uint32_t) > idx->size)
+		goto invalid;
+
+	p = (const uint32_t *)((char *)idx->mm + offset);
+	n_keys = ntohl(p[0]);
+	n_buckets = ntohl(p[1]);
+	end = (uint64_t) offset + sizeof(uint32_t) *
+		(2 + (uint64_t) n_buckets + 2 * (uint64_t) n_keys);
+	if (n_keys == 0 || n_buckets == 0 || end > idx->size)
+		goto invalid;
+
+	idx->hash.n_keys = n_keys;
+	idx->hash.n_buckets = n_buckets;
+	idx->hash.seeds = p + 2;
+	idx->hash.slots = p + 2 + n_buckets;
+	return;
+
+invalid:
+	DBG(idx->ctx, "ignoring invalid hash table at offset %u\n", offset);
 }
 
-struct index_mm *index_mm_open(struct kmod_ctx *ctx, const char *filename,
-						unsigned long long *stamp)
+/* Check the header of the index mapped at @mm and create its handle */
+static struct index_mm *index_mm_new(struct kmod_ctx *ctx, void *mm,
+								size_t size)
 {
-	int fd;
-	struct stat st;
 	struct index_mm *idx;
 	struct {
 		uint32_t magic;
 		uint32_t version;
 		uint32_t root_offset;
+		uint32_t hash_offset;
 	} hdr;
 	void *p;
 
-	DBG(ctx, "file=%s\n", filename);
+	if (size < 3 * sizeof(uint32_t))
+		return NULL;
+
+	p = mm;
+	hdr.magic = read_long_mm(&p);
+	hdr.version = read_long_mm(&p);
+	hdr.root_offset = read_long_mm(&p);
+
+	if (hdr.magic != INDEX_MAGIC) {
+		ERR(ctx, "magic check fail: %x instead of %x\n", hdr.magic,
+								INDEX_MAGIC);
+		return NULL;
+	}
+
+	if (hdr.version >> 16 != INDEX_VERSION_MAJOR &&
+			hdr.version >> 16 != INDEX_VERSION_MAJOR_V3) {
+		ERR(ctx, "major version check fail: %u instead of %u or %u\n",
+					hdr.version >> 16, INDEX_VERSION_MAJOR,
+					INDEX_VERSION_MAJOR_V3);
+		return NULL;
+	}
 
 	idx = malloc(sizeof(*idx));
 	if (idx == NULL) {
@@ -760,208 +1084,500 @@ struct index_mm *index_mm_open(struct kmod_ctx *ctx, const char *filename,
 		return NULL;
 	}
 
+	idx->mm = mm;
+	idx->bundle = NULL;
+	idx->root_offset = hdr.root_offset;
+	idx->version = hdr.version >> 16;
+	idx->size = size;
+	idx->ctx = ctx;
+
+	hdr.hash_offset = 0;
+	if ((idx->version == INDEX_VERSION_MAJOR &&
+	     (hdr.version & 0xffff) >= INDEX_VERSION_MINOR_HASH) ||
+	    (idx->version == INDEX_VERSION_MAJOR_V3 &&
+	     (hdr.version & 0xffff) >= INDEX_VERSION_MINOR_V3_HASH)) {
+		if (size < sizeof(hdr)) {
+			ERR(ctx, "header too short\n");
+			free(idx);
+			return NULL;
+		}
+		hdr.hash_offset = read_long_mm(&p);
+	}
+
+	memset(&idx->hash, 0, sizeof(idx->hash));
+	if (hdr.hash_offset != 0)
+		index_mm_open_hash(idx, hdr.hash_offset);
+
+	return idx;
+}
+
+struct index_mm *index_mm_open(struct kmod_ctx *ctx, const char *filename,
+						unsigned long long *stamp)
+{
+	int fd;
+	struct stat st;
+	struct index_mm *idx;
+	void *mm;
+
+	DBG(ctx, "file=%s\n", filename);
+
 	if ((fd = open(filename, O_RDONLY|O_CLOEXEC)) < 0) {
 		DBG(ctx, "open(%s, O_RDONLY|O_CLOEXEC): %m\n", filename);
-		goto fail_open;
+		return NULL;
 	}
 
 	if (fstat(fd, &st) < 0)
 		goto fail_nommap;
-	if ((size_t) st.st_size < sizeof(hdr))
+	if ((size_t) st.st_size < 3 * sizeof(uint32_t))
 		goto fail_nommap;
 
-	if ((idx->mm = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	if ((mm = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
 							== MAP_FAILED) {
 		ERR(ctx, "mmap(NULL, %"PRIu64", PROT_READ, %d, MAP_PRIVATE, 0): %m\n",
 							st.st_size, fd);
 		goto fail_nommap;
 	}
 
-	p = idx->mm;
-	hdr.magic = read_long_mm(&p);
-	hdr.version = read_long_mm(&p);
-	hdr.root_offset = read_long_mm(&p);
+	idx = index_mm_new(ctx, mm, st.st_size);
+	if (idx == NULL)
+		goto fail;
 
-	if (hdr.magic != INDEX_MAGIC) {
-		ERR(ctx, "magic check fail: %x instead of %x\n", hdr.magic,
-								INDEX_MAGIC);
+	close(fd);
+
+	*stamp = stat_mstamp(&st);
+
+	return idx;
+
+fail:
+	munmap(mm, st.st_size);
+fail_nommap:
+	close(fd);
+	return NULL;
+}
+
+/*
+ * Open all the @n_idx indexes in the bundle @filename, with a single mmap()
+ * shared by them. Either all of them are opened or none is.
+ */
+int index_mm_open_bundle(struct kmod_ctx *ctx, const char *filename,
+				unsigned long long *stamp,
+				struct index_mm **idx, unsigned int n_idx)
+{
+	struct index_mm_bundle *bundle;
+	struct stat st;
+	uint32_t magic, version, n_sections, i;
+	void *p;
+	int fd, err;
+
+	DBG(ctx, "file=%s\n", filename);
+
+	if ((fd = open(filename, O_RDONLY|O_CLOEXEC)) < 0) {
+		err = -errno;
+		DBG(ctx, "open(%s, O_RDONLY|O_CLOEXEC): %m\n", filename);
+		return err;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		goto fail_nobundle;
+	}
+	if ((size_t) st.st_size < 3 * sizeof(uint32_t)) {
+		err = -EINVAL;
+		goto fail_nobundle;
+	}
+
+	bundle = malloc(sizeof(*bundle));
+	if (bundle == NULL) {
+		err = -ENOMEM;
+		goto fail_nobundle;
+	}
+
+	bundle->size = st.st_size;
+	bundle->refcount = 0;
+	if ((bundle->mm = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+							== MAP_FAILED) {
+		err = -errno;
+		ERR(ctx, "mmap(NULL, %"PRIu64", PROT_READ, %d, MAP_PRIVATE, 0): %m\n",
+							st.st_size, fd);
+		goto fail_nommap;
+	}
+
+	memset(idx, 0, sizeof(*idx) * n_idx);
+
+	p = bundle->mm;
+	magic = read_long_mm(&p);
+	version = read_long_mm(&p);
+	n_sections = read_long_mm(&p);
+
+	err = -EINVAL;
+	if (magic != INDEX_BUNDLE_MAGIC) {
+		ERR(ctx, "magic check fail: %x instead of %x\n", magic,
+							INDEX_BUNDLE_MAGIC);
 		goto fail;
 	}
 
-	if (hdr.version >> 16 != INDEX_VERSION_MAJOR) {
+	if (version >> 16 != INDEX_BUNDLE_VERSION >> 16) {
 		ERR(ctx, "major version check fail: %u instead of %u\n",
-					hdr.version >> 16, INDEX_VERSION_MAJOR);
+				version >> 16, INDEX_BUNDLE_VERSION >> 16);
 		goto fail;
 	}
 
-	idx->root_offset = hdr.root_offset;
-	idx->size = st.st_size;
-	idx->ctx = ctx;
+	if (n_sections > (bundle->size - 3 * sizeof(uint32_t)) /
+						(3 * sizeof(uint32_t))) {
+		ERR(ctx, "section table too big: %u sections\n", n_sections);
+		goto fail;
+	}
+
+	for (i = 0; i < n_sections; i++) {
+		uint32_t id = read_long_mm(&p);
+		uint32_t offset = read_long_mm(&p);
+		uint32_t size = read_long_mm(&p);
+
+		/* sections for other indexes are just ignored */
+		if (id >= n_idx || idx[id] != NULL)
+			continue;
+
+		if (offset % 8 != 0 || offset > bundle->size ||
+					size > bundle->size - offset) {
+			ERR(ctx, "invalid section %u: offset=%u size=%u\n",
+							id, offset, size);
+			goto fail;
+		}
+
+		idx[id] = index_mm_new(ctx, (char *) bundle->mm + offset, size);
+		if (idx[id] == NULL)
+			goto fail;
+
+		idx[id]->bundle = bundle;
+		bundle->refcount++;
+	}
+
+	for (i = 0; i < n_idx; i++) {
+		if (idx[i] == NULL) {
+			DBG(ctx, "no section %u in %s\n", i, filename);
+			err = -ENOENT;
+			goto fail;
+		}
+	}
+
 	close(fd);
 
 	*stamp = stat_mstamp(&st);
 
-	return idx;
+	return 0;
 
 fail:
-	munmap(idx->mm, st.st_size);
+	for (i = 0; i < n_idx; i++) {
+		free(idx[i]);
+		idx[i] = NULL;
+	}
+	munmap(bundle->mm, bundle->size);
 fail_nommap:
+	free(bundle);
+fail_nobundle:
 	close(fd);
-fail_open:
-	free(idx);
-	return NULL;
+	return err;
+}
+
+size_t index_mm_get_size(const struct index_mm *idx)
+{
+	return idx->size;
 }
 
 void index_mm_close(struct index_mm *idx)
 {
-	munmap(idx->mm, idx->size);
+	struct index_mm_bundle *bundle = idx->bundle;
+
+	if (bundle == NULL) {
+		munmap(idx->mm, idx->size);
+	} else if (--bundle->refcount == 0) {
+		munmap(bundle->mm, bundle->size);
+		free(bundle);
+	}
+
 	free(idx);
 }
 
-static struct index_mm_node *index_mm_readroot(struct index_mm *idx)
+static bool index_mm_readroot(struct index_mm *idx, struct index_mm_node *root)
 {
-	return index_mm_read_node(idx, idx->root_offset);
+	return index_mm_read_node(idx, idx->root_offset, root);
+}
+
+/* v3: the child's position is the number of children before it */
+static bool index_mm_readchild_v3(const struct index_mm_node *parent, int ch,
+						struct index_mm_node *child)
+{
+	const uint32_t *map = parent->child_map;
+	uint32_t bit = 1U << (ch % 32);
+	unsigned int i, pos;
+	void *p;
+
+	if (!(map[ch / 32] & bit))
+		return false;
+
+	pos = __builtin_popcount(map[ch / 32] & (bit - 1));
+	for (i = 0; i < (unsigned int) ch / 32; i++)
+		pos += __builtin_popcount(map[i]);
+
+	p = (uint32_t *)parent->children + pos;
+
+	return index_mm_read_node(parent->idx, read_long_aligned_mm(&p),
+									child);
 }
 
-static struct index_mm_node *index_mm_readchild(const struct index_mm_node *parent,
-									int ch)
+static bool index_mm_readchild(const struct index_mm_node *parent, int ch,
+						struct index_mm_node *child)
 {
 	if (parent->first <= ch && ch <= parent->last) {
-		return index_mm_read_node(parent->idx,
-					parent->children[ch - parent->first]);
+		void *p;
+
+		if (parent->idx->version == INDEX_VERSION_MAJOR_V3)
+			return index_mm_readchild_v3(parent, ch, child);
+
+		p = (char *)parent->children +
+				sizeof(uint32_t) * (ch - parent->first);
+
+		return index_mm_read_node(parent->idx, read_long_mm(&p),
+									child);
 	}
 
-	return NULL;
+	return false;
 }
 
-static void index_mm_dump_node(struct index_mm_node *node, struct strbuf *buf,
-								int fd)
+static void index_mm_dump_node(const struct index_mm_node *node,
+						struct strbuf *buf, int fd)
 {
-	struct index_mm_value *itr, *itr_end;
+	struct index_mm_value v;
+	const void *p;
+	unsigned int i;
 	int ch, pushed;
 
 	pushed = strbuf_pushchars(buf, node->prefix);
 
-	itr = node->values.values;
-	itr_end = itr + node->values.len;
-	for (; itr < itr_end; itr++) {
+	for (i = 0, p = node->values; i < node->value_count; i++) {
+		index_mm_read_value(node, &p, &v);
 		write_str_safe(fd, buf->bytes, buf->used);
 		write_str_safe(fd, " ", 1);
-		write_str_safe(fd, itr->value, itr->len);
+		write_str_safe(fd, v.value, v.len);
 		write_str_safe(fd, "\n", 1);
 	}
 
 	for (ch = node->first; ch <= node->last; ch++) {
-		struct index_mm_node *child = index_mm_readchild(node, ch);
+		struct index_mm_node child;
 
-		if (child == NULL)
+		if (!index_mm_readchild(node, ch, &child))
 			continue;
 
 		strbuf_pushchar(buf, ch);
-		index_mm_dump_node(child, buf, fd);
+		index_mm_dump_node(&child, buf, fd);
 		strbuf_popchar(buf);
 	}
 
 	strbuf_popchars(buf, pushed);
-	index_mm_free_node(node);
 }
 
 void index_mm_dump(struct index_mm *idx, int fd, const char *prefix)
 {
-	struct index_mm_node *root;
+	struct index_mm_node root;
 	struct strbuf buf;
 
-	root = index_mm_readroot(idx);
-	if (root == NULL)
+	if (!index_mm_readroot(idx, &root))
 		return;
 
 	strbuf_init(&buf);
 	strbuf_pushchars(&buf, prefix);
-	index_mm_dump_node(root, &buf, fd);
+	index_mm_dump_node(&root, &buf, fd);
 	strbuf_release(&buf);
 }
 
-static char *index_mm_search_node(struct index_mm_node *node, const char *key,
-									int i)
+/*
+ * Of the sorted @keys, which share their first @i chars, count the ones
+ * whose char at @i is lower than @ch
+ */
+static size_t index_keys_count_below(const char * const *keys, size_t n_keys,
+						int i, unsigned int ch)
 {
-	char *value;
-	struct index_mm_node *child;
-	int ch;
+	size_t lo = 0, hi = n_keys;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if ((unsigned char) keys[mid][i] < ch)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Descend the tree with the sorted, distinct @keys, which share their first
+ * @i chars. Keys sharing a longer prefix go down together, so each node on
+ * the way is decoded once for all of them.
+ */
+static void index_mm_search_node(struct index_mm_node *node,
+				const char * const *keys, size_t n_keys, int i,
+				struct index_mm_value *values)
+{
+	struct index_mm_node child;
+	const void *p;
+	size_t first, n;
 	int j;
 
-	while(node) {
+	for (;;) {
 		for (j = 0; node->prefix[j]; j++) {
-			ch = node->prefix[j];
+			unsigned int ch = (unsigned char) node->prefix[j];
 
-			if (ch != key[i+j]) {
-				index_mm_free_node(node);
-				return NULL;
-			}
+			first = index_keys_count_below(keys, n_keys, i + j, ch);
+			n_keys = index_keys_count_below(keys, n_keys, i + j,
+							ch + 1) - first;
+			if (n_keys == 0)
+				return;
+
+			keys += first;
+			values += first;
 		}
 
 		i += j;
 
-		if (key[i] == '\0') {
-			value = node->values.len > 0
-				? strdup(node->values.values[0].value)
-				: NULL;
+		/* sorted first, there's at most one key ending here */
+		if (keys[0][i] == '\0') {
+			if (node->value_count > 0) {
+				p = node->values;
+				index_mm_read_value(node, &p, values);
+			}
 
-			index_mm_free_node(node);
-			return value;
+			if (--n_keys == 0)
+				return;
+			keys++;
+			values++;
 		}
 
-		child = index_mm_readchild(node, key[i]);
-		index_mm_free_node(node);
-		node = child;
+		/* each run of keys with the same next char takes its branch */
+		for (;;) {
+			n = index_keys_count_below(keys, n_keys, i,
+					(unsigned char) keys[0][i] + 1);
+			if (n == n_keys)
+				break;
+
+			if (index_mm_readchild(node, keys[0][i], &child))
+				index_mm_search_node(&child, keys, n, i + 1,
+									values);
+			keys += n;
+			values += n;
+			n_keys -= n;
+		}
+
+		if (!index_mm_readchild(node, keys[0][i], node))
+			return;
 		i++;
 	}
+}
 
-	return NULL;
+static bool index_mm_search_hash(struct index_mm *idx, const char *key,
+						struct index_mm_value *value)
+{
+	struct index_mm_node node;
+	const uint32_t *slot;
+	uint32_t bucket, seed, key_offset;
+	size_t keylen = strlen(key) + 1;
+	const void *p;
+
+	bucket = hash_str_seeded(key, 0) % idx->hash.n_buckets;
+	seed = ntohl(idx->hash.seeds[bucket]);
+	slot = idx->hash.slots +
+		2 * (hash_str_seeded(key, seed) % idx->hash.n_keys);
+
+	/* the slot's key may not be terminated in a corrupt index */
+	key_offset = ntohl(slot[0]);
+	if (key_offset >= idx->size || idx->size - key_offset < keylen ||
+	    memcmp((const char *)idx->mm + key_offset, key, keylen) != 0)
+		return false;
+
+	if (!index_mm_read_node(idx, ntohl(slot[1]), &node) ||
+						node.value_count == 0)
+		return false;
+
+	p = node.values;
+	index_mm_read_value(&node, &p, value);
+	return true;
 }
 
 /*
- * Search the index for a key
+ * Search the index for each of the @n_keys @keys, which must be sorted with
+ * strcmp() and distinct.
  *
- * Returns the value of the first match
- *
- * The recursive functions free their node argument (using index_close).
+ * Fills @values[i] with the first match of @keys[i], or sets its value to
+ * NULL if there's none. The values are not copied: they point inside the
+ * mmap'ed index and are valid until index_mm_close() is called. With the
+ * hash table each key is found on its own, otherwise the keys sharing a
+ * prefix share the descent of the trie.
  */
-char *index_mm_search(struct index_mm *idx, const char *key)
+void index_mm_search_many(struct index_mm *idx, const char * const *keys,
+				size_t n_keys, struct index_mm_value *values)
 {
-// FIXME: return value by reference instead of strdup
-	struct index_mm_node *root;
-	char *value;
+	struct index_mm_node root;
+	size_t i;
 
-	root = index_mm_readroot(idx);
-	value = index_mm_search_node(root, key, 0);
+	for (i = 0; i < n_keys; i++)
+		values[i].value = NULL;
 
-	return value;
+	if (idx->hash.n_keys > 0) {
+		for (i = 0; i < n_keys; i++) {
+			if (!index_mm_search_hash(idx, keys[i], &values[i]))
+				values[i].value = NULL;
+		}
+		return;
+	}
+
+	if (n_keys == 0 || !index_mm_readroot(idx, &root))
+		return;
+
+	index_mm_search_node(&root, keys, n_keys, 0, values);
+}
+
+/*
+ * Search the index for a key
+ *
+ * Fills @value with the first match and returns true if one is found. The
+ * value is not copied: it points inside the mmap'ed index and is valid
+ * until index_mm_close() is called.
+ */
+bool index_mm_search(struct index_mm *idx, const char *key,
+						struct index_mm_value *value)
+{
+	index_mm_search_many(idx, &key, 1, value);
+
+	return value->value != NULL;
 }
 
 /* Level 4: add all the values from a matching node */
-static void index_mm_searchwild_allvalues(struct index_mm_node *node,
+static void index_mm_searchwild_allvalues(const struct index_mm_node *node,
 						struct index_value **out)
 {
-	struct index_mm_value *itr, *itr_end;
-
-	itr = node->values.values;
-	itr_end = itr + node->values.len;
-	for (; itr < itr_end; itr++)
-		add_value(out, itr->value, itr->len, itr->priority);
+	struct index_mm_value v;
+	const void *p;
+	unsigned int i;
 
-	index_mm_free_node(node);
+	for (i = 0, p = node->values; i < node->value_count; i++) {
+		index_mm_read_value(node, &p, &v);
+		add_value(out, v.value, v.len, v.priority);
+	}
 }
 
 /*
  * Level 3: traverse a sub-keyspace which starts with a wildcard,
- * looking for matches.
+ * looking for matches of each key from its char @i on.
  */
-static void index_mm_searchwild_all(struct index_mm_node *node, int j,
+static void index_mm_searchwild_all(const struct index_mm_node *node, int j,
 					  struct strbuf *buf,
-					  const char *subkey,
-					  struct index_value **out)
+					  const char * const *keys,
+					  size_t n_keys, int i,
+					  struct index_value **outs)
 {
 	int pushed = 0;
+	size_t k;
 	int ch;
 
 	while (node->prefix[j]) {
@@ -973,103 +1589,263 @@ static void index_mm_searchwild_all(struct index_mm_node *node, int j,
 	}
 
 	for (ch = node->first; ch <= node->last; ch++) {
-		struct index_mm_node *child = index_mm_readchild(node, ch);
+		struct index_mm_node child;
 
-		if (!child)
+		if (!index_mm_readchild(node, ch, &child))
 			continue;
 
 		strbuf_pushchar(buf, ch);
-		index_mm_searchwild_all(child, 0, buf, subkey, out);
+		index_mm_searchwild_all(&child, 0, buf, keys, n_keys, i, outs);
 		strbuf_popchar(buf);
 	}
 
-	if (node->values.len > 0) {
-		if (fnmatch(strbuf_str(buf), subkey, 0) == 0)
-			index_mm_searchwild_allvalues(node, out);
-		else
-			index_mm_free_node(node);
-	} else {
-		index_mm_free_node(node);
+	if (node->value_count > 0) {
+		const char *pattern = strbuf_str(buf);
+
+		for (k = 0; k < n_keys; k++) {
+			if (fnmatch(pattern, &keys[k][i], 0) == 0)
+				index_mm_searchwild_allvalues(node, &outs[k]);
+		}
 	}
 
 	strbuf_popchars(buf, pushed);
 }
 
-/* Level 2: descend the tree (until we hit a wildcard) */
+/*
+ * Match a precompiled pattern, same as fnmatch(pattern, str, 0) for single
+ * byte chars. Since all the other ops match exactly one char, on mismatch
+ * it's enough to retry from the last '*' with one more char consumed by it.
+ */
+static bool index_mm_wild_match(const uint8_t *code, const char *str)
+{
+	const uint8_t *star_code = NULL;
+	const char *star_str = NULL;
+	const uint8_t *s = (const uint8_t *) str;
+
+	for (;;) {
+		switch (*code) {
+		case INDEX_WILD_END:
+			if (*s == '\0')
+				return true;
+			break;
+		case INDEX_WILD_STAR:
+			star_code = ++code;
+			star_str = (const char *) s;
+			continue;
+		case INDEX_WILD_LITERAL:
+			if (*s != '\0' && *s == code[1]) {
+				code += 2;
+				s++;
+				continue;
+			}
+			break;
+		case INDEX_WILD_ANY:
+			if (*s != '\0') {
+				code++;
+				s++;
+				continue;
+			}
+			break;
+		case INDEX_WILD_CLASS:
+			if (*s != '\0' && (code[1 + *s / 8] & (1 << (*s % 8)))) {
+				code += 1 + 32;
+				s++;
+				continue;
+			}
+			break;
+		default:
+			return false;
+		}
+
+		/* mismatch: let the last star eat one more char */
+		if (star_code == NULL || *star_str == '\0')
+			return false;
+		code = star_code;
+		s = (const uint8_t *) ++star_str;
+	}
+}
+
+/* Level 3, precompiled: run the node's bucket of patterns against each key */
+static void index_mm_searchwild_bucket(const struct index_mm_node *node,
+						const char * const *keys,
+						size_t n_keys, int i,
+						struct index_value **outs)
+{
+	void *p = (void *) node->wildcards;
+	uint32_t e, n_entries;
+
+	n_entries = read_long_aligned_mm(&p);
+
+	for (e = 0; e < n_entries; e++) {
+		uint32_t values_offset = read_long_aligned_mm(&p);
+		uint32_t len = read_long_aligned_mm(&p);
+		const uint8_t *code = p;
+		size_t k;
+
+		p = (char *)p + INDEX_ALIGN(len & ~INDEX_WILD_FNMATCH);
+
+		for (k = 0; k < n_keys; k++) {
+			uint32_t value_count;
+			bool match;
+			void *v;
+
+			if (len & INDEX_WILD_FNMATCH)
+				match = fnmatch((const char *) code,
+							&keys[k][i], 0) == 0;
+			else
+				match = index_mm_wild_match(code, &keys[k][i]);
+
+			if (!match)
+				continue;
+
+			v = (char *)node->idx->mm + values_offset;
+			value_count = read_long_aligned_mm(&v);
+			while (value_count--) {
+				unsigned int priority, vlen;
+				const char *value;
+
+				priority = read_long_aligned_mm(&v);
+				value = read_chars_aligned_mm(&v, &vlen);
+				add_value(&outs[k], value, vlen, priority);
+			}
+		}
+	}
+}
+
+/*
+ * Level 2: descend the tree (until we hit a wildcard) with the sorted,
+ * distinct @keys, which share their first @i chars. As in
+ * index_mm_search_node(), keys sharing a longer prefix go down together.
+ */
 static void index_mm_searchwild_node(struct index_mm_node *node,
 					   struct strbuf *buf,
-					   const char *key, int i,
-					   struct index_value **out)
+					   const char * const *keys,
+					   size_t n_keys, int i,
+					   struct index_value **outs)
 {
-	struct index_mm_node *child;
+	struct index_mm_node child;
+	size_t first, n;
 	int j;
 	int ch;
 
-	while(node) {
+	for (;;) {
 		for (j = 0; node->prefix[j]; j++) {
-			ch = node->prefix[j];
+			ch = (unsigned char) node->prefix[j];
 
 			if (ch == '*' || ch == '?' || ch == '[') {
-				index_mm_searchwild_all(node, j, buf,
-						      &key[i+j], out);
+				if (node->wildcards)
+					index_mm_searchwild_bucket(node, keys,
+							n_keys, i + j, outs);
+				else
+					index_mm_searchwild_all(node, j, buf,
+						keys, n_keys, i + j, outs);
 				return;
 			}
 
-			if (ch != key[i+j]) {
-				index_mm_free_node(node);
+			first = index_keys_count_below(keys, n_keys, i + j, ch);
+			n_keys = index_keys_count_below(keys, n_keys, i + j,
+							ch + 1) - first;
+			if (n_keys == 0)
 				return;
-			}
+
+			keys += first;
+			outs += first;
 		}
 
 		i += j;
 
-		child = index_mm_readchild(node, '*');
-		if (child) {
-			strbuf_pushchar(buf, '*');
-			index_mm_searchwild_all(child, 0, buf, &key[i], out);
-			strbuf_popchar(buf);
-		}
+		/* the bucket has the patterns under all the wildcard children */
+		if (node->wildcards) {
+			index_mm_searchwild_bucket(node, keys, n_keys, i, outs);
+		} else {
+			if (index_mm_readchild(node, '*', &child)) {
+				strbuf_pushchar(buf, '*');
+				index_mm_searchwild_all(&child, 0, buf,
+						keys, n_keys, i, outs);
+				strbuf_popchar(buf);
+			}
 
-		child = index_mm_readchild(node, '?');
-		if (child) {
-			strbuf_pushchar(buf, '?');
-			index_mm_searchwild_all(child, 0, buf, &key[i], out);
-			strbuf_popchar(buf);
-		}
+			if (index_mm_readchild(node, '?', &child)) {
+				strbuf_pushchar(buf, '?');
+				index_mm_searchwild_all(&child, 0, buf,
+						keys, n_keys, i, outs);
+				strbuf_popchar(buf);
+			}
 
-		child = index_mm_readchild(node, '[');
-		if (child) {
-			strbuf_pushchar(buf, '[');
-			index_mm_searchwild_all(child, 0, buf, &key[i], out);
-			strbuf_popchar(buf);
+			if (index_mm_readchild(node, '[', &child)) {
+				strbuf_pushchar(buf, '[');
+				index_mm_searchwild_all(&child, 0, buf,
+						keys, n_keys, i, outs);
+				strbuf_popchar(buf);
+			}
 		}
 
-		if (key[i] == '\0') {
-			index_mm_searchwild_allvalues(node, out);
+		/* sorted first, there's at most one key ending here */
+		if (keys[0][i] == '\0') {
+			index_mm_searchwild_allvalues(node, outs);
 
-			return;
+			if (--n_keys == 0)
+				return;
+			keys++;
+			outs++;
 		}
 
-		child = index_mm_readchild(node, key[i]);
-		index_mm_free_node(node);
-		node = child;
+		/* each run of keys with the same next char takes its branch */
+		for (;;) {
+			n = index_keys_count_below(keys, n_keys, i,
+					(unsigned char) keys[0][i] + 1);
+			if (n == n_keys)
+				break;
+
+			if (index_mm_readchild(node, keys[0][i], &child))
+				index_mm_searchwild_node(&child, buf, keys, n,
+								i + 1, outs);
+			keys += n;
+			outs += n;
+			n_keys -= n;
+		}
+
+		if (!index_mm_readchild(node, keys[0][i], node))
+			return;
 		i++;
 	}
 }
 
 /*
- * Search the index for a key.  The index may contain wildcards.
+ * Search the index for each of the @n_keys @keys, which must be sorted with
+ * strcmp() and distinct. The index may contain wildcards.
  *
- * Returns a list of all the values of matching keys.
+ * Sets @outs[i] to the list of all the values of keys matching @keys[i].
+ * The keys sharing a prefix share the descent of the trie.
  */
-struct index_value *index_mm_searchwild(struct index_mm *idx, const char *key)
+void index_mm_searchwild_many(struct index_mm *idx, const char * const *keys,
+				size_t n_keys, struct index_value **outs)
 {
-	struct index_mm_node *root = index_mm_readroot(idx);
+	struct index_mm_node root;
 	struct strbuf buf;
-	struct index_value *out = NULL;
+	size_t i;
+
+	for (i = 0; i < n_keys; i++)
+		outs[i] = NULL;
+
+	if (n_keys == 0 || !index_mm_readroot(idx, &root))
+		return;
 
 	strbuf_init(&buf);
-	index_mm_searchwild_node(root, &buf, key, 0, &out);
+	index_mm_searchwild_node(&root, &buf, keys, n_keys, 0, outs);
 	strbuf_release(&buf);
+}
+
+/*
+ * Search the index for a key.  The index may contain wildcards.
+ *
+ * Returns a list of all the values of matching keys.
+ */
+struct index_value *index_mm_searchwild(struct index_mm *idx, const char *key)
+{
+	struct index_value *out;
+
+	index_mm_searchwild_many(idx, &key, 1, &out);
+
 	return out;
 }
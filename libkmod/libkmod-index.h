@@ -20,6 +20,7 @@
 #pragma once
 
 #include <inttypes.h>
+#include <stdbool.h>
 
 struct index_value {
 	struct index_value *next;
@@ -40,9 +41,26 @@ void index_values_free(struct index_value *values);
 
 /* Implementation using mmap */
 struct index_mm;
+
+/* Value pointing inside the mmap'ed index, valid while it's not closed */
+struct index_mm_value {
+	unsigned int priority;
+	unsigned int len;
+	const char *value;
+};
+
 struct index_mm *index_mm_open(struct kmod_ctx *ctx, const char *filename,
 						unsigned long long *stamp);
+int index_mm_open_bundle(struct kmod_ctx *ctx, const char *filename,
+				unsigned long long *stamp,
+				struct index_mm **idx, unsigned int n_idx);
 void index_mm_close(struct index_mm *index);
-char *index_mm_search(struct index_mm *idx, const char *key);
+size_t index_mm_get_size(const struct index_mm *idx);
+bool index_mm_search(struct index_mm *idx, const char *key,
+						struct index_mm_value *value);
+void index_mm_search_many(struct index_mm *idx, const char * const *keys,
+				size_t n_keys, struct index_mm_value *values);
 struct index_value *index_mm_searchwild(struct index_mm *idx, const char *key);
+void index_mm_searchwild_many(struct index_mm *idx, const char * const *keys,
+				size_t n_keys, struct index_value **outs);
 void index_mm_dump(struct index_mm *idx, int fd, const char *prefix);
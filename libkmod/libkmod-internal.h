@@ -84,24 +84,46 @@ struct kmod_list *kmod_list_append_list(struct kmod_list *list1, struct kmod_lis
 		list_entry = ((list_entry == first_entry) ? NULL :	\
 		container_of(list_entry->node.prev, struct kmod_list, node)))
 
+enum kmod_file_compression_type {
+	KMOD_FILE_COMPRESSION_NONE = 0,
+	KMOD_FILE_COMPRESSION_ZSTD,
+	KMOD_FILE_COMPRESSION_XZ,
+	KMOD_FILE_COMPRESSION_ZLIB,
+};
+
 /* libkmod.c */
+struct kmod_ctx *kmod_lock(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+void kmod_unlock(struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+static inline void kmod_unlockp(struct kmod_ctx **ctx)
+{
+	if (*ctx != NULL)
+		kmod_unlock(*ctx);
+}
+#define _cleanup_kmod_unlock_ _cleanup_(kmod_unlockp)
+
 int kmod_lookup_alias_from_config(struct kmod_ctx *ctx, const char *name, struct kmod_list **list) __attribute__((nonnull(1, 2, 3)));
 int kmod_lookup_alias_from_symbols_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list) __attribute__((nonnull(1, 2, 3)));
 int kmod_lookup_alias_from_aliases_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list) __attribute__((nonnull(1, 2, 3)));
+int kmod_lookup_alias_from_aliases_file_many(struct kmod_ctx *ctx, const char * const *names, size_t n, struct kmod_list **lists) __attribute__((nonnull(1, 2, 4)));
 int kmod_lookup_alias_from_moddep_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list) __attribute__((nonnull(1, 2, 3)));
+int kmod_lookup_alias_from_moddep_file_many(struct kmod_ctx *ctx, const char * const *names, size_t n, struct kmod_list **lists) __attribute__((nonnull(1, 2, 4)));
 int kmod_lookup_alias_from_builtin_file(struct kmod_ctx *ctx, const char *name, struct kmod_list **list) __attribute__((nonnull(1, 2, 3)));
 bool kmod_lookup_alias_is_builtin(struct kmod_ctx *ctx, const char *name) __attribute__((nonnull(1, 2)));
 int kmod_lookup_alias_from_commands(struct kmod_ctx *ctx, const char *name, struct kmod_list **list) __attribute__((nonnull(1, 2, 3)));
 void kmod_set_modules_visited(struct kmod_ctx *ctx, bool visited) __attribute__((nonnull((1))));
 void kmod_set_modules_required(struct kmod_ctx *ctx, bool required) __attribute__((nonnull((1))));
 
-char *kmod_search_moddep(struct kmod_ctx *ctx, const char *name) __attribute__((nonnull(1,2)));
+const char *kmod_search_moddep(struct kmod_ctx *ctx, const char *name, char **buf) __attribute__((nonnull(1, 2, 3)));
+const char *kmod_lookup_cache_get(struct kmod_ctx *ctx, const char *key, unsigned int *n_modules) __attribute__((nonnull(1, 2, 3)));
+void kmod_lookup_cache_add(struct kmod_ctx *ctx, const char *key, const char *modules, size_t modules_len, unsigned int n_modules) __attribute__((nonnull(1, 2)));
 
 struct kmod_module *kmod_pool_get_module(struct kmod_ctx *ctx, const char *key) __attribute__((nonnull(1,2)));
 void kmod_pool_add_module(struct kmod_ctx *ctx, struct kmod_module *mod, const char *key) __attribute__((nonnull(1, 2, 3)));
 void kmod_pool_del_module(struct kmod_ctx *ctx, struct kmod_module *mod, const char *key) __attribute__((nonnull(1, 2, 3)));
 
 const struct kmod_config *kmod_get_config(const struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+enum kmod_file_compression_type kmod_get_kernel_compression(const struct kmod_ctx *ctx) __attribute__((nonnull(1)));
+int kmod_get_file_cache_dirfd(const struct kmod_ctx *ctx) __attribute__((nonnull(1)));
 
 /* libkmod-config.c */
 struct kmod_config_path {
@@ -138,20 +160,25 @@ const char * const *kmod_softdep_get_post(const struct kmod_list *l, unsigned in
 
 /* libkmod-module.c */
 int kmod_module_new_from_alias(struct kmod_ctx *ctx, const char *alias, const char *name, struct kmod_module **mod);
-int kmod_module_parse_depline(struct kmod_module *mod, char *line) __attribute__((nonnull(1, 2)));
+int kmod_module_parse_depline(struct kmod_module *mod, const char *line) __attribute__((nonnull(1, 2)));
 void kmod_module_set_install_commands(struct kmod_module *mod, const char *cmd) __attribute__((nonnull(1)));
 void kmod_module_set_remove_commands(struct kmod_module *mod, const char *cmd) __attribute__((nonnull(1)));
 void kmod_module_set_visited(struct kmod_module *mod, bool visited) __attribute__((nonnull(1)));
 void kmod_module_set_builtin(struct kmod_module *mod, bool builtin) __attribute__((nonnull((1))));
 void kmod_module_set_required(struct kmod_module *mod, bool required) __attribute__((nonnull(1)));
 bool kmod_module_is_builtin(struct kmod_module *mod) __attribute__((nonnull(1)));
+struct kmod_list *kmod_module_info_append(struct kmod_list **list, const char *key, size_t keylen, const char *value, size_t valuelen) __attribute__((nonnull(1, 2)));
+struct kmod_list *kmod_module_symbols_append(struct kmod_list **list, uint64_t crc, const char *symbol) __attribute__((nonnull(1, 3)));
+struct kmod_list *kmod_module_dependency_symbols_append(struct kmod_list **list, uint64_t crc, uint8_t bind, const char *symbol) __attribute__((nonnull(1, 4)));
 
 /* libkmod-file.c */
 struct kmod_file *kmod_file_open(const struct kmod_ctx *ctx, const char *filename) _must_check_ __attribute__((nonnull(1,2)));
+int kmod_file_load_contents(struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
 struct kmod_elf *kmod_file_get_elf(struct kmod_file *file) __attribute__((nonnull(1)));
 void *kmod_file_get_contents(const struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
 off_t kmod_file_get_size(const struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
 bool kmod_file_get_direct(const struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
+enum kmod_file_compression_type kmod_file_get_compression(const struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
 int kmod_file_get_fd(const struct kmod_file *file) _must_check_ __attribute__((nonnull(1)));
 void kmod_file_unref(struct kmod_file *file) __attribute__((nonnull(1)));
 
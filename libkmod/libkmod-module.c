@@ -39,6 +39,7 @@
 #include <linux/module.h>
 #endif
 
+#include <shared/strbuf.h>
 #include <shared/util.h>
 
 #include "libkmod.h"
@@ -107,19 +108,23 @@ struct kmod_module {
 	bool required : 1;
 };
 
-static inline const char *path_join(const char *path, size_t prefixlen,
-							char buf[PATH_MAX])
+/*
+ * Join @prefixlen bytes already in @buf with the first @pathlen bytes of
+ * @path. Absolute paths are copied after the prefix so it's kept intact for
+ * the next call.
+ */
+static inline const char *path_join(const char *path, size_t pathlen,
+					size_t prefixlen, char buf[PATH_MAX])
 {
-	size_t pathlen;
-
-	if (path[0] == '/')
-		return path;
-
-	pathlen = strlen(path);
 	if (prefixlen + pathlen + 1 >= PATH_MAX)
 		return NULL;
 
-	memcpy(buf + prefixlen, path, pathlen + 1);
+	memcpy(buf + prefixlen, path, pathlen);
+	buf[prefixlen + pathlen] = '\0';
+
+	if (path[0] == '/')
+		return buf + prefixlen;
+
 	return buf;
 }
 
@@ -134,15 +139,19 @@ static inline bool module_is_inkernel(struct kmod_module *mod)
 	return false;
 }
 
-int kmod_module_parse_depline(struct kmod_module *mod, char *line)
+/*
+ * Parse a line from modules.dep. @line is not modified, so it may point
+ * directly inside the mmap'ed index.
+ */
+int kmod_module_parse_depline(struct kmod_module *mod, const char *line)
 {
 	struct kmod_ctx *ctx = mod->ctx;
 	struct kmod_list *list = NULL;
 	const char *dirname;
 	char buf[PATH_MAX];
-	char *p, *saveptr;
+	const char *p;
 	int err = 0, n = 0;
-	size_t dirnamelen;
+	size_t dirnamelen, len;
 
 	if (mod->init.dep)
 		return mod->n_dep;
@@ -153,7 +162,6 @@ int kmod_module_parse_depline(struct kmod_module *mod, char *line)
 	if (p == NULL)
 		return 0;
 
-	*p = '\0';
 	dirname = kmod_get_dirname(mod->ctx);
 	dirnamelen = strlen(dirname);
 	if (dirnamelen + 2 >= PATH_MAX)
@@ -165,7 +173,7 @@ int kmod_module_parse_depline(struct kmod_module *mod, char *line)
 	buf[dirnamelen] = '\0';
 
 	if (mod->path == NULL) {
-		const char *str = path_join(line, dirnamelen, buf);
+		const char *str = path_join(line, p - line, dirnamelen, buf);
 		if (str == NULL)
 			return 0;
 		mod->path = strdup(str);
@@ -173,16 +181,19 @@ int kmod_module_parse_depline(struct kmod_module *mod, char *line)
 			return 0;
 	}
 
-	p++;
-	for (p = strtok_r(p, " \t", &saveptr); p != NULL;
-					p = strtok_r(NULL, " \t", &saveptr)) {
+	for (p++;; p += len) {
 		struct kmod_module *depmod = NULL;
 		const char *path;
 
-		path = path_join(p, dirnamelen, buf);
+		p += strspn(p, " \t");
+		len = strcspn(p, " \t");
+		if (len == 0)
+			break;
+
+		path = path_join(p, len, dirnamelen, buf);
 		if (path == NULL) {
-			ERR(ctx, "could not join path '%s' and '%s'.\n",
-			    dirname, p);
+			ERR(ctx, "could not join path '%s' and '%.*s'.\n",
+			    dirname, (int) len, p);
 			goto fail;
 		}
 
@@ -229,13 +240,42 @@ void kmod_module_set_required(struct kmod_module *mod, bool required)
 
 bool kmod_module_is_builtin(struct kmod_module *mod)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = kmod_lock(mod->ctx);
+
 	if (mod->builtin == KMOD_MODULE_BUILTIN_UNKNOWN) {
-		kmod_module_set_builtin(mod,
-					kmod_lookup_alias_is_builtin(mod->ctx, mod->name));
+		bool builtin;
+
+		kmod_unlock(locked);
+		builtin = kmod_lookup_alias_is_builtin(mod->ctx, mod->name);
+		kmod_lock(locked);
+
+		if (mod->builtin == KMOD_MODULE_BUILTIN_UNKNOWN)
+			kmod_module_set_builtin(mod, builtin);
 	}
 
 	return mod->builtin == KMOD_MODULE_BUILTIN_YES;
 }
+
+/*
+ * Take a reference of @mod, found in the pool with the lock held, unless
+ * another thread is releasing it: then it's about to leave the pool and
+ * must be treated as not found.
+ */
+static bool kmod_module_ref_pooled(struct kmod_module *mod)
+{
+	int refcount = __atomic_load_n(&mod->refcount, __ATOMIC_SEQ_CST);
+
+	do {
+		if (refcount == 0)
+			return false;
+	} while (!__atomic_compare_exchange_n(&mod->refcount, &refcount,
+						refcount + 1, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST));
+
+	return true;
+}
+
 /*
  * Memory layout with alias:
  *
@@ -264,12 +304,13 @@ static int kmod_module_new(struct kmod_ctx *ctx, const char *key,
 				const char *alias, size_t aliaslen,
 				struct kmod_module **mod)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = kmod_lock(ctx);
 	struct kmod_module *m;
 	size_t keylen;
 
 	m = kmod_pool_get_module(ctx, key);
-	if (m != NULL) {
-		*mod = kmod_module_ref(m);
+	if (m != NULL && kmod_module_ref_pooled(m)) {
+		*mod = m;
 		return 0;
 	}
 
@@ -388,6 +429,7 @@ KMOD_EXPORT int kmod_module_new_from_path(struct kmod_ctx *ctx,
 						const char *path,
 						struct kmod_module **mod)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	struct kmod_module *m;
 	int err;
 	struct stat st;
@@ -418,8 +460,10 @@ KMOD_EXPORT int kmod_module_new_from_path(struct kmod_ctx *ctx,
 		return -ENOENT;
 	}
 
+	locked = kmod_lock(ctx);
+
 	m = kmod_pool_get_module(ctx, name);
-	if (m != NULL) {
+	if (m != NULL && kmod_module_ref_pooled(m)) {
 		if (m->path == NULL)
 			m->path = abspath;
 		else if (streq(m->path, abspath))
@@ -428,10 +472,11 @@ KMOD_EXPORT int kmod_module_new_from_path(struct kmod_ctx *ctx,
 			ERR(ctx, "kmod_module '%s' already exists with different path: new-path='%s' old-path='%s'\n",
 							name, abspath, m->path);
 			free(abspath);
+			kmod_module_unref(m);
 			return -EEXIST;
 		}
 
-		*mod = kmod_module_ref(m);
+		*mod = m;
 		return 0;
 	}
 
@@ -462,12 +507,20 @@ KMOD_EXPORT struct kmod_module *kmod_module_unref(struct kmod_module *mod)
 	if (mod == NULL)
 		return NULL;
 
-	if (--mod->refcount > 0)
+	if (__atomic_sub_fetch(&mod->refcount, 1, __ATOMIC_SEQ_CST) > 0)
 		return mod;
 
 	DBG(mod->ctx, "kmod_module %p released\n", mod);
 
+	/*
+	 * Only the pool needs the lock: once out of it nobody else can get a
+	 * reference. The last reference to ctx may be dropped below, so it
+	 * can't be held until the end.
+	 */
+	kmod_lock(mod->ctx);
 	kmod_pool_del_module(mod->ctx, mod, mod->hashkey);
+	kmod_unlock(mod->ctx);
+
 	kmod_module_unref_list(mod->dep);
 
 	if (mod->file)
@@ -493,18 +546,251 @@ KMOD_EXPORT struct kmod_module *kmod_module_ref(struct kmod_module *mod)
 	if (mod == NULL)
 		return NULL;
 
-	mod->refcount++;
+	__atomic_add_fetch(&mod->refcount, 1, __ATOMIC_SEQ_CST);
 
 	return mod;
 }
 
-#define CHECK_ERR_AND_FINISH(_err, _label_err, _list, label_finish)	\
-	do {								\
-		if ((_err) < 0)						\
-			goto _label_err;				\
-		if (*(_list) != NULL)					\
-			goto finish;					\
-	} while (0)
+/* Recreate the list of modules of a cached lookup */
+static int module_lookup_cached(struct kmod_ctx *ctx, const char *modules,
+				unsigned int n_modules, struct kmod_list **list)
+{
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < n_modules; i++) {
+		const char *name = modules;
+		const char *alias = name + strlen(name) + 1;
+		struct kmod_module *mod;
+		struct kmod_list *l;
+
+		modules = alias + strlen(alias) + 1;
+
+		if (alias[0] != '\0')
+			err = kmod_module_new_from_alias(ctx, alias, name, &mod);
+		else
+			err = kmod_module_new_from_name(ctx, name, &mod);
+		if (err < 0)
+			goto fail;
+
+		l = kmod_list_append(*list, mod);
+		if (l == NULL) {
+			kmod_module_unref(mod);
+			err = -ENOMEM;
+			goto fail;
+		}
+		*list = l;
+	}
+
+	return 0;
+
+fail:
+	kmod_module_unref_list(*list);
+	*list = NULL;
+	return err;
+}
+
+static void module_lookup_cache_add(struct kmod_ctx *ctx, const char *alias,
+						const struct kmod_list *list)
+{
+	const struct kmod_list *l;
+	struct strbuf buf;
+	unsigned int n_modules = 0;
+
+	strbuf_init(&buf);
+
+	kmod_list_foreach(l, list) {
+		const struct kmod_module *mod = l->data;
+
+		if (!strbuf_pushchars(&buf, mod->name) ||
+				!strbuf_pushchar(&buf, '\0') ||
+				(mod->alias != NULL &&
+				 !strbuf_pushchars(&buf, mod->alias)) ||
+				!strbuf_pushchar(&buf, '\0'))
+			goto out;
+		n_modules++;
+	}
+
+	kmod_lookup_cache_add(ctx, alias, buf.bytes, buf.used, n_modules);
+out:
+	strbuf_release(&buf);
+}
+
+/*
+ * An already normalized alias being looked up. The aliases looked up
+ * together are sorted and distinct.
+ */
+struct lookup_key {
+	const char *alias;
+	struct kmod_list *list;
+	bool done;
+	bool cached;
+};
+
+/* Lookup each of the aliases not found yet with @lookup */
+static int module_lookup_each(struct kmod_ctx *ctx, struct lookup_key *keys,
+				unsigned int n_keys, const char *what,
+				int (*lookup)(struct kmod_ctx *ctx,
+						const char *name,
+						struct kmod_list **list))
+{
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < n_keys; i++) {
+		if (keys[i].done)
+			continue;
+
+		DBG(ctx, "lookup %s %s\n", what, keys[i].alias);
+		err = lookup(ctx, keys[i].alias, &keys[i].list);
+		if (err < 0)
+			return err;
+
+		keys[i].done = keys[i].list != NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Lookup all the aliases not found yet at once with @lookup. @names and
+ * @lists are scratch arrays with room for all the keys.
+ */
+static int module_lookup_batch(struct kmod_ctx *ctx, struct lookup_key *keys,
+				unsigned int n_keys, const char *what,
+				int (*lookup)(struct kmod_ctx *ctx,
+						const char * const *names,
+						size_t n,
+						struct kmod_list **lists),
+				const char **names, struct kmod_list **lists)
+{
+	unsigned int i, n = 0;
+	int err;
+
+	for (i = 0; i < n_keys; i++) {
+		if (keys[i].done)
+			continue;
+
+		names[n] = keys[i].alias;
+		lists[n] = NULL;
+		n++;
+	}
+
+	if (n == 0)
+		return 0;
+
+	DBG(ctx, "lookup %s for %u aliases\n", what, n);
+	err = lookup(ctx, names, n, lists);
+
+	/* even on failure, so that the caller releases them */
+	for (i = 0, n = 0; i < n_keys; i++) {
+		if (keys[i].done)
+			continue;
+
+		keys[i].list = lists[n++];
+		keys[i].done = keys[i].list != NULL;
+	}
+
+	return err;
+}
+
+/*
+ * Lookup the aliases in @keys in the order documented below. Each step only
+ * looks for the aliases the previous ones didn't find. modules.dep and
+ * modules.alias are searched for all of them in a single walk, sharing the
+ * descent of the trie among the aliases with a common prefix. @names and
+ * @lists are scratch arrays with room for all the keys.
+ *
+ * On failure the lists found so far are left in @keys, to be released by
+ * the caller.
+ */
+static int module_lookup_keys(struct kmod_ctx *ctx, struct lookup_key *keys,
+				unsigned int n_keys, const char **names,
+				struct kmod_list **lists)
+{
+	const char *cached;
+	unsigned int i, n_cached;
+	int err = 0;
+
+	/* The indexes are searched unlocked, only the cache needs the lock */
+	kmod_lock(ctx);
+	for (i = 0; i < n_keys && err >= 0; i++) {
+		cached = kmod_lookup_cache_get(ctx, keys[i].alias, &n_cached);
+		if (cached == NULL)
+			continue;
+
+		err = module_lookup_cached(ctx, cached, n_cached,
+							&keys[i].list);
+		keys[i].done = true;
+		keys[i].cached = true;
+	}
+	kmod_unlock(ctx);
+	if (err < 0)
+		return err;
+
+	/* Aliases from config file override all the others */
+	err = module_lookup_each(ctx, keys, n_keys, "config",
+					kmod_lookup_alias_from_config);
+	if (err < 0)
+		return err;
+
+	err = module_lookup_batch(ctx, keys, n_keys, "modules.dep",
+				kmod_lookup_alias_from_moddep_file_many,
+				names, lists);
+	if (err < 0)
+		return err;
+
+	err = module_lookup_each(ctx, keys, n_keys, "modules.symbols",
+					kmod_lookup_alias_from_symbols_file);
+	if (err < 0)
+		return err;
+
+	err = module_lookup_each(ctx, keys, n_keys,
+					"install and remove commands",
+					kmod_lookup_alias_from_commands);
+	if (err < 0)
+		return err;
+
+	err = module_lookup_batch(ctx, keys, n_keys, "modules.aliases",
+				kmod_lookup_alias_from_aliases_file_many,
+				names, lists);
+	if (err < 0)
+		return err;
+
+	err = module_lookup_each(ctx, keys, n_keys, "modules.builtin",
+					kmod_lookup_alias_from_builtin_file);
+	if (err < 0)
+		return err;
+
+	for (i = 0; i < n_keys; i++) {
+		DBG(ctx, "lookup %s list=%p\n", keys[i].alias, keys[i].list);
+		if (!keys[i].cached)
+			module_lookup_cache_add(ctx, keys[i].alias,
+							keys[i].list);
+	}
+
+	return 0;
+}
+
+/* Lookup an already normalized alias */
+static int module_lookup(struct kmod_ctx *ctx, const char *alias,
+						struct kmod_list **list)
+{
+	struct lookup_key key = { .alias = alias };
+	struct kmod_list *scratch_list;
+	const char *scratch_name;
+	int err;
+
+	err = module_lookup_keys(ctx, &key, 1, &scratch_name, &scratch_list);
+	if (err < 0) {
+		DBG(ctx, "Failed to lookup %s\n", alias);
+		kmod_module_unref_list(key.list);
+		return err;
+	}
+
+	*list = key.list;
+	return 0;
+}
 
 /**
  * kmod_module_new_from_lookup:
@@ -537,7 +823,6 @@ KMOD_EXPORT int kmod_module_new_from_lookup(struct kmod_ctx *ctx,
 						const char *given_alias,
 						struct kmod_list **list)
 {
-	int err;
 	char alias[PATH_MAX];
 
 	if (ctx == NULL || given_alias == NULL)
@@ -555,40 +840,177 @@ KMOD_EXPORT int kmod_module_new_from_lookup(struct kmod_ctx *ctx,
 
 	DBG(ctx, "input alias=%s, normalized=%s\n", given_alias, alias);
 
-	/* Aliases from config file override all the others */
-	err = kmod_lookup_alias_from_config(ctx, alias, list);
-	CHECK_ERR_AND_FINISH(err, fail, list, finish);
+	return module_lookup(ctx, alias, list);
+}
+
+static int module_list_copy(const struct kmod_list *from,
+						struct kmod_list **to)
+{
+	const struct kmod_list *l;
+
+	kmod_list_foreach(l, from) {
+		struct kmod_module *mod = l->data;
+		struct kmod_list *n;
+
+		n = kmod_list_append(*to, mod);
+		if (n == NULL)
+			return -ENOMEM;
+
+		kmod_module_ref(mod);
+		*to = n;
+	}
+
+	return 0;
+}
+
+/* A normalized alias and its position in the caller's array */
+struct lookup_alias {
+	char *alias;
+	unsigned int pos;
+};
+
+static int lookup_alias_cmp(const void *a, const void *b)
+{
+	const struct lookup_alias *la = a;
+	const struct lookup_alias *lb = b;
+
+	return strcmp(la->alias, lb->alias);
+}
+
+/**
+ * kmod_module_new_from_lookup_many:
+ * @ctx: kmod library context
+ * @given_aliases: array of aliases to look for
+ * @n_aliases: number of entries in @given_aliases
+ * @lists: array of @n_aliases empty lists where to save the modules
+ * matching each alias
+ *
+ * Same as calling kmod_module_new_from_lookup() for each alias in
+ * @given_aliases, saving the result for @given_aliases[i] in @lists[i], but
+ * in a single pass meant for callers resolving the aliases of many devices
+ * at once, like the coldplug of all devices in the system. The aliases are
+ * normalized and sorted, equal ones are looked up only once and the
+ * modules.dep and modules.alias indexes are searched for all of them in a
+ * single walk, sharing the descent of the trie among the aliases with a
+ * common prefix. The same kmod_module is shared by all the lists it's in,
+ * each one holding its own reference.
+ *
+ * An alias that can't be normalized is not an error: its list is left
+ * empty, as it is for aliases that are not found.
+ *
+ * Each list in @lists must be released by calling kmod_module_unref_list().
+ *
+ * Returns: 0 on success or < 0 otherwise. On failure all the lists are
+ * released and set to NULL.
+ */
+KMOD_EXPORT int kmod_module_new_from_lookup_many(struct kmod_ctx *ctx,
+						const char * const *given_aliases,
+						unsigned int n_aliases,
+						struct kmod_list **lists)
+{
+	struct lookup_alias *aliases;
+	struct lookup_key *keys;
+	struct kmod_list **scratch_lists;
+	const char **scratch_names;
+	unsigned int *key_of;
+	unsigned int i, n_valid = 0, n_keys = 0;
+	int err = 0;
 
-	DBG(ctx, "lookup modules.dep %s\n", alias);
-	err = kmod_lookup_alias_from_moddep_file(ctx, alias, list);
-	CHECK_ERR_AND_FINISH(err, fail, list, finish);
+	if (ctx == NULL || given_aliases == NULL)
+		return -ENOENT;
+
+	if (lists == NULL) {
+		ERR(ctx, "An array of empty lists is needed to create lookup\n");
+		return -ENOSYS;
+	}
+
+	for (i = 0; i < n_aliases; i++) {
+		if (lists[i] != NULL) {
+			ERR(ctx, "An array of empty lists is needed to create lookup\n");
+			return -ENOSYS;
+		}
+	}
+
+	if (n_aliases == 0)
+		return 0;
 
-	DBG(ctx, "lookup modules.symbols %s\n", alias);
-	err = kmod_lookup_alias_from_symbols_file(ctx, alias, list);
-	CHECK_ERR_AND_FINISH(err, fail, list, finish);
+	aliases = calloc(n_aliases, sizeof(*aliases));
+	keys = calloc(n_aliases, sizeof(*keys));
+	scratch_lists = calloc(n_aliases, sizeof(*scratch_lists));
+	scratch_names = calloc(n_aliases, sizeof(*scratch_names));
+	key_of = calloc(n_aliases, sizeof(*key_of));
+	if (aliases == NULL || keys == NULL || scratch_lists == NULL ||
+			scratch_names == NULL || key_of == NULL) {
+		err = -ENOMEM;
+		goto finish;
+	}
+
+	for (i = 0; i < n_aliases; i++) {
+		char alias[PATH_MAX];
 
-	DBG(ctx, "lookup install and remove commands %s\n", alias);
-	err = kmod_lookup_alias_from_commands(ctx, alias, list);
-	CHECK_ERR_AND_FINISH(err, fail, list, finish);
+		key_of[i] = UINT_MAX;
 
-	DBG(ctx, "lookup modules.aliases %s\n", alias);
-	err = kmod_lookup_alias_from_aliases_file(ctx, alias, list);
-	CHECK_ERR_AND_FINISH(err, fail, list, finish);
+		if (given_aliases[i] == NULL ||
+			alias_normalize(given_aliases[i], alias, NULL) < 0) {
+			DBG(ctx, "invalid alias #%u: %s\n", i,
+				given_aliases[i] ? given_aliases[i] : "(null)");
+			continue;
+		}
 
-	DBG(ctx, "lookup modules.builtin %s\n", alias);
-	err = kmod_lookup_alias_from_builtin_file(ctx, alias, list);
-	CHECK_ERR_AND_FINISH(err, fail, list, finish);
+		DBG(ctx, "input alias=%s, normalized=%s\n",
+						given_aliases[i], alias);
+
+		aliases[n_valid].alias = strdup(alias);
+		if (aliases[n_valid].alias == NULL) {
+			err = -ENOMEM;
+			goto finish;
+		}
+		aliases[n_valid].pos = i;
+		n_valid++;
+	}
+
+	qsort(aliases, n_valid, sizeof(*aliases), lookup_alias_cmp);
+
+	for (i = 0; i < n_valid; i++) {
+		if (n_keys == 0 ||
+			!streq(keys[n_keys - 1].alias, aliases[i].alias))
+			keys[n_keys++].alias = aliases[i].alias;
+
+		key_of[aliases[i].pos] = n_keys - 1;
+	}
+
+	err = module_lookup_keys(ctx, keys, n_keys, scratch_names,
+							scratch_lists);
+
+	for (i = 0; i < n_aliases && err >= 0; i++) {
+		if (key_of[i] != UINT_MAX)
+			err = module_list_copy(keys[key_of[i]].list, &lists[i]);
+	}
 
 finish:
-	DBG(ctx, "lookup %s=%d, list=%p\n", alias, err, *list);
-	return err;
-fail:
-	DBG(ctx, "Failed to lookup %s\n", alias);
-	kmod_module_unref_list(*list);
-	*list = NULL;
+	if (err < 0) {
+		for (i = 0; i < n_aliases; i++) {
+			kmod_module_unref_list(lists[i]);
+			lists[i] = NULL;
+		}
+	}
+
+	if (keys != NULL) {
+		for (i = 0; i < n_keys; i++)
+			kmod_module_unref_list(keys[i].list);
+	}
+	if (aliases != NULL) {
+		for (i = 0; i < n_valid; i++)
+			free(aliases[i].alias);
+	}
+	free(key_of);
+	free(scratch_names);
+	free(scratch_lists);
+	free(keys);
+	free(aliases);
+
 	return err;
 }
-#undef CHECK_ERR_AND_FINISH
 
 /**
  * kmod_module_unref_list:
@@ -628,17 +1050,22 @@ KMOD_EXPORT int kmod_module_get_filtered_blacklist(const struct kmod_ctx *ctx,
 	return kmod_module_apply_filter(ctx, KMOD_FILTER_BLACKLIST, input, output);
 }
 
+/* Called with the lock held, which is dropped while searching the index */
 static const struct kmod_list *module_get_dependencies_noref(const struct kmod_module *mod)
 {
 	if (!mod->init.dep) {
 		/* lazy init */
-		char *line = kmod_search_moddep(mod->ctx, mod->name);
+		_cleanup_free_ char *buf = NULL;
+		const char *line;
+
+		kmod_unlock(mod->ctx);
+		line = kmod_search_moddep(mod->ctx, mod->name, &buf);
+		kmod_lock(mod->ctx);
 
 		if (line == NULL)
 			return NULL;
 
 		kmod_module_parse_depline((struct kmod_module *)mod, line);
-		free(line);
 
 		if (!mod->init.dep)
 			return NULL;
@@ -660,11 +1087,14 @@ static const struct kmod_list *module_get_dependencies_noref(const struct kmod_m
  */
 KMOD_EXPORT struct kmod_list *kmod_module_get_dependencies(const struct kmod_module *mod)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	struct kmod_list *l, *l_new, *list_new = NULL;
 
 	if (mod == NULL)
 		return NULL;
 
+	locked = kmod_lock(mod->ctx);
+
 	module_get_dependencies_noref(mod);
 
 	kmod_list_foreach(l, mod->dep) {
@@ -736,11 +1166,15 @@ KMOD_EXPORT const char *kmod_module_get_name(const struct kmod_module *mod)
  */
 KMOD_EXPORT const char *kmod_module_get_path(const struct kmod_module *mod)
 {
-	char *line;
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
+	_cleanup_free_ char *buf = NULL;
+	const char *line;
 
 	if (mod == NULL)
 		return NULL;
 
+	locked = kmod_lock(mod->ctx);
+
 	DBG(mod->ctx, "name='%s' path='%s'\n", mod->name, mod->path);
 
 	if (mod->path != NULL)
@@ -748,13 +1182,14 @@ KMOD_EXPORT const char *kmod_module_get_path(const struct kmod_module *mod)
 	if (mod->init.dep)
 		return NULL;
 
-	/* lazy init */
-	line = kmod_search_moddep(mod->ctx, mod->name);
+	/* lazy init, kmod_module_parse_depline() ignores a second one */
+	kmod_unlock(locked);
+	line = kmod_search_moddep(mod->ctx, mod->name, &buf);
+	kmod_lock(locked);
 	if (line == NULL)
 		return NULL;
 
 	kmod_module_parse_depline((struct kmod_module *) mod, line);
-	free(line);
 
 	return mod->path;
 }
@@ -798,6 +1233,20 @@ KMOD_EXPORT int kmod_module_remove_module(struct kmod_module *mod,
 
 extern long init_module(const void *mem, unsigned long len, const char *args);
 
+/* The file may be shared, so load it under the context's lock */
+static int module_file_load_contents(struct kmod_module *mod)
+{
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = kmod_lock(mod->ctx);
+	int err;
+
+	err = kmod_file_load_contents(mod->file);
+	if (err < 0)
+		ERR(mod->ctx, "could not load module '%s': %s\n",
+					mod->name, strerror(-err));
+
+	return err;
+}
+
 /**
  * kmod_module_insert_module:
  * @mod: kmod module
@@ -807,8 +1256,10 @@ extern long init_module(const void *mem, unsigned long len, const char *args);
  * KMOD_INSERT_FORCE_MODVERSION: ignore symbol version hashes.
  * @options: module's options to pass to Linux Kernel.
  *
- * Insert a module in Linux kernel. It opens the file pointed by @mod,
- * mmap'ing it and passing to kernel.
+ * Insert a module in Linux kernel. It opens the file pointed by @mod and
+ * passes its fd to the kernel, also when it's compressed with what the
+ * kernel can decompress itself. Otherwise the file is decompressed or
+ * mmap'ed here and its contents are passed instead.
  *
  * Returns: 0 on success or < 0 on failure. If module is already loaded it
  * returns -EEXIST.
@@ -817,12 +1268,14 @@ KMOD_EXPORT int kmod_module_insert_module(struct kmod_module *mod,
 							unsigned int flags,
 							const char *options)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	int err;
 	const void *mem;
 	off_t size;
 	struct kmod_elf *elf;
 	const char *path;
 	const char *args = options ? options : "";
+	enum kmod_file_compression_type compression;
 
 	if (mod == NULL)
 		return -ENOENT;
@@ -833,6 +1286,7 @@ KMOD_EXPORT int kmod_module_insert_module(struct kmod_module *mod,
 		return -ENOENT;
 	}
 
+	locked = kmod_lock(mod->ctx);
 	if (!mod->file) {
 		mod->file = kmod_file_open(mod->ctx, path);
 		if (mod->file == NULL) {
@@ -841,19 +1295,40 @@ KMOD_EXPORT int kmod_module_insert_module(struct kmod_module *mod,
 		}
 	}
 
-	if (kmod_file_get_direct(mod->file)) {
+	/*
+	 * Don't hold the lock while the kernel runs the module's init, unless
+	 * the file is going to be modified
+	 */
+	if (!(flags & (KMOD_INSERT_FORCE_VERMAGIC | KMOD_INSERT_FORCE_MODVERSION))) {
+		kmod_unlock(locked);
+		locked = NULL;
+	}
+
+	/*
+	 * Hand the fd to the kernel if the module isn't compressed, or is
+	 * compressed with what the kernel knows how to decompress
+	 */
+	compression = kmod_file_get_compression(mod->file);
+	if (compression == KMOD_FILE_COMPRESSION_NONE ||
+	    compression == kmod_get_kernel_compression(mod->ctx)) {
 		unsigned int kernel_flags = 0;
 
 		if (flags & KMOD_INSERT_FORCE_VERMAGIC)
 			kernel_flags |= MODULE_INIT_IGNORE_VERMAGIC;
 		if (flags & KMOD_INSERT_FORCE_MODVERSION)
 			kernel_flags |= MODULE_INIT_IGNORE_MODVERSIONS;
+		if (compression != KMOD_FILE_COMPRESSION_NONE)
+			kernel_flags |= MODULE_INIT_COMPRESSED_FILE;
 
 		err = finit_module(kmod_file_get_fd(mod->file), args, kernel_flags);
 		if (err == 0 || errno != ENOSYS)
 			goto init_finished;
 	}
 
+	err = module_file_load_contents(mod);
+	if (err < 0)
+		return err;
+
 	if (flags & (KMOD_INSERT_FORCE_VERMAGIC | KMOD_INSERT_FORCE_MODVERSION)) {
 		elf = kmod_file_get_elf(mod->file);
 		if (elf == NULL) {
@@ -1243,8 +1718,14 @@ KMOD_EXPORT int kmod_module_probe_insert_module(struct kmod_module *mod,
 						bool install,
 						const char *options))
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	struct kmod_list *list = NULL, *l;
 	struct probe_insert_cb cb;
+	struct {
+		bool required : 1;
+		bool ignorecmd : 1;
+	} *probe_flags;
+	unsigned int i, n_probe;
 	int err;
 
 	if (mod == NULL)
@@ -1271,6 +1752,12 @@ KMOD_EXPORT int kmod_module_probe_insert_module(struct kmod_module *mod,
 			return err;
 	}
 
+	/*
+	 * ->visited, ->required and ->ignorecmd are shared by all the probes
+	 * in ctx, so they are copied while holding the lock
+	 */
+	locked = kmod_lock(mod->ctx);
+
 	err = kmod_module_get_probe_list(mod,
 				!!(flags & KMOD_PROBE_IGNORE_COMMAND), &list);
 	if (err < 0)
@@ -1291,15 +1778,42 @@ KMOD_EXPORT int kmod_module_probe_insert_module(struct kmod_module *mod,
 		list = filtered;
 	}
 
+	n_probe = 0;
+	kmod_list_foreach(l, list)
+		n_probe++;
+
+	probe_flags = malloc(n_probe * sizeof(*probe_flags) + 1);
+	if (probe_flags == NULL) {
+		kmod_module_unref_list(list);
+		return -ENOMEM;
+	}
+
+	i = 0;
+	kmod_list_foreach(l, list) {
+		struct kmod_module *m = l->data;
+
+		probe_flags[i].required = m->required;
+		probe_flags[i].ignorecmd = m->ignorecmd;
+		i++;
+	}
+
+	kmod_unlock(locked);
+	locked = NULL;
+
 	cb.run_install = run_install;
 	cb.data = (void *) data;
 
+	i = 0;
 	kmod_list_foreach(l, list) {
 		struct kmod_module *m = l->data;
 		const char *moptions = kmod_module_get_options(m);
 		const char *cmd = kmod_module_get_install_commands(m);
+		bool required = probe_flags[i].required;
+		bool ignorecmd = probe_flags[i].ignorecmd;
 		char *options;
 
+		i++;
+
 		if (!(flags & KMOD_PROBE_IGNORE_LOADED)
 						&& module_is_inkernel(m)) {
 			DBG(mod->ctx, "Ignoring module '%s': already loaded\n",
@@ -1311,7 +1825,7 @@ KMOD_EXPORT int kmod_module_probe_insert_module(struct kmod_module *mod,
 		options = module_options_concat(moptions,
 					m == mod ? extra_options : NULL);
 
-		if (cmd != NULL && !m->ignorecmd) {
+		if (cmd != NULL && !ignorecmd) {
 			if (print_action != NULL)
 				print_action(m, true, options ?: "");
 
@@ -1347,13 +1861,14 @@ finish_module:
 		/*
 		 * Ignore errors from softdeps
 		 */
-		if (err == -EEXIST || !m->required)
+		if (err == -EEXIST || !required)
 			err = 0;
 
 		else if (err < 0)
 			break;
 	}
 
+	free(probe_flags);
 	kmod_module_unref_list(list);
 	return err;
 }
@@ -1371,9 +1886,12 @@ finish_module:
  */
 KMOD_EXPORT const char *kmod_module_get_options(const struct kmod_module *mod)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	if (mod == NULL)
 		return NULL;
 
+	locked = kmod_lock(mod->ctx);
+
 	if (!mod->init.options) {
 		/* lazy init */
 		struct kmod_module *m = (struct kmod_module *)mod;
@@ -1446,9 +1964,12 @@ failed:
  */
 KMOD_EXPORT const char *kmod_module_get_install_commands(const struct kmod_module *mod)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	if (mod == NULL)
 		return NULL;
 
+	locked = kmod_lock(mod->ctx);
+
 	if (!mod->init.install_commands) {
 		/* lazy init */
 		struct kmod_module *m = (struct kmod_module *)mod;
@@ -1575,9 +2096,12 @@ KMOD_EXPORT int kmod_module_get_softdeps(const struct kmod_module *mod,
  */
 KMOD_EXPORT const char *kmod_module_get_remove_commands(const struct kmod_module *mod)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	if (mod == NULL)
 		return NULL;
 
+	locked = kmod_lock(mod->ctx);
+
 	if (!mod->init.remove_commands) {
 		/* lazy init */
 		struct kmod_module *m = (struct kmod_module *)mod;
@@ -2177,7 +2701,7 @@ static void kmod_module_info_free(struct kmod_module_info *info)
 	free(info);
 }
 
-static struct kmod_list *kmod_module_info_append(struct kmod_list **list, const char *key, size_t keylen, const char *value, size_t valuelen)
+struct kmod_list *kmod_module_info_append(struct kmod_list **list, const char *key, size_t keylen, const char *value, size_t valuelen)
 {
 	struct kmod_module_info *info;
 	struct kmod_list *n;
@@ -2213,6 +2737,7 @@ static struct kmod_list *kmod_module_info_append(struct kmod_list **list, const
  */
 KMOD_EXPORT int kmod_module_get_info(const struct kmod_module *mod, struct kmod_list **list)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	struct kmod_elf *elf;
 	char **strings;
 	int i, count, ret = -ENOMEM;
@@ -2223,6 +2748,8 @@ KMOD_EXPORT int kmod_module_get_info(const struct kmod_module *mod, struct kmod_
 
 	assert(*list == NULL);
 
+	locked = kmod_lock(mod->ctx);
+
 	elf = kmod_module_get_elf(mod);
 	if (elf == NULL)
 		return -errno;
@@ -2411,6 +2938,7 @@ static void kmod_module_version_free(struct kmod_module_version *version)
  */
 KMOD_EXPORT int kmod_module_get_versions(const struct kmod_module *mod, struct kmod_list **list)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	struct kmod_elf *elf;
 	struct kmod_modversion *versions;
 	int i, count, ret = 0;
@@ -2420,6 +2948,8 @@ KMOD_EXPORT int kmod_module_get_versions(const struct kmod_module *mod, struct k
 
 	assert(*list == NULL);
 
+	locked = kmod_lock(mod->ctx);
+
 	elf = kmod_module_get_elf(mod);
 	if (elf == NULL)
 		return -errno;
@@ -2536,6 +3066,22 @@ static void kmod_module_symbol_free(struct kmod_module_symbol *symbol)
 	free(symbol);
 }
 
+struct kmod_list *kmod_module_symbols_append(struct kmod_list **list, uint64_t crc, const char *symbol)
+{
+	struct kmod_module_symbol *mv;
+	struct kmod_list *n;
+
+	mv = kmod_module_symbols_new(crc, symbol);
+	if (mv == NULL)
+		return NULL;
+	n = kmod_list_append(*list, mv);
+	if (n != NULL)
+		*list = n;
+	else
+		kmod_module_symbol_free(mv);
+	return n;
+}
+
 /**
  * kmod_module_get_symbols:
  * @mod: kmod module
@@ -2552,6 +3098,7 @@ static void kmod_module_symbol_free(struct kmod_module_symbol *symbol)
  */
 KMOD_EXPORT int kmod_module_get_symbols(const struct kmod_module *mod, struct kmod_list **list)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	struct kmod_elf *elf;
 	struct kmod_modversion *symbols;
 	int i, count, ret = 0;
@@ -2561,6 +3108,8 @@ KMOD_EXPORT int kmod_module_get_symbols(const struct kmod_module *mod, struct km
 
 	assert(*list == NULL);
 
+	locked = kmod_lock(mod->ctx);
+
 	elf = kmod_module_get_elf(mod);
 	if (elf == NULL)
 		return -errno;
@@ -2679,6 +3228,22 @@ static void kmod_module_dependency_symbol_free(struct kmod_module_dependency_sym
 	free(dependency_symbol);
 }
 
+struct kmod_list *kmod_module_dependency_symbols_append(struct kmod_list **list, uint64_t crc, uint8_t bind, const char *symbol)
+{
+	struct kmod_module_dependency_symbol *mv;
+	struct kmod_list *n;
+
+	mv = kmod_module_dependency_symbols_new(crc, bind, symbol);
+	if (mv == NULL)
+		return NULL;
+	n = kmod_list_append(*list, mv);
+	if (n != NULL)
+		*list = n;
+	else
+		kmod_module_dependency_symbol_free(mv);
+	return n;
+}
+
 /**
  * kmod_module_get_dependency_symbols:
  * @mod: kmod module
@@ -2696,6 +3261,7 @@ static void kmod_module_dependency_symbol_free(struct kmod_module_dependency_sym
  */
 KMOD_EXPORT int kmod_module_get_dependency_symbols(const struct kmod_module *mod, struct kmod_list **list)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	struct kmod_elf *elf;
 	struct kmod_modversion *symbols;
 	int i, count, ret = 0;
@@ -2705,6 +3271,8 @@ KMOD_EXPORT int kmod_module_get_dependency_symbols(const struct kmod_module *mod
 
 	assert(*list == NULL);
 
+	locked = kmod_lock(mod->ctx);
+
 	elf = kmod_module_get_elf(mod);
 	if (elf == NULL)
 		return -errno;
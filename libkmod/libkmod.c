@@ -20,8 +20,10 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fnmatch.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -60,6 +62,9 @@ static struct _index_files {
 	[KMOD_INDEX_MODULES_BUILTIN] = { .fn = "modules.builtin", .prefix = ""},
 };
 
+/* All the indexes above in a single file, optionally created by depmod */
+static const char index_bundle_fn[] = "modules.idx";
+
 static const char *default_config_paths[] = {
 	SYSCONFDIR "/modprobe.d",
 	"/run/modprobe.d",
@@ -67,6 +72,18 @@ static const char *default_config_paths[] = {
 	NULL
 };
 
+/*
+ * Result of kmod_module_new_from_lookup() for @key, possibly with no
+ * modules, kept in a list with the most recently used first
+ */
+struct lookup_cache_entry {
+	struct lookup_cache_entry *prev;
+	struct lookup_cache_entry *next;
+	unsigned int n_modules;
+	const char *modules;
+	char key[];
+};
+
 /**
  * kmod_ctx:
  *
@@ -85,6 +102,19 @@ struct kmod_ctx {
 	struct hash *modules_by_name;
 	struct index_mm *indexes[_KMOD_INDEX_MODULES_SIZE];
 	unsigned long long indexes_stamp[_KMOD_INDEX_MODULES_SIZE];
+	bool indexes_bundled;
+	bool lazy_resources;
+	/* indexes that failed to load lazily, not to be tried again */
+	unsigned int indexes_missing;
+	struct hash *lookup_cache;
+	struct lookup_cache_entry *lookup_cache_first;
+	struct lookup_cache_entry *lookup_cache_last;
+	uint64_t lookup_cache_hits;
+	uint64_t lookup_cache_misses;
+	bool thread_safe;
+	pthread_mutex_t lock;
+	enum kmod_file_compression_type kernel_compression;
+	int file_cache_dfd;
 };
 
 void kmod_log(const struct kmod_ctx *ctx,
@@ -225,6 +255,44 @@ static char *get_kernel_release(const char *dirname)
 	return p;
 }
 
+/*
+ * Compression the kernel can undo itself when given a module's fd with
+ * MODULE_INIT_COMPRESSED_FILE, as exported by kernels built with
+ * CONFIG_MODULE_DECOMPRESS
+ */
+static enum kmod_file_compression_type get_kernel_compression(struct kmod_ctx *ctx)
+{
+	const char *path = "/sys/module/compression";
+	char buf[16];
+	int fd, err;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		/* Not supported or not available */
+		if (errno != ENOENT)
+			DBG(ctx, "could not open '%s' for reading: %m\n", path);
+		return KMOD_FILE_COMPRESSION_NONE;
+	}
+
+	err = read_str_safe(fd, buf, sizeof(buf));
+	close(fd);
+	if (err < 0) {
+		DBG(ctx, "could not read from '%s': %s\n", path, strerror(-err));
+		return KMOD_FILE_COMPRESSION_NONE;
+	}
+
+	if (streq(buf, "zstd\n"))
+		return KMOD_FILE_COMPRESSION_ZSTD;
+	else if (streq(buf, "xz\n"))
+		return KMOD_FILE_COMPRESSION_XZ;
+	else if (streq(buf, "gzip\n"))
+		return KMOD_FILE_COMPRESSION_ZLIB;
+
+	DBG(ctx, "unknown kernel compression %s", buf);
+
+	return KMOD_FILE_COMPRESSION_NONE;
+}
+
 /**
  * kmod_new:
  * @dirname: what to consider as linux module's directory, if NULL
@@ -253,11 +321,24 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname,
 	struct kmod_ctx *ctx;
 	int err;
 
+	pthread_mutexattr_t attr;
+
 	ctx = calloc(1, sizeof(struct kmod_ctx));
 	if (!ctx)
 		return NULL;
 
+	/* recursive, so public functions can lock and call each other */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	err = pthread_mutex_init(&ctx->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if (err != 0) {
+		free(ctx);
+		return NULL;
+	}
+
 	ctx->refcount = 1;
+	ctx->file_cache_dfd = -1;
 	ctx->log_fn = log_filep;
 	ctx->log_data = stderr;
 	ctx->log_priority = LOG_ERR;
@@ -283,6 +364,16 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname,
 		goto fail;
 	}
 
+	ctx->kernel_compression = get_kernel_compression(ctx);
+
+	env = secure_getenv("KMOD_CACHE_DIR");
+	if (env != NULL && env[0] != '\0') {
+		err = kmod_set_file_cache_dir(ctx, env);
+		if (err < 0)
+			INFO(ctx, "not using cache directory '%s': %s\n", env,
+							strerror(-err));
+	}
+
 	INFO(ctx, "ctx %p created\n", ctx);
 	DBG(ctx, "log_priority=%d\n", ctx->log_priority);
 
@@ -291,6 +382,7 @@ KMOD_EXPORT struct kmod_ctx *kmod_new(const char *dirname,
 fail:
 	free(ctx->modules_by_name);
 	free(ctx->dirname);
+	pthread_mutex_destroy(&ctx->lock);
 	free(ctx);
 	return NULL;
 }
@@ -307,7 +399,7 @@ KMOD_EXPORT struct kmod_ctx *kmod_ref(struct kmod_ctx *ctx)
 {
 	if (ctx == NULL)
 		return NULL;
-	ctx->refcount++;
+	__atomic_add_fetch(&ctx->refcount, 1, __ATOMIC_SEQ_CST);
 	return ctx;
 }
 
@@ -325,21 +417,128 @@ KMOD_EXPORT struct kmod_ctx *kmod_unref(struct kmod_ctx *ctx)
 	if (ctx == NULL)
 		return NULL;
 
-	if (--ctx->refcount > 0)
+	if (__atomic_sub_fetch(&ctx->refcount, 1, __ATOMIC_SEQ_CST) > 0)
 		return ctx;
 
 	INFO(ctx, "context %p released\n", ctx);
 
 	kmod_unload_resources(ctx);
+	hash_free(ctx->lookup_cache);
 	hash_free(ctx->modules_by_name);
 	free(ctx->dirname);
 	if (ctx->config)
 		kmod_config_free(ctx->config);
+	if (ctx->file_cache_dfd >= 0)
+		close(ctx->file_cache_dfd);
 
+	pthread_mutex_destroy(&ctx->lock);
 	free(ctx);
 	return NULL;
 }
 
+/**
+ * kmod_set_thread_safe:
+ * @ctx: kmod library context
+ * @enable: whether @ctx may be used from more than one thread at a time
+ *
+ * By default a context and everything created from it must be used by a
+ * single thread at a time. In thread-safe mode the module pool, the lazily
+ * loaded indexes, the lookup cache and the information computed lazily for
+ * each module are protected by a lock in @ctx, and the references are
+ * counted atomically, so the same context and its modules can be shared by
+ * several threads doing lookups and probing modules concurrently. The
+ * indexes are searched and the modules inserted in the kernel without
+ * holding the lock.
+ *
+ * This must be called right after kmod_new(), before @ctx is shared.
+ * Logging and userdata functions are not protected: set them up before
+ * sharing @ctx as well. kmod_unload_resources() must not be called while
+ * other threads are using @ctx.
+ */
+KMOD_EXPORT void kmod_set_thread_safe(struct kmod_ctx *ctx, bool enable)
+{
+	if (ctx == NULL)
+		return;
+
+	ctx->thread_safe = enable;
+}
+
+/**
+ * kmod_set_file_cache_dir:
+ * @ctx: kmod library context
+ * @dirname: directory to keep decompressed modules in, or NULL to not use one
+ *
+ * Keep a copy of each compressed module that has to be decompressed in
+ * @dirname, and use it instead of decompressing the module again, in this and
+ * in other contexts and processes using the same directory. Entries are
+ * keyed by the path, inode, modification time and size of the module, so
+ * an updated module is decompressed again. Old entries are never removed:
+ * a directory on a tmpfs such as /run/kmod-cache works best.
+ *
+ * @dirname must already exist, be owned by the effective user or by root
+ * and not be writable by group or others. Entries not meeting the same
+ * conditions are ignored. The directory given in the KMOD_CACHE_DIR
+ * environment variable is used by default.
+ *
+ * Returns: 0 on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_set_file_cache_dir(struct kmod_ctx *ctx,
+							const char *dirname)
+{
+	struct stat st;
+	int fd;
+
+	if (ctx == NULL)
+		return -ENOENT;
+
+	if (ctx->file_cache_dfd >= 0) {
+		close(ctx->file_cache_dfd);
+		ctx->file_cache_dfd = -1;
+	}
+
+	if (dirname == NULL)
+		return 0;
+
+	fd = open(dirname, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	if ((st.st_uid != geteuid() && st.st_uid != 0) ||
+			(st.st_mode & (S_IWGRP | S_IWOTH))) {
+		close(fd);
+		return -EPERM;
+	}
+
+	DBG(ctx, "caching decompressed modules in %s\n", dirname);
+	ctx->file_cache_dfd = fd;
+
+	return 0;
+}
+
+/*
+ * Lock @ctx if it's in thread-safe mode. Returns @ctx, so it can be used
+ * with _cleanup_kmod_unlock_ to unlock when leaving the scope.
+ */
+struct kmod_ctx *kmod_lock(struct kmod_ctx *ctx)
+{
+	if (ctx->thread_safe)
+		pthread_mutex_lock(&ctx->lock);
+
+	return ctx;
+}
+
+void kmod_unlock(struct kmod_ctx *ctx)
+{
+	if (ctx->thread_safe)
+		pthread_mutex_unlock(&ctx->lock);
+}
+
 /**
  * kmod_set_log_fn:
  * @ctx: kmod library context
@@ -417,7 +616,252 @@ void kmod_pool_del_module(struct kmod_ctx *ctx, struct kmod_module *mod,
 {
 	DBG(ctx, "del %p key='%s'\n", mod, key);
 
-	hash_del(ctx->modules_by_name, key);
+	/*
+	 * In thread-safe mode another thread may have replaced @mod while its
+	 * last reference was being dropped
+	 */
+	if (hash_find(ctx->modules_by_name, key) == mod)
+		hash_del(ctx->modules_by_name, key);
+}
+
+/*
+ * Lookups are cached only while the indexes are kept loaded, since then
+ * kmod_validate_resources() tells when they change and the cache is
+ * flushed together with them.
+ */
+static bool lookup_cache_enabled(const struct kmod_ctx *ctx)
+{
+	size_t i;
+
+	if (ctx->lazy_resources)
+		return true;
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+		if (ctx->indexes[i] != NULL)
+			return true;
+	}
+
+	return false;
+}
+
+static void lookup_cache_unlink(struct kmod_ctx *ctx,
+					struct lookup_cache_entry *entry)
+{
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		ctx->lookup_cache_first = entry->next;
+
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		ctx->lookup_cache_last = entry->prev;
+}
+
+static void lookup_cache_link_first(struct kmod_ctx *ctx,
+					struct lookup_cache_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = ctx->lookup_cache_first;
+	if (entry->next != NULL)
+		entry->next->prev = entry;
+	else
+		ctx->lookup_cache_last = entry;
+	ctx->lookup_cache_first = entry;
+}
+
+static void lookup_cache_flush(struct kmod_ctx *ctx)
+{
+	struct lookup_cache_entry *entry, *next;
+
+	for (entry = ctx->lookup_cache_first; entry != NULL; entry = next) {
+		next = entry->next;
+		hash_del(ctx->lookup_cache, entry->key);
+		free(entry);
+	}
+
+	ctx->lookup_cache_first = NULL;
+	ctx->lookup_cache_last = NULL;
+}
+
+/*
+ * Get the cached result of looking up @key: *n_modules pairs of module name
+ * and alias ("" if the module wasn't created from an alias), one nul
+ * terminated string after the other. Returns NULL if it's not cached. Must
+ * be called with @ctx locked, and the result is only valid until unlocked.
+ */
+const char *kmod_lookup_cache_get(struct kmod_ctx *ctx, const char *key,
+						unsigned int *n_modules)
+{
+	struct lookup_cache_entry *entry;
+
+	if (!lookup_cache_enabled(ctx))
+		return NULL;
+
+	entry = ctx->lookup_cache ? hash_find(ctx->lookup_cache, key) : NULL;
+	if (entry == NULL) {
+		ctx->lookup_cache_misses++;
+		return NULL;
+	}
+
+	ctx->lookup_cache_hits++;
+	DBG(ctx, "cached lookup %s: %u modules\n", key, entry->n_modules);
+
+	if (entry != ctx->lookup_cache_first) {
+		lookup_cache_unlink(ctx, entry);
+		lookup_cache_link_first(ctx, entry);
+	}
+
+	*n_modules = entry->n_modules;
+	return entry->modules;
+}
+
+/*
+ * Cache the result of looking up @key, in the format returned by
+ * kmod_lookup_cache_get(), evicting the least recently used one if there
+ * are already KMOD_LRU_MAX. Failing to cache is not an error.
+ */
+void kmod_lookup_cache_add(struct kmod_ctx *ctx, const char *key,
+				const char *modules, size_t modules_len,
+				unsigned int n_modules)
+{
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = kmod_lock(ctx);
+	struct lookup_cache_entry *entry;
+	size_t keylen;
+
+	if (!lookup_cache_enabled(ctx))
+		return;
+
+	if (ctx->lookup_cache == NULL) {
+		ctx->lookup_cache = hash_new(KMOD_LRU_MAX, NULL);
+		if (ctx->lookup_cache == NULL)
+			return;
+	}
+
+	if (hash_get_count(ctx->lookup_cache) >= KMOD_LRU_MAX) {
+		entry = ctx->lookup_cache_last;
+		lookup_cache_unlink(ctx, entry);
+		hash_del(ctx->lookup_cache, entry->key);
+		free(entry);
+	}
+
+	keylen = strlen(key) + 1;
+	entry = malloc(sizeof(*entry) + keylen + modules_len);
+	if (entry == NULL)
+		return;
+
+	memcpy(entry->key, key, keylen);
+	if (modules_len > 0)
+		memcpy(entry->key + keylen, modules, modules_len);
+	entry->modules = entry->key + keylen;
+	entry->n_modules = n_modules;
+
+	if (hash_add_unique(ctx->lookup_cache, entry->key, entry) < 0) {
+		free(entry);
+		return;
+	}
+
+	lookup_cache_link_first(ctx, entry);
+}
+
+/**
+ * kmod_get_lookup_cache_stats:
+ * @ctx: kmod library context
+ * @hits: where to save the number of lookups answered from the cache
+ * @misses: where to save the number of lookups not found in the cache
+ *
+ * While the indexes are kept loaded, with kmod_load_resources() or
+ * kmod_set_lazy_resources(), the results of the last KMOD_LRU_MAX (128)
+ * different lookups with kmod_module_new_from_lookup() are cached in @ctx,
+ * including the ones that didn't find any module. The cache is flushed
+ * when the resources are unloaded or kmod_validate_resources() finds they
+ * changed. Either of @hits and @misses may be NULL.
+ *
+ * Returns: 0 on success or < 0 otherwise.
+ */
+KMOD_EXPORT int kmod_get_lookup_cache_stats(const struct kmod_ctx *ctx,
+						uint64_t *hits,
+						uint64_t *misses)
+{
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
+
+	if (ctx == NULL)
+		return -ENOENT;
+
+	locked = kmod_lock((struct kmod_ctx *) ctx);
+
+	if (hits != NULL)
+		*hits = ctx->lookup_cache_hits;
+	if (misses != NULL)
+		*misses = ctx->lookup_cache_misses;
+
+	return 0;
+}
+
+static bool kmod_load_bundle(struct kmod_ctx *ctx);
+
+/*
+ * Get the mmap'ed index @type, if loaded. In lazy mode it's loaded on
+ * first use, together with all the others if there's a bundle.
+ */
+static struct index_mm *kmod_get_index(struct kmod_ctx *ctx,
+							enum kmod_index type)
+{
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = kmod_lock(ctx);
+	char path[PATH_MAX];
+	size_t i;
+
+	if (ctx->indexes[type] != NULL || !ctx->lazy_resources ||
+				(ctx->indexes_missing & (1U << type)))
+		return ctx->indexes[type];
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+		if (ctx->indexes[i] != NULL)
+			break;
+	}
+
+	if (i == _KMOD_INDEX_MODULES_SIZE && ctx->indexes_missing == 0 &&
+							kmod_load_bundle(ctx))
+		return ctx->indexes[type];
+
+	snprintf(path, sizeof(path), "%s/%s.bin", ctx->dirname,
+						index_files[type].fn);
+	ctx->indexes[type] = index_mm_open(ctx, path,
+						&ctx->indexes_stamp[type]);
+	if (ctx->indexes[type] == NULL)
+		ctx->indexes_missing |= 1U << type;
+
+	return ctx->indexes[type];
+}
+
+/*
+ * Append a module for each of the @realnames found for alias @name to
+ * @list. Returns the number of modules or < 0 on failure, leaving @list as
+ * it was.
+ */
+static int alias_values_to_list(struct kmod_ctx *ctx, const char *name,
+					const struct index_value *realnames,
+					struct kmod_list **list)
+{
+	const struct index_value *realname;
+	int err, nmatch = 0;
+
+	for (realname = realnames; realname; realname = realname->next) {
+		struct kmod_module *mod;
+
+		err = kmod_module_new_from_alias(ctx, name, realname->value, &mod);
+		if (err < 0) {
+			ERR(ctx, "Could not create module for alias=%s realname=%s: %s\n",
+			    name, realname->value, strerror(-err));
+			*list = kmod_list_remove_n_latest(*list, nmatch);
+			return err;
+		}
+
+		*list = kmod_list_append(*list, mod);
+		nmatch++;
+	}
+
+	return nmatch;
 }
 
 static int kmod_lookup_alias_from_alias_bin(struct kmod_ctx *ctx,
@@ -425,15 +869,16 @@ static int kmod_lookup_alias_from_alias_bin(struct kmod_ctx *ctx,
 						const char *name,
 						struct kmod_list **list)
 {
-	int err, nmatch = 0;
+	int nmatch;
 	struct index_file *idx;
-	struct index_value *realnames, *realname;
+	struct index_mm *idx_mm;
+	struct index_value *realnames;
 
-	if (ctx->indexes[index_number] != NULL) {
+	idx_mm = kmod_get_index(ctx, index_number);
+	if (idx_mm != NULL) {
 		DBG(ctx, "use mmaped index '%s' for name=%s\n",
 			index_files[index_number].fn, name);
-		realnames = index_mm_searchwild(ctx->indexes[index_number],
-									name);
+		realnames = index_mm_searchwild(idx_mm, name);
 	} else {
 		char fn[PATH_MAX];
 
@@ -450,28 +895,10 @@ static int kmod_lookup_alias_from_alias_bin(struct kmod_ctx *ctx,
 		index_file_close(idx);
 	}
 
-	for (realname = realnames; realname; realname = realname->next) {
-		struct kmod_module *mod;
-
-		err = kmod_module_new_from_alias(ctx, name, realname->value, &mod);
-		if (err < 0) {
-			ERR(ctx, "Could not create module for alias=%s realname=%s: %s\n",
-			    name, realname->value, strerror(-err));
-			goto fail;
-		}
-
-		*list = kmod_list_append(*list, mod);
-		nmatch++;
-	}
-
+	nmatch = alias_values_to_list(ctx, name, realnames, list);
 	index_values_free(realnames);
-	return nmatch;
-
-fail:
-	*list = kmod_list_remove_n_latest(*list, nmatch);
-	index_values_free(realnames);
-	return err;
 
+	return nmatch;
 }
 
 int kmod_lookup_alias_from_symbols_file(struct kmod_ctx *ctx, const char *name,
@@ -491,19 +918,65 @@ int kmod_lookup_alias_from_aliases_file(struct kmod_ctx *ctx, const char *name,
 								name, list);
 }
 
-static char *lookup_builtin_file(struct kmod_ctx *ctx, const char *name)
+/*
+ * Same as kmod_lookup_alias_from_aliases_file() for each of the @n sorted
+ * and distinct @names, saving the modules of @names[i] in @lists[i]. When
+ * the index is loaded all of them are searched in a single walk.
+ */
+int kmod_lookup_alias_from_aliases_file_many(struct kmod_ctx *ctx,
+						const char * const *names,
+						size_t n,
+						struct kmod_list **lists)
+{
+	struct index_value **realnames;
+	struct index_mm *idx_mm;
+	size_t i;
+	int err = 0;
+
+	idx_mm = kmod_get_index(ctx, KMOD_INDEX_MODULES_ALIAS);
+	if (idx_mm == NULL) {
+		for (i = 0; i < n && err >= 0; i++)
+			err = kmod_lookup_alias_from_aliases_file(ctx, names[i],
+								&lists[i]);
+		return err < 0 ? err : 0;
+	}
+
+	realnames = malloc(n * sizeof(*realnames));
+	if (realnames == NULL)
+		return -ENOMEM;
+
+	DBG(ctx, "use mmaped index '%s' for %zu names\n",
+			index_files[KMOD_INDEX_MODULES_ALIAS].fn, n);
+	index_mm_searchwild_many(idx_mm, names, n, realnames);
+
+	for (i = 0; i < n; i++) {
+		if (err >= 0)
+			err = alias_values_to_list(ctx, names[i], realnames[i],
+								&lists[i]);
+		index_values_free(realnames[i]);
+	}
+
+	free(realnames);
+	return err < 0 ? err : 0;
+}
+
+static bool lookup_builtin_file(struct kmod_ctx *ctx, const char *name)
 {
-	char *line;
+	struct index_mm *idx_mm;
+	bool found;
+
+	idx_mm = kmod_get_index(ctx, KMOD_INDEX_MODULES_BUILTIN);
+	if (idx_mm != NULL) {
+		struct index_mm_value v;
 
-	if (ctx->indexes[KMOD_INDEX_MODULES_BUILTIN]) {
 		DBG(ctx, "use mmaped index '%s' modname=%s\n",
 				index_files[KMOD_INDEX_MODULES_BUILTIN].fn,
 				name);
-		line = index_mm_search(ctx->indexes[KMOD_INDEX_MODULES_BUILTIN],
-									name);
+		found = index_mm_search(idx_mm, name, &v);
 	} else {
 		struct index_file *idx;
 		char fn[PATH_MAX];
+		char *line;
 
 		snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname,
 				index_files[KMOD_INDEX_MODULES_BUILTIN].fn);
@@ -512,68 +985,76 @@ static char *lookup_builtin_file(struct kmod_ctx *ctx, const char *name)
 		idx = index_file_open(fn);
 		if (idx == NULL) {
 			DBG(ctx, "could not open builtin file '%s'\n", fn);
-			return NULL;
+			return false;
 		}
 
 		line = index_search(idx, name);
 		index_file_close(idx);
+		found = line != NULL;
+		free(line);
 	}
 
-	return line;
+	return found;
 }
 
 int kmod_lookup_alias_from_builtin_file(struct kmod_ctx *ctx, const char *name,
 						struct kmod_list **list)
 {
-	char *line;
-	int err = 0;
+	struct kmod_module *mod;
+	int err;
 
 	assert(*list == NULL);
 
-	line = lookup_builtin_file(ctx, name);
-	if (line != NULL) {
-		struct kmod_module *mod;
-
-		err = kmod_module_new_from_name(ctx, name, &mod);
-		if (err < 0) {
-			ERR(ctx, "Could not create module from name %s: %s\n",
-							name, strerror(-err));
-			goto finish;
-		}
+	if (!lookup_builtin_file(ctx, name))
+		return 0;
 
-		/* already mark it as builtin since it's being created from
-		 * this index */
-		kmod_module_set_builtin(mod, true);
-		*list = kmod_list_append(*list, mod);
-		if (*list == NULL)
-			err = -ENOMEM;
+	err = kmod_module_new_from_name(ctx, name, &mod);
+	if (err < 0) {
+		ERR(ctx, "Could not create module from name %s: %s\n",
+						name, strerror(-err));
+		return err;
 	}
 
-finish:
-	free(line);
-	return err;
+	/* already mark it as builtin since it's being created from
+	 * this index */
+	kmod_module_set_builtin(mod, true);
+	*list = kmod_list_append(*list, mod);
+	if (*list == NULL)
+		return -ENOMEM;
+
+	return 0;
 }
 
 bool kmod_lookup_alias_is_builtin(struct kmod_ctx *ctx, const char *name)
 {
-	_cleanup_free_ char *line;
-
-	line = lookup_builtin_file(ctx, name);
-
-	return line != NULL;
+	return lookup_builtin_file(ctx, name);
 }
 
-char *kmod_search_moddep(struct kmod_ctx *ctx, const char *name)
+/*
+ * Search @name in modules.dep. The returned line points inside the mmap'ed
+ * index when it's loaded, so it's only valid until the resources are
+ * unloaded. Otherwise it's read from the file and *buf is set to the
+ * allocated line, which must be freed by the caller.
+ */
+const char *kmod_search_moddep(struct kmod_ctx *ctx, const char *name,
+								char **buf)
 {
 	struct index_file *idx;
+	struct index_mm *idx_mm;
 	char fn[PATH_MAX];
-	char *line;
 
-	if (ctx->indexes[KMOD_INDEX_MODULES_DEP]) {
+	*buf = NULL;
+
+	idx_mm = kmod_get_index(ctx, KMOD_INDEX_MODULES_DEP);
+	if (idx_mm != NULL) {
+		struct index_mm_value v;
+
 		DBG(ctx, "use mmaped index '%s' modname=%s\n",
 				index_files[KMOD_INDEX_MODULES_DEP].fn, name);
-		return index_mm_search(ctx->indexes[KMOD_INDEX_MODULES_DEP],
-									name);
+		if (!index_mm_search(idx_mm, name, &v))
+			return NULL;
+
+		return v.value;
 	}
 
 	snprintf(fn, sizeof(fn), "%s/%s.bin", ctx->dirname,
@@ -587,17 +1068,36 @@ char *kmod_search_moddep(struct kmod_ctx *ctx, const char *name)
 		return NULL;
 	}
 
-	line = index_search(idx, name);
+	*buf = index_search(idx, name);
 	index_file_close(idx);
 
-	return line;
+	return *buf;
+}
+
+static int moddep_line_to_list(struct kmod_ctx *ctx, const char *name,
+					const char *line, struct kmod_list **list)
+{
+	struct kmod_module *mod;
+	int n;
+
+	n = kmod_module_new_from_name(ctx, name, &mod);
+	if (n < 0) {
+		ERR(ctx, "Could not create module from name %s: %s\n",
+		    name, strerror(-n));
+		return n;
+	}
+
+	*list = kmod_list_append(*list, mod);
+	kmod_module_parse_depline(mod, line);
+
+	return n;
 }
 
 int kmod_lookup_alias_from_moddep_file(struct kmod_ctx *ctx, const char *name,
 						struct kmod_list **list)
 {
-	char *line;
-	int n = 0;
+	_cleanup_free_ char *buf = NULL;
+	const char *line;
 
 	/*
 	 * Module names do not contain ':'. Return early if we know it will
@@ -606,25 +1106,70 @@ int kmod_lookup_alias_from_moddep_file(struct kmod_ctx *ctx, const char *name,
 	if (strchr(name, ':'))
 		return 0;
 
-	line = kmod_search_moddep(ctx, name);
-	if (line != NULL) {
-		struct kmod_module *mod;
+	line = kmod_search_moddep(ctx, name, &buf);
+	if (line == NULL)
+		return 0;
 
-		n = kmod_module_new_from_name(ctx, name, &mod);
-		if (n < 0) {
-			ERR(ctx, "Could not create module from name %s: %s\n",
-			    name, strerror(-n));
-			goto finish;
-		}
+	return moddep_line_to_list(ctx, name, line, list);
+}
 
-		*list = kmod_list_append(*list, mod);
-		kmod_module_parse_depline(mod, line);
+/*
+ * Same as kmod_lookup_alias_from_moddep_file() for each of the @n sorted
+ * and distinct @names, saving the module of @names[i] in @lists[i]. When
+ * the index is loaded all of them are searched in a single walk.
+ */
+int kmod_lookup_alias_from_moddep_file_many(struct kmod_ctx *ctx,
+						const char * const *names,
+						size_t n,
+						struct kmod_list **lists)
+{
+	struct index_mm_value *values;
+	struct index_mm *idx_mm;
+	const char **modnames;
+	size_t i, n_modnames = 0;
+	int err = 0;
+
+	idx_mm = kmod_get_index(ctx, KMOD_INDEX_MODULES_DEP);
+	if (idx_mm == NULL) {
+		for (i = 0; i < n && err >= 0; i++)
+			err = kmod_lookup_alias_from_moddep_file(ctx, names[i],
+								&lists[i]);
+		return err < 0 ? err : 0;
 	}
 
-finish:
-	free(line);
+	values = malloc(n * sizeof(*values));
+	modnames = malloc(n * sizeof(*modnames));
+	if (values == NULL || modnames == NULL) {
+		err = -ENOMEM;
+		goto finish;
+	}
 
-	return n;
+	/* as above, skip what can't be a module name */
+	for (i = 0; i < n; i++) {
+		if (strchr(names[i], ':') == NULL)
+			modnames[n_modnames++] = names[i];
+	}
+
+	DBG(ctx, "use mmaped index '%s' for %zu modnames\n",
+			index_files[KMOD_INDEX_MODULES_DEP].fn, n_modnames);
+	index_mm_search_many(idx_mm, modnames, n_modnames, values);
+
+	for (i = 0, n_modnames = 0; i < n && err >= 0; i++) {
+		const char *line;
+
+		if (strchr(names[i], ':') != NULL)
+			continue;
+
+		line = values[n_modnames++].value;
+		if (line != NULL)
+			err = moddep_line_to_list(ctx, names[i], line,
+								&lists[i]);
+	}
+
+finish:
+	free(modnames);
+	free(values);
+	return err < 0 ? err : 0;
 }
 
 int kmod_lookup_alias_from_config(struct kmod_ctx *ctx, const char *name,
@@ -773,6 +1318,36 @@ static bool is_cache_invalid(const char *path, unsigned long long stamp)
 	return false;
 }
 
+/*
+ * Each section of modules.idx is a copy of an index file, written before
+ * it. A file with another size or newer than the bundle was rewritten
+ * afterwards, e.g. by a depmod that doesn't know about modules.idx, and the
+ * bundle is stale. A missing file doesn't make it stale.
+ */
+static bool kmod_bundle_is_stale(struct kmod_ctx *ctx,
+						unsigned long long stamp)
+{
+	size_t i;
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+		char path[PATH_MAX];
+		struct stat st;
+
+		snprintf(path, sizeof(path), "%s/%s.bin", ctx->dirname,
+							index_files[i].fn);
+		if (stat(path, &st) < 0)
+			continue;
+
+		if ((size_t) st.st_size != index_mm_get_size(ctx->indexes[i]) ||
+						stat_mstamp(&st) > stamp) {
+			DBG(ctx, "%s changed after the bundle\n", path);
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /**
  * kmod_validate_resources:
  * @ctx: kmod library context
@@ -787,17 +1362,36 @@ static bool is_cache_invalid(const char *path, unsigned long long stamp)
  */
 KMOD_EXPORT int kmod_validate_resources(struct kmod_ctx *ctx)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	struct kmod_list *l;
 	size_t i;
 
 	if (ctx == NULL || ctx->config == NULL)
 		return KMOD_RESOURCES_MUST_RECREATE;
 
+	locked = kmod_lock(ctx);
+
 	kmod_list_foreach(l, ctx->config->paths) {
 		struct kmod_config_path *cf = l->data;
 
-		if (is_cache_invalid(cf->path, cf->stamp))
+		if (is_cache_invalid(cf->path, cf->stamp)) {
+			lookup_cache_flush(ctx);
 			return KMOD_RESOURCES_MUST_RECREATE;
+		}
+	}
+
+	if (ctx->indexes_bundled) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/%s", ctx->dirname,
+							index_bundle_fn);
+		if (is_cache_invalid(path, ctx->indexes_stamp[0]) ||
+			kmod_bundle_is_stale(ctx, ctx->indexes_stamp[0])) {
+			lookup_cache_flush(ctx);
+			return KMOD_RESOURCES_MUST_RELOAD;
+		}
+
+		return KMOD_RESOURCES_OK;
 	}
 
 	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
@@ -809,13 +1403,42 @@ KMOD_EXPORT int kmod_validate_resources(struct kmod_ctx *ctx)
 		snprintf(path, sizeof(path), "%s/%s.bin", ctx->dirname,
 						index_files[i].fn);
 
-		if (is_cache_invalid(path, ctx->indexes_stamp[i]))
+		if (is_cache_invalid(path, ctx->indexes_stamp[i])) {
+			lookup_cache_flush(ctx);
 			return KMOD_RESOURCES_MUST_RELOAD;
+		}
 	}
 
 	return KMOD_RESOURCES_OK;
 }
 
+/* Load all the indexes from modules.idx, if there's one and it's not stale */
+static bool kmod_load_bundle(struct kmod_ctx *ctx)
+{
+	char path[PATH_MAX];
+	unsigned long long stamp;
+	size_t i;
+
+	snprintf(path, sizeof(path), "%s/%s", ctx->dirname, index_bundle_fn);
+	if (index_mm_open_bundle(ctx, path, &stamp, ctx->indexes,
+					_KMOD_INDEX_MODULES_SIZE) < 0)
+		return false;
+
+	if (kmod_bundle_is_stale(ctx, stamp)) {
+		for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+			index_mm_close(ctx->indexes[i]);
+			ctx->indexes[i] = NULL;
+		}
+		return false;
+	}
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++)
+		ctx->indexes_stamp[i] = stamp;
+	ctx->indexes_bundled = true;
+
+	return true;
+}
+
 /**
  * kmod_load_resources:
  * @ctx: kmod library context
@@ -829,15 +1452,30 @@ KMOD_EXPORT int kmod_validate_resources(struct kmod_ctx *ctx)
  * udev that on bootup issues hundreds of calls to lookup the index, calling
  * this function will speedup the searches.
  *
+ * If depmod created the modules.idx bundle, all the indexes are loaded from
+ * it at once instead of from their own files, unless one of these files
+ * changed after the bundle was written.
+ *
  * Returns: 0 on success or < 0 otherwise.
  */
 KMOD_EXPORT int kmod_load_resources(struct kmod_ctx *ctx)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	size_t i;
 
 	if (ctx == NULL)
 		return -ENOENT;
 
+	locked = kmod_lock(ctx);
+
+	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
+		if (ctx->indexes[i] != NULL)
+			break;
+	}
+
+	if (i == _KMOD_INDEX_MODULES_SIZE && kmod_load_bundle(ctx))
+		return 0;
+
 	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
 		char path[PATH_MAX];
 
@@ -879,11 +1517,14 @@ fail:
  */
 KMOD_EXPORT void kmod_unload_resources(struct kmod_ctx *ctx)
 {
+	_cleanup_kmod_unlock_ struct kmod_ctx *locked = NULL;
 	size_t i;
 
 	if (ctx == NULL)
 		return;
 
+	locked = kmod_lock(ctx);
+
 	for (i = 0; i < _KMOD_INDEX_MODULES_SIZE; i++) {
 		if (ctx->indexes[i] != NULL) {
 			index_mm_close(ctx->indexes[i]);
@@ -891,6 +1532,34 @@ KMOD_EXPORT void kmod_unload_resources(struct kmod_ctx *ctx)
 			ctx->indexes_stamp[i] = 0;
 		}
 	}
+
+	ctx->indexes_bundled = false;
+	ctx->indexes_missing = 0;
+
+	lookup_cache_flush(ctx);
+}
+
+/**
+ * kmod_set_lazy_resources:
+ * @ctx: kmod library context
+ * @enable: whether to load the indexes lazily
+ *
+ * In lazy mode each index is loaded, as kmod_load_resources() would do, the
+ * first time a search needs it, and kept open in @ctx until
+ * kmod_unload_resources(). So the indexes that are never searched are never
+ * opened, while the ones that are pay the cost of opening them only once.
+ * kmod_validate_resources() checks the indexes loaded so far.
+ *
+ * Indexes that can't be loaded are not tried again until
+ * kmod_unload_resources() is called, and are searched without loading them,
+ * as when this mode is disabled.
+ */
+KMOD_EXPORT void kmod_set_lazy_resources(struct kmod_ctx *ctx, bool enable)
+{
+	if (ctx == NULL)
+		return;
+
+	ctx->lazy_resources = enable;
 }
 
 /**
@@ -912,16 +1581,18 @@ KMOD_EXPORT void kmod_unload_resources(struct kmod_ctx *ctx)
 KMOD_EXPORT int kmod_dump_index(struct kmod_ctx *ctx, enum kmod_index type,
 									int fd)
 {
+	struct index_mm *idx_mm;
+
 	if (ctx == NULL)
 		return -ENOSYS;
 
 	if (type < 0 || type >= _KMOD_INDEX_MODULES_SIZE)
 		return -ENOENT;
 
-	if (ctx->indexes[type] != NULL) {
+	idx_mm = kmod_get_index(ctx, type);
+	if (idx_mm != NULL) {
 		DBG(ctx, "use mmaped index '%s'\n", index_files[type].fn);
-		index_mm_dump(ctx->indexes[type], fd,
-						index_files[type].prefix);
+		index_mm_dump(idx_mm, fd, index_files[type].prefix);
 	} else {
 		char fn[PATH_MAX];
 		struct index_file *idx;
@@ -946,3 +1617,13 @@ const struct kmod_config *kmod_get_config(const struct kmod_ctx *ctx)
 {
 	return ctx->config;
 }
+
+enum kmod_file_compression_type kmod_get_kernel_compression(const struct kmod_ctx *ctx)
+{
+	return ctx->kernel_compression;
+}
+
+int kmod_get_file_cache_dirfd(const struct kmod_ctx *ctx)
+{
+	return ctx->file_cache_dfd;
+}
@@ -50,6 +50,8 @@ int kmod_get_log_priority(const struct kmod_ctx *ctx);
 void kmod_set_log_priority(struct kmod_ctx *ctx, int priority);
 void *kmod_get_userdata(const struct kmod_ctx *ctx);
 void kmod_set_userdata(struct kmod_ctx *ctx, const void *userdata);
+void kmod_set_thread_safe(struct kmod_ctx *ctx, bool enable);
+int kmod_set_file_cache_dir(struct kmod_ctx *ctx, const char *dirname);
 
 const char *kmod_get_dirname(const struct kmod_ctx *ctx);
 
@@ -58,6 +60,9 @@ const char *kmod_get_dirname(const struct kmod_ctx *ctx);
  */
 int kmod_load_resources(struct kmod_ctx *ctx);
 void kmod_unload_resources(struct kmod_ctx *ctx);
+void kmod_set_lazy_resources(struct kmod_ctx *ctx, bool enable);
+int kmod_get_lookup_cache_stats(const struct kmod_ctx *ctx, uint64_t *hits,
+							uint64_t *misses);
 
 enum kmod_resources {
 	KMOD_RESOURCES_OK = 0,
@@ -128,6 +133,10 @@ int kmod_module_new_from_path(struct kmod_ctx *ctx, const char *path,
 						struct kmod_module **mod);
 int kmod_module_new_from_lookup(struct kmod_ctx *ctx, const char *given_alias,
 						struct kmod_list **list);
+int kmod_module_new_from_lookup_many(struct kmod_ctx *ctx,
+						const char * const *given_aliases,
+						unsigned int n_aliases,
+						struct kmod_list **lists);
 int kmod_module_new_from_loaded(struct kmod_ctx *ctx,
 						struct kmod_list **list);
 
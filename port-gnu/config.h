@@ -16,6 +16,9 @@
 /* Enable zlib for modules. */
 /* #undef ENABLE_ZLIB */
 
+/* Enable Zstandard for modules. */
+/* #undef ENABLE_ZSTD */
+
 /* Define to 1 if you have the declaration of `be32toh', and to 0 if you
    don't. */
 #define HAVE_DECL_BE32TOH 1
@@ -92,7 +95,7 @@
 #define HAVE___XSTAT 1
 
 /* Features in this build */
-#define KMOD_FEATURES "-XZ -ZLIB -EXPERIMENTAL"
+#define KMOD_FEATURES "-XZ -ZLIB -ZSTD -EXPERIMENTAL"
 
 /* Define to the sub-directory in which libtool stores uninstalled libraries.
    */
@@ -0,0 +1,128 @@
+/*
+ * libkmod - interface to kernel module operations
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <shared/arena.h>
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	size_t size;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void arena_init(struct arena *arena, size_t block_size)
+{
+	arena->blocks = NULL;
+	arena->block_size = block_size > 0 ? block_size :
+						ARENA_DEFAULT_BLOCK_SIZE;
+}
+
+void arena_release(struct arena *arena)
+{
+	struct arena_block *b = arena->blocks;
+
+	while (b != NULL) {
+		struct arena_block *next = b->next;
+
+		free(b);
+		b = next;
+	}
+	arena->blocks = NULL;
+}
+
+/*
+ * Allocations bigger than a quarter of a block get a block of their own,
+ * which goes after the current one so what is left of it isn't wasted.
+ */
+static struct arena_block *arena_add_block(struct arena *arena, size_t size)
+{
+	struct arena_block *b;
+	bool dedicated = size > arena->block_size / 4;
+
+	if (!dedicated)
+		size = arena->block_size;
+
+	b = malloc(sizeof(*b) + size);
+	if (b == NULL)
+		return NULL;
+	b->used = 0;
+	b->size = size;
+
+	if (dedicated && arena->blocks != NULL) {
+		b->next = arena->blocks->next;
+		arena->blocks->next = b;
+	} else {
+		b->next = arena->blocks;
+		arena->blocks = b;
+	}
+
+	return b;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_block *b = arena->blocks;
+	void *p;
+
+	if (size > SIZE_MAX - ARENA_ALIGN) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (b == NULL || b->size - b->used < size) {
+		b = arena_add_block(arena, size);
+		if (b == NULL)
+			return NULL;
+	}
+
+	p = b->data + b->used;
+	b->used += size;
+	return p;
+}
+
+void *arena_zalloc(struct arena *arena, size_t size)
+{
+	void *p = arena_alloc(arena, size);
+
+	if (p != NULL)
+		memset(p, 0, size);
+	return p;
+}
+
+void *arena_memdup(struct arena *arena, const void *p, size_t size)
+{
+	void *r = arena_alloc(arena, size);
+
+	if (r != NULL)
+		memcpy(r, p, size);
+	return r;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+	return arena_memdup(arena, str, strlen(str) + 1);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for objects sharing the same lifetime: they are allocated
+ * from big blocks and can't be freed one by one, only all at once with
+ * arena_release().
+ */
+struct arena_block;
+
+struct arena {
+	struct arena_block *blocks;
+	size_t block_size;
+};
+
+void arena_init(struct arena *arena, size_t block_size);
+void arena_release(struct arena *arena);
+
+/* Memory is aligned as returned by malloc(). All return NULL on ENOMEM */
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_zalloc(struct arena *arena, size_t size);
+void *arena_memdup(struct arena *arena, const void *p, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
@@ -0,0 +1,372 @@
+/*
+ * libkmod - interface to kernel module operations
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <shared/array.h>
+#include <shared/dirwalk.h>
+
+#define DIR_READER_BUF_SIZE (64 * 1024)
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+int dir_reader_init(struct dir_reader *r, int fd)
+{
+	r->fd = fd;
+	r->len = 0;
+	r->pos = 0;
+	r->buf = malloc(DIR_READER_BUF_SIZE);
+	if (r->buf == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+int dir_reader_open(struct dir_reader *r, int dfd, const char *name)
+{
+	int fd = openat(dfd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+	if (fd < 0)
+		return -errno;
+
+	return dir_reader_init(r, fd);
+}
+
+void dir_reader_close(struct dir_reader *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+	close(r->fd);
+	r->fd = -1;
+}
+
+int dir_reader_next(struct dir_reader *r, struct dir_entry *e)
+{
+	for (;;) {
+		const struct linux_dirent64 *d;
+
+		if (r->pos >= r->len) {
+			long n = syscall(SYS_getdents64, r->fd, r->buf,
+							DIR_READER_BUF_SIZE);
+			if (n < 0)
+				return -errno;
+			if (n == 0)
+				return 0;
+			r->len = n;
+			r->pos = 0;
+		}
+
+		d = (const struct linux_dirent64 *)(r->buf + r->pos);
+		r->pos += d->d_reclen;
+
+		if (d->d_name[0] == '.' && (d->d_name[1] == '\0' ||
+			(d->d_name[1] == '.' && d->d_name[2] == '\0')))
+			continue;
+
+		e->name = d->d_name;
+		e->namelen = strlen(d->d_name);
+		e->type = d->d_type;
+		return 1;
+	}
+}
+
+int dir_entry_type(int dfd, const struct dir_entry *e, struct stat *st)
+{
+	struct stat buf;
+
+	if (e->type == DT_REG || e->type == DT_DIR)
+		return e->type;
+
+	if (st == NULL)
+		st = &buf;
+	if (fstatat(dfd, e->name, st, 0) < 0)
+		return -errno;
+
+	return IFTODT(st->st_mode);
+}
+
+struct dirwalk {
+	dirwalk_fn fn;
+	void *data;
+	int dfd;
+	size_t baselen; /* where paths relative to dfd start */
+
+	/* only used with threads */
+	bool threaded;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct array queue; /* paths of the directories to read */
+	unsigned int pending; /* directories queued or being read */
+	bool stop;
+	int err;
+};
+
+static int dirwalk_push(struct dirwalk *w, const char *path)
+{
+	char *p = strdup(path);
+
+	if (p == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&w->lock);
+	if (array_append(&w->queue, p) < 0) {
+		pthread_mutex_unlock(&w->lock);
+		free(p);
+		return -ENOMEM;
+	}
+	w->pending++;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+/* Tell the callback that the directory in @e couldn't be read */
+static int dirwalk_dir_error(struct dirwalk *w, struct dirwalk_entry *e,
+								int err)
+{
+	int action;
+
+	e->err = err;
+	action = w->fn(e, w->data);
+	if (action < 0 || action == DIRWALK_STOP)
+		return action;
+
+	return 0;
+}
+
+/* Walk the entries of @r, whose path is @path, @len long and ending in '/' */
+static int dirwalk_dir(struct dirwalk *w, struct dir_reader *r, char *path,
+								size_t len)
+{
+	struct dir_entry de;
+	int ret;
+
+	while ((ret = dir_reader_next(r, &de)) > 0) {
+		struct dirwalk_entry e;
+		struct stat st;
+		int action;
+
+		if (w->threaded && __atomic_load_n(&w->stop, __ATOMIC_RELAXED))
+			return DIRWALK_STOP;
+
+		e.dfd = r->fd;
+		e.path = path;
+		e.namelen = de.namelen;
+		e.st = NULL;
+		e.err = 0;
+
+		/* room for a '/' if it's a directory */
+		if (len + de.namelen + 2 > PATH_MAX) {
+			path[len] = '\0';
+			e.name = de.name;
+			e.type = DT_UNKNOWN;
+			e.err = -ENAMETOOLONG;
+			action = w->fn(&e, w->data);
+			if (action < 0 || action == DIRWALK_STOP)
+				return action;
+			continue;
+		}
+
+		memcpy(path + len, de.name, de.namelen + 1);
+		e.name = path + len;
+		e.type = dir_entry_type(r->fd, &de, &st);
+		if (e.type < 0) {
+			e.err = e.type;
+			e.type = DT_UNKNOWN;
+		} else if (de.type != DT_REG && de.type != DT_DIR) {
+			e.st = &st;
+		}
+
+		action = w->fn(&e, w->data);
+		if (action < 0 || action == DIRWALK_STOP)
+			return action;
+		if (e.err < 0 || e.type != DT_DIR || action == DIRWALK_SKIP)
+			continue;
+
+		path[len + de.namelen] = '/';
+		path[len + de.namelen + 1] = '\0';
+
+		if (w->threaded) {
+			ret = dirwalk_push(w, path);
+			if (ret < 0)
+				return ret;
+		} else {
+			struct dir_reader sub;
+
+			ret = dir_reader_open(&sub, r->fd, e.name);
+			if (ret < 0) {
+				ret = dirwalk_dir_error(w, &e, ret);
+				if (ret != 0)
+					return ret;
+				continue;
+			}
+
+			ret = dirwalk_dir(w, &sub, path,
+						len + de.namelen + 1);
+			dir_reader_close(&sub);
+			if (ret != 0)
+				return ret;
+		}
+	}
+
+	return ret;
+}
+
+/* Account for a directory read by a thread, @ret as from dirwalk_dir() */
+static void dirwalk_done(struct dirwalk *w, int ret)
+{
+	pthread_mutex_lock(&w->lock);
+	w->pending--;
+	if (ret != 0 && !w->stop) {
+		__atomic_store_n(&w->stop, true, __ATOMIC_RELAXED);
+		w->err = ret < 0 ? ret : 0;
+	}
+	if (w->pending == 0 || w->stop)
+		pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void *dirwalk_thread(void *data)
+{
+	struct dirwalk *w = data;
+	char path[PATH_MAX];
+
+	for (;;) {
+		struct dir_reader r;
+		char *p;
+		size_t len;
+		int ret;
+
+		pthread_mutex_lock(&w->lock);
+		while (w->queue.count == 0 && w->pending > 0 && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->queue.count == 0 || w->stop) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		p = w->queue.array[w->queue.count - 1];
+		array_pop(&w->queue);
+		pthread_mutex_unlock(&w->lock);
+
+		len = strlen(p);
+		memcpy(path, p, len + 1);
+		free(p);
+
+		ret = dir_reader_open(&r, w->dfd, path + w->baselen);
+		if (ret < 0) {
+			struct dirwalk_entry e = {
+				.dfd = w->dfd,
+				.path = path,
+				.name = path + w->baselen,
+				.namelen = len - w->baselen,
+				.type = DT_DIR,
+			};
+
+			ret = dirwalk_dir_error(w, &e, ret);
+		} else {
+			ret = dirwalk_dir(w, &r, path, len);
+			dir_reader_close(&r);
+		}
+
+		dirwalk_done(w, ret);
+	}
+
+	return NULL;
+}
+
+int dirwalk(int dfd, const char *path, unsigned int n_threads, dirwalk_fn fn,
+								void *data)
+{
+	struct dirwalk w = {
+		.fn = fn,
+		.data = data,
+		.dfd = dfd,
+	};
+	char buf[PATH_MAX];
+	pthread_t *threads;
+	struct dir_reader r;
+	unsigned int i, n = 0;
+	size_t len = strlen(path);
+	int ret;
+
+	if (len + 2 > PATH_MAX)
+		return -ENAMETOOLONG;
+	memcpy(buf, path, len);
+	buf[len++] = '/';
+	buf[len] = '\0';
+	w.baselen = len;
+
+	ret = dir_reader_open(&r, dfd, ".");
+	if (ret < 0)
+		return ret;
+
+	if (n_threads <= 1) {
+		ret = dirwalk_dir(&w, &r, buf, len);
+		dir_reader_close(&r);
+		return ret < 0 ? ret : 0;
+	}
+
+	w.threaded = true;
+	w.pending = 1;
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	array_init(&w.queue, 64);
+
+	/* if threads can't be created, the ones running do all the work */
+	threads = malloc((n_threads - 1) * sizeof(*threads));
+	for (i = 0; threads != NULL && i < n_threads - 1; i++) {
+		if (pthread_create(&threads[n], NULL, dirwalk_thread, &w) != 0)
+			break;
+		n++;
+	}
+
+	ret = dirwalk_dir(&w, &r, buf, len);
+	dir_reader_close(&r);
+	dirwalk_done(&w, ret);
+	dirwalk_thread(&w);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	/* left when stopped early */
+	for (i = 0; i < w.queue.count; i++)
+		free(w.queue.array[i]);
+	array_free_array(&w.queue);
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.lock);
+
+	return w.err;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/*
+ * Directory reader using getdents64() with a large buffer, so that reading a
+ * big directory takes few system calls. "." and ".." are skipped.
+ */
+struct dir_reader {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t pos;
+};
+
+struct dir_entry {
+	const char *name; /* valid until the next call to dir_reader_next() */
+	size_t namelen;
+	unsigned char type; /* d_type: DT_UNKNOWN if the filesystem doesn't tell */
+};
+
+/* Both take ownership of @fd, closing it on failure */
+int dir_reader_init(struct dir_reader *r, int fd);
+int dir_reader_open(struct dir_reader *r, int dfd, const char *name);
+void dir_reader_close(struct dir_reader *r);
+
+/* 1 with the next entry in @e, 0 at the end, < 0 on errors */
+int dir_reader_next(struct dir_reader *r, struct dir_entry *e);
+
+/*
+ * Type of @e in @dfd as a DT_* value, following symlinks. d_type is used when
+ * it's conclusive, otherwise the entry is stat'ed into @st if not NULL. Returns
+ * -errno if fstatat() fails.
+ */
+int dir_entry_type(int dfd, const struct dir_entry *e, struct stat *st);
+
+enum dirwalk_action {
+	DIRWALK_CONTINUE = 0,
+	DIRWALK_SKIP = 1, /* don't walk into this directory */
+	DIRWALK_STOP = 2,
+};
+
+struct dirwalk_entry {
+	int dfd; /* directory it's in */
+	const char *path; /* the path given to dirwalk() followed by the entry's */
+	const char *name;
+	size_t namelen;
+	int type; /* DT_*, symlinks followed */
+	const struct stat *st; /* set if it had to be stat'ed to find the type */
+	/*
+	 * < 0 if the type couldn't be found, or with DT_DIR when the
+	 * directory couldn't be read: the callback is then called a second
+	 * time for it. With -ENAMETOOLONG, path is just the directory's.
+	 */
+	int err;
+};
+
+typedef int (*dirwalk_fn)(const struct dirwalk_entry *e, void *data);
+
+/*
+ * Call @fn for every entry under the directory @dfd, whose name is @path, and
+ * walk into the directories it returns DIRWALK_CONTINUE for. With a single
+ * thread, entries are seen depth first and in the order the filesystem
+ * returns them. With more, directories are read by up to @n_threads threads
+ * in no particular order and @fn must be thread-safe.
+ *
+ * The walk ends when @fn returns DIRWALK_STOP, 0 is returned then, or an error,
+ * which is returned.
+ */
+int dirwalk(int dfd, const char *path, unsigned int n_threads, dirwalk_fn fn,
+								void *data);
@@ -86,6 +86,30 @@ void hash_free(struct hash *hash)
 	free(hash);
 }
 
+/*
+ * FNV-1a followed by murmur3's finalizer, with a seed to select different
+ * functions from the same family. Unlike hash_superfast() the result doesn't
+ * depend on the host endianness, so it can be stored: it's used by the
+ * perfect hash tables in the index files and must not change.
+ */
+uint32_t hash_str_seeded(const char *key, uint32_t seed)
+{
+	uint32_t h = 2166136261U ^ (seed * 0x9e3779b9U);
+
+	for (; *key != '\0'; key++) {
+		h ^= (uint8_t) *key;
+		h *= 16777619U;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+
+	return h;
+}
+
 static inline unsigned int hash_superfast(const char *key, unsigned int len)
 {
 	/* Paul Hsieh (http://www.azillionmonkeys.com/qed/hash.html)
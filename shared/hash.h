@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct hash;
 
@@ -20,3 +21,4 @@ unsigned int hash_get_count(const struct hash *hash);
 void hash_iter_init(const struct hash *hash, struct hash_iter *iter);
 bool hash_iter_next(struct hash_iter *iter, const char **key,
 							const void **value);
+uint32_t hash_str_seeded(const char *key, uint32_t seed);
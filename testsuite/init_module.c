@@ -39,6 +39,7 @@
 #include <sys/types.h>
 #include <sys/utsname.h>
 
+#include <shared/missing.h>
 #include <shared/util.h>
 
 /* kmod_elf_get_section() is not exported, we need the private header */
@@ -301,6 +302,50 @@ static int check_kernel_version(int major, int minor)
 }
 
 
+/*
+ * Decompress the module behind @fd like the kernel does, which only knows the
+ * compression in /sys/module/compression
+ */
+static int finit_module_compressed(const int fd, const char *args)
+{
+	char procpath[64], path[PATH_MAX];
+	struct kmod_file *file;
+	ssize_t len;
+	int err;
+
+	init_retcodes();
+
+	snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", fd);
+	len = readlink(procpath, path, sizeof(path) - 1);
+	if (len < 0)
+		return -1;
+	path[len] = '\0';
+
+	file = kmod_file_open(ctx, path);
+	if (file == NULL)
+		return -1;
+
+	if (kmod_file_get_compression(file) == KMOD_FILE_COMPRESSION_NONE ||
+	    kmod_file_get_compression(file) != kmod_get_kernel_compression(ctx)) {
+		kmod_file_unref(file);
+		errno = EINVAL;
+		return -1;
+	}
+
+	err = kmod_file_load_contents(file);
+	if (err < 0) {
+		kmod_file_unref(file);
+		errno = -err;
+		return -1;
+	}
+
+	err = init_module(kmod_file_get_contents(file),
+					kmod_file_get_size(file), args);
+	kmod_file_unref(file);
+
+	return err;
+}
+
 TS_EXPORT int finit_module(const int fd, const char *args, const int flags);
 
 int finit_module(const int fd, const char *args, const int flags)
@@ -314,6 +359,8 @@ int finit_module(const int fd, const char *args, const int flags)
 		errno = ENOSYS;
 		return -1;
 	}
+	if (flags & MODULE_INIT_COMPRESSED_FILE)
+		return finit_module_compressed(fd, args);
 	if (fstat(fd, &st) < 0)
 		return -1;
 
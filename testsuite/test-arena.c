@@ -0,0 +1,112 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <shared/arena.h>
+
+#include "testsuite.h"
+
+static int test_arena_alloc(const struct test *t)
+{
+	struct arena arena;
+	char *p[100];
+	uintptr_t misalign;
+	unsigned int i;
+
+	arena_init(&arena, 256);
+
+	for (i = 0; i < 100; i++) {
+		p[i] = arena_alloc(&arena, i + 1);
+		assert_return(p[i] != NULL, EXIT_FAILURE);
+		misalign = (uintptr_t) p[i] & (_Alignof(max_align_t) - 1);
+		assert_return(misalign == 0, EXIT_FAILURE);
+		memset(p[i], i, i + 1);
+	}
+
+	/* nothing got overwritten by later allocations */
+	for (i = 0; i < 100; i++) {
+		unsigned int j;
+
+		for (j = 0; j <= i; j++)
+			assert_return(p[i][j] == (char) i, EXIT_FAILURE);
+	}
+
+	arena_release(&arena);
+
+	return 0;
+}
+DEFINE_TEST(test_arena_alloc,
+		.description = "test arena allocations are aligned and don't overlap");
+
+static int test_arena_bump(const struct test *t)
+{
+	struct arena arena;
+	char *a, *b, *big, *c;
+
+	arena_init(&arena, 1024);
+
+	a = arena_alloc(&arena, 1);
+	b = arena_alloc(&arena, 1);
+	assert_return(b == a + _Alignof(max_align_t), EXIT_FAILURE);
+
+	/* a big allocation doesn't take over the current block */
+	big = arena_zalloc(&arena, 4096);
+	assert_return(big != NULL, EXIT_FAILURE);
+	assert_return(big[0] == 0 && big[4095] == 0, EXIT_FAILURE);
+	c = arena_alloc(&arena, 1);
+	assert_return(c == b + _Alignof(max_align_t), EXIT_FAILURE);
+
+	arena_release(&arena);
+
+	return 0;
+}
+DEFINE_TEST(test_arena_bump,
+		.description = "test arena allocations are consecutive in a block");
+
+static int test_arena_strdup(const struct test *t)
+{
+	static const char *const strs[] = { "", "a", "test_arena_strdup" };
+	struct arena arena;
+	unsigned int i;
+
+	arena_init(&arena, 0);
+
+	for (i = 0; i < 3; i++) {
+		char *s = arena_strdup(&arena, strs[i]);
+
+		assert_return(s != NULL, EXIT_FAILURE);
+		assert_return(s != strs[i], EXIT_FAILURE);
+		assert_return(strcmp(s, strs[i]) == 0, EXIT_FAILURE);
+	}
+
+	arena_release(&arena);
+
+	/* arena can be used again after release */
+	assert_return(arena_strdup(&arena, strs[2]) != NULL, EXIT_FAILURE);
+	arena_release(&arena);
+
+	return 0;
+}
+DEFINE_TEST(test_arena_strdup,
+		.description = "test arena string duplication and reuse after release");
+
+TESTSUITE_MAIN();
@@ -15,13 +15,20 @@
  * License along with this library; if not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "testsuite.h"
 
@@ -56,6 +63,314 @@ DEFINE_TEST(depmod_modules_order_for_compressed,
 	});
 #endif
 
+static int run_depmod(const char *const args[])
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	if (pid == 0)
+		test_spawn_prog(args[0], args);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+					WEXITSTATUS(status) != EXIT_SUCCESS)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int set_mtime(const char *path, time_t mtime)
+{
+	const struct timespec ts[2] = {
+		{ .tv_sec = mtime },
+		{ .tv_sec = mtime },
+	};
+
+	return utimensat(AT_FDCWD, path, ts, AT_SYMLINK_NOFOLLOW);
+}
+
+static time_t get_mtime(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return 0;
+	return st.st_mtime;
+}
+
+#ifdef ENABLE_ZLIB
+static const struct keyval modules_order_alias[] = {
+	{ MODULES_ORDER_LIB_MODULES "/correct-modules.alias",
+	  MODULES_ORDER_LIB_MODULES "/modules.alias" },
+	{ }
+};
+
+/* All that a plain serial run writes as text */
+static const struct keyval modules_order_files[] = {
+	{ MODULES_ORDER_LIB_MODULES "/correct-modules.dep",
+	  MODULES_ORDER_LIB_MODULES "/modules.dep" },
+	{ MODULES_ORDER_LIB_MODULES "/correct-modules.alias",
+	  MODULES_ORDER_LIB_MODULES "/modules.alias" },
+	{ MODULES_ORDER_LIB_MODULES "/correct-modules.symbols",
+	  MODULES_ORDER_LIB_MODULES "/modules.symbols" },
+	{ }
+};
+
+#define DEFINE_MODULES_ORDER_TEST(_name, _description, _files)		\
+	DEFINE_TEST(_name,						\
+		.description = _description,				\
+		.config = {						\
+			[TC_UNAME_R] = MODULES_ORDER_UNAME,		\
+			[TC_ROOTFS] = MODULES_ORDER_ROOTFS,		\
+		},							\
+		.output = {						\
+			.files = _files,				\
+		})
+
+static noreturn void modules_order_spawn(const char *option)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		option,
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+
+static bool files_equal(const char *a, const char *b)
+{
+	FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+	bool eq = fa != NULL && fb != NULL;
+	int ca, cb;
+
+	while (eq) {
+		ca = getc(fa);
+		cb = getc(fb);
+		if (ca != cb)
+			eq = false;
+		else if (ca == EOF)
+			break;
+	}
+
+	if (fa != NULL)
+		fclose(fa);
+	if (fb != NULL)
+		fclose(fb);
+
+	return eq;
+}
+
+static noreturn int depmod_modules_order_for_compressed_jobs(const struct test *t)
+{
+	modules_order_spawn("--jobs=4");
+}
+DEFINE_MODULES_ORDER_TEST(depmod_modules_order_for_compressed_jobs,
+	"check if depmod -j generates the same output as a serial run",
+	modules_order_files);
+
+static noreturn int depmod_modules_order_for_compressed_sync(const struct test *t)
+{
+	modules_order_spawn("--sync");
+}
+DEFINE_MODULES_ORDER_TEST(depmod_modules_order_for_compressed_sync,
+	"check if depmod --sync generates the same output as a run without it",
+	modules_order_alias);
+
+/* Content of @path, NUL terminated, to be released with free() */
+static char *file_read(const char *path, size_t *size)
+{
+	struct stat st;
+	char *buf = NULL;
+	int fd;
+
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)) != NULL) {
+		if (read(fd, buf, st.st_size) == st.st_size) {
+			buf[st.st_size] = '\0';
+			*size = st.st_size;
+		} else {
+			free(buf);
+			buf = NULL;
+		}
+	}
+	close(fd);
+
+	return buf;
+}
+
+/*
+ * Overwrite the first @old after @after in modules.cache with @new, of the
+ * same length, so the outputs show whether the entry was reused.
+ */
+static int modules_order_cache_patch(const char *after, const char *old,
+							const char *new)
+{
+	const char *path = MODULES_ORDER_LIB_MODULES "/modules.cache";
+	char *buf, *p;
+	size_t size;
+	int fd, err = -ENOENT;
+
+	buf = file_read(path, &size);
+	if (buf == NULL)
+		return -errno;
+
+	p = memmem(buf, size, after, strlen(after));
+	if (p != NULL)
+		p = memmem(p, size - (p - buf), old, strlen(old));
+	if (p != NULL) {
+		memcpy(p, new, strlen(new));
+		fd = open(path, O_WRONLY|O_TRUNC|O_CLOEXEC);
+		err = fd >= 0 && write(fd, buf, size) == (ssize_t)size ?
+								0 : -EIO;
+		if (fd >= 0)
+			close(fd);
+	}
+
+	free(buf);
+	return err;
+}
+
+/*
+ * The first run writes modules.cache and the second one takes all the
+ * modules from it. Then the symbol exported by scsi_mod is renamed in the
+ * cache: the third run must export the new name, which it can only get from
+ * there. The last run parses scsi_mod again since it was touched before it.
+ */
+static noreturn int depmod_modules_order_for_compressed_cache(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		"--cache",
+		NULL,
+	};
+	const char *touched = MODULES_ORDER_LIB_MODULES
+				"/kernel/drivers/scsi/scsi_mod.ko.gz";
+	const struct keyval *k;
+	char *symbols;
+	size_t size;
+	bool reused;
+
+	/* left by a previous run */
+	unlink(MODULES_ORDER_LIB_MODULES "/modules.cache");
+
+	if (run_depmod(args) < 0 ||
+		access(MODULES_ORDER_LIB_MODULES "/modules.cache", F_OK) < 0 ||
+		run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	for (k = modules_order_files; k->key != NULL; k++) {
+		if (!files_equal(k->key, k->val))
+			exit(EXIT_FAILURE);
+	}
+
+	if (modules_order_cache_patch("kernel/drivers/scsi/scsi_mod.ko.gz",
+					"dummy_export", "dummy_exporx") < 0 ||
+			run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	symbols = file_read(MODULES_ORDER_LIB_MODULES "/modules.symbols",
+									&size);
+	reused = symbols != NULL &&
+		strstr(symbols, "alias symbol:dummy_exporx scsi_mod\n") != NULL;
+	free(symbols);
+	if (!reused)
+		exit(EXIT_FAILURE);
+
+	if (set_mtime(touched, get_mtime(touched) + 1) < 0)
+		exit(EXIT_FAILURE);
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_MODULES_ORDER_TEST(depmod_modules_order_for_compressed_cache,
+	"check if depmod --cache generates the same output as a run without it",
+	modules_order_files);
+
+/* Times, memory and sizes vary from run to run */
+static bool stats_key_varies(const char *key, size_t len)
+{
+	return (len > 3 && memcmp(key + len - 3, "_us", 3) == 0) ||
+		(len > 4 && memcmp(key + len - 4, "_kib", 4) == 0) ||
+		(len == 4 && memcmp(key, "size", 4) == 0);
+}
+
+/*
+ * Print what depmod --stats=json prints with 0 as the value of the keys
+ * that vary, so the rest can be checked against the expected output.
+ */
+static noreturn int depmod_modules_order_for_compressed_stats(const struct test *t)
+{
+	char buf[8192];
+	const char *p, *key;
+	size_t len = 0;
+	ssize_t r;
+	int fd[2], status;
+	pid_t pid;
+
+	if (pipe(fd) < 0)
+		exit(EXIT_FAILURE);
+
+	pid = fork();
+	if (pid < 0)
+		exit(EXIT_FAILURE);
+	if (pid == 0) {
+		close(fd[0]);
+		if (dup2(fd[1], STDOUT_FILENO) < 0)
+			exit(EXIT_FAILURE);
+		modules_order_spawn("--stats=json");
+	}
+
+	close(fd[1]);
+	while (len < sizeof(buf) - 1 &&
+		(r = read(fd[0], buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += r;
+	close(fd[0]);
+	buf[len] = '\0';
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+					WEXITSTATUS(status) != EXIT_SUCCESS)
+		exit(EXIT_FAILURE);
+
+	for (p = buf; *p != '\0'; p++) {
+		putchar(*p);
+		if (*p != ':' || p == buf || p[-1] != '"')
+			continue;
+
+		for (key = p - 1; key > buf && key[-1] != '"'; key--)
+			;
+		if (!stats_key_varies(key, p - 1 - key))
+			continue;
+
+		putchar('0');
+		while (isdigit(p[1]))
+			p++;
+	}
+
+	fflush(stdout);
+	exit(EXIT_SUCCESS);
+}
+DEFINE_TEST(depmod_modules_order_for_compressed_stats,
+	.description = "check if depmod --stats=json prints the expected keys",
+	.config = {
+		[TC_UNAME_R] = MODULES_ORDER_UNAME,
+		[TC_ROOTFS] = MODULES_ORDER_ROOTFS,
+	},
+	.need_spawn = true,
+	.output = {
+		.out = MODULES_ORDER_LIB_MODULES "/correct-stats.json",
+		.files = modules_order_alias,
+	});
+#endif
+
 #define SEARCH_ORDER_SIMPLE_ROOTFS TESTSUITE_ROOTFS "test-depmod/search-order-simple"
 static noreturn int depmod_search_order_simple(const struct test *t)
 {
@@ -131,4 +446,115 @@ DEFINE_TEST(depmod_detect_loop,
 		.err = DETECT_LOOP_ROOTFS "/correct.txt",
 	});
 
+#define BIG_TREE_ROOTFS TESTSUITE_ROOTFS "test-depmod/big-tree"
+#define BIG_TREE_LIB_MODULES BIG_TREE_ROOTFS "/lib/modules/4.4.4"
+#define BIG_TREE_N_MODULES 200000
+static noreturn int depmod_big_tree(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		NULL,
+	};
+	char line[PATH_MAX];
+	unsigned int i, n_users = 0;
+	FILE *fp;
+
+	/* many copies of mod-foo, each one depending on mod-foo-{a,b,c} */
+	if (mkdir(BIG_TREE_LIB_MODULES "/kernel/big", 0755) < 0 &&
+							errno != EEXIST)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < BIG_TREE_N_MODULES; i++) {
+		snprintf(line, sizeof(line),
+			 BIG_TREE_LIB_MODULES "/kernel/big/mod-big-%u.ko", i);
+		if (symlink("../mod-foo.ko", line) < 0 && errno != EEXIST)
+			exit(EXIT_FAILURE);
+	}
+
+	if (run_depmod(args) < 0)
+		exit(EXIT_FAILURE);
+
+	fp = fopen(BIG_TREE_LIB_MODULES "/modules.dep", "r");
+	if (fp == NULL)
+		exit(EXIT_FAILURE);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strstr(line, " kernel/mod-foo-a.ko") &&
+				strstr(line, " kernel/mod-foo-b.ko") &&
+				strstr(line, " kernel/mod-foo-c.ko"))
+			n_users++;
+	}
+	fclose(fp);
+
+	exit(n_users == BIG_TREE_N_MODULES + 1 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+DEFINE_TEST(depmod_big_tree,
+	.description = "check if depmod handles more than 65535 modules",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = BIG_TREE_ROOTFS,
+	},
+	.timeout = 60);
+
+#define QUICK_ROOTFS TESTSUITE_ROOTFS "test-depmod/quick-manifest"
+#define QUICK_LIB_MODULES QUICK_ROOTFS "/lib/modules/4.4.4"
+static noreturn int depmod_quick_manifest(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/depmod";
+	const char *const args[] = {
+		progname,
+		NULL,
+	};
+	const char *const quick_args[] = {
+		progname,
+		"-A",
+		NULL,
+	};
+	static const char *const modules[] = {
+		QUICK_LIB_MODULES "/kernel/mod-foo.ko",
+		QUICK_LIB_MODULES "/kernel/mod-foo-a.ko",
+		QUICK_LIB_MODULES "/kernel/mod-foo-b.ko",
+		QUICK_LIB_MODULES "/kernel/mod-foo-c.ko",
+	};
+	const time_t old = 1500000000, dep_mtime = 1600000000;
+	size_t i;
+
+	/* left by a previous run */
+	unlink(QUICK_LIB_MODULES "/kernel/mod-new.ko");
+
+	for (i = 0; i < sizeof(modules) / sizeof(modules[0]); i++) {
+		if (set_mtime(modules[i], old) < 0)
+			exit(EXIT_FAILURE);
+	}
+
+	/* directories must be old enough for their mtime to be trusted */
+	if (set_mtime(QUICK_LIB_MODULES "/kernel", old) < 0 ||
+			run_depmod(args) < 0 ||
+			set_mtime(QUICK_LIB_MODULES "/modules.dep",
+							dep_mtime) < 0)
+		exit(EXIT_FAILURE);
+
+	/* nothing changed */
+	if (run_depmod(quick_args) < 0 ||
+		get_mtime(QUICK_LIB_MODULES "/modules.dep") != dep_mtime)
+		exit(EXIT_FAILURE);
+
+	/* a new module, older than modules.dep but not there before */
+	if (symlink("mod-foo.ko", QUICK_LIB_MODULES "/kernel/mod-new.ko") < 0 ||
+			set_mtime(QUICK_LIB_MODULES "/kernel/mod-new.ko",
+								old) < 0 ||
+			run_depmod(quick_args) < 0 ||
+			get_mtime(QUICK_LIB_MODULES "/modules.dep") == dep_mtime)
+		exit(EXIT_FAILURE);
+
+	exit(EXIT_SUCCESS);
+}
+DEFINE_TEST(depmod_quick_manifest,
+	.description = "check if depmod -A uses the manifest of the last run",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = QUICK_ROOTFS,
+	});
+
 TESTSUITE_MAIN();
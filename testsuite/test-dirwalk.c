@@ -0,0 +1,217 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <shared/dirwalk.h>
+#include <shared/util.h>
+
+#include "testsuite.h"
+
+#define DIRWALK_ROOT TESTSUITE_ROOTFS "test-dirwalk"
+#define N_BIG 2000 /* entries that don't fit in one getdents64() call */
+
+struct walk_count {
+	unsigned int files;
+	unsigned int dirs;
+	unsigned int links;
+	unsigned int skipped_seen;
+	unsigned int errors;
+	unsigned int stop_after;
+};
+
+static int rm_entry(const char *path, const struct stat *st, int flag,
+							struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static void tree_remove(void)
+{
+	nftw(DIRWALK_ROOT, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * big/ with N_BIG files, small/ with one file in a subdirectory, skip/ whose
+ * content must not be seen and link, a symlink to small/.
+ */
+static int tree_create(void)
+{
+	char name[32];
+	int dfd, fd, i;
+
+	tree_remove();
+	if (mkdir(DIRWALK_ROOT, 0755) < 0)
+		return -errno;
+	dfd = open(DIRWALK_ROOT, O_RDONLY|O_DIRECTORY);
+	if (dfd < 0)
+		return -errno;
+
+	if (mkdirat(dfd, "big", 0755) < 0 ||
+	    mkdirat(dfd, "small", 0755) < 0 ||
+	    mkdirat(dfd, "small/sub", 0755) < 0 ||
+	    mkdirat(dfd, "skip", 0755) < 0 ||
+	    symlinkat("small", dfd, "link") < 0)
+		goto fail;
+
+	for (i = 0; i < N_BIG; i++) {
+		snprintf(name, sizeof(name), "big/file-%04d.ko", i);
+		fd = openat(dfd, name, O_WRONLY|O_CREAT|O_EXCL, 0644);
+		if (fd < 0)
+			goto fail;
+		close(fd);
+	}
+
+	fd = openat(dfd, "small/sub/file.ko", O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (fd < 0)
+		goto fail;
+	close(fd);
+	fd = openat(dfd, "skip/hidden.ko", O_WRONLY|O_CREAT|O_EXCL, 0644);
+	if (fd < 0)
+		goto fail;
+	close(fd);
+
+	close(dfd);
+	return 0;
+
+fail:
+	close(dfd);
+	return -errno;
+}
+
+static int count_entry(const struct dirwalk_entry *e, void *data)
+{
+	struct walk_count *c = data;
+	unsigned int files;
+
+	if (e->err < 0) {
+		__atomic_fetch_add(&c->errors, 1, __ATOMIC_RELAXED);
+		return DIRWALK_CONTINUE;
+	}
+
+	if (strstr(e->path, "/skip/") != NULL)
+		__atomic_fetch_add(&c->skipped_seen, 1, __ATOMIC_RELAXED);
+
+	if (e->type == DT_DIR) {
+		__atomic_fetch_add(&c->dirs, 1, __ATOMIC_RELAXED);
+		if (streq(e->name, "link")) {
+			/* it had to be stat'ed to find out it's a directory */
+			if (e->st != NULL)
+				__atomic_fetch_add(&c->links, 1,
+							__ATOMIC_RELAXED);
+			return DIRWALK_SKIP;
+		}
+		if (streq(e->name, "skip"))
+			return DIRWALK_SKIP;
+		return DIRWALK_CONTINUE;
+	}
+
+	files = __atomic_add_fetch(&c->files, 1, __ATOMIC_RELAXED);
+	if (c->stop_after > 0 && files == c->stop_after)
+		return DIRWALK_STOP;
+
+	return DIRWALK_CONTINUE;
+}
+
+static int walk(unsigned int n_threads, struct walk_count *c)
+{
+	int dfd, err;
+
+	dfd = open(DIRWALK_ROOT, O_RDONLY|O_DIRECTORY);
+	if (dfd < 0)
+		return -errno;
+	err = dirwalk(dfd, DIRWALK_ROOT, n_threads, count_entry, c);
+	close(dfd);
+
+	return err;
+}
+
+static int test_dirwalk_serial(const struct test *t)
+{
+	struct walk_count c = { };
+	int err;
+
+	assert_return(tree_create() == 0, EXIT_FAILURE);
+
+	err = walk(1, &c);
+	tree_remove();
+
+	assert_return(err == 0, EXIT_FAILURE);
+	assert_return(c.files == N_BIG + 1, EXIT_FAILURE);
+	/* big, small, small/sub, skip and link */
+	assert_return(c.dirs == 5, EXIT_FAILURE);
+	assert_return(c.links == 1, EXIT_FAILURE);
+	assert_return(c.skipped_seen == 0, EXIT_FAILURE);
+	assert_return(c.errors == 0, EXIT_FAILURE);
+
+	return 0;
+}
+DEFINE_TEST(test_dirwalk_serial,
+		.description = "test walking a tree with a single thread");
+
+static int test_dirwalk_threads(const struct test *t)
+{
+	struct walk_count c = { };
+	int err;
+
+	assert_return(tree_create() == 0, EXIT_FAILURE);
+
+	err = walk(4, &c);
+	tree_remove();
+
+	assert_return(err == 0, EXIT_FAILURE);
+	assert_return(c.files == N_BIG + 1, EXIT_FAILURE);
+	assert_return(c.dirs == 5, EXIT_FAILURE);
+	assert_return(c.links == 1, EXIT_FAILURE);
+	assert_return(c.skipped_seen == 0, EXIT_FAILURE);
+	assert_return(c.errors == 0, EXIT_FAILURE);
+
+	return 0;
+}
+DEFINE_TEST(test_dirwalk_threads,
+		.description = "test walking a tree with several threads sees the same entries");
+
+static int test_dirwalk_stop(const struct test *t)
+{
+	struct walk_count c = { .stop_after = 10 };
+	struct walk_count ct = { .stop_after = 10 };
+	int err, err_threads;
+
+	assert_return(tree_create() == 0, EXIT_FAILURE);
+
+	err = walk(1, &c);
+	err_threads = walk(4, &ct);
+	tree_remove();
+
+	assert_return(err == 0, EXIT_FAILURE);
+	assert_return(c.files == 10, EXIT_FAILURE);
+	/* threads already reading a directory may see a few more */
+	assert_return(err_threads == 0, EXIT_FAILURE);
+	assert_return(ct.files >= 10 && ct.files < N_BIG + 1, EXIT_FAILURE);
+
+	return 0;
+}
+DEFINE_TEST(test_dirwalk_stop,
+		.description = "test stopping a walk early");
+
+TESTSUITE_MAIN();
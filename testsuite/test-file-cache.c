@@ -0,0 +1,178 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <shared/util.h>
+
+#include <libkmod/libkmod.h>
+
+#include "testsuite.h"
+
+#ifdef ENABLE_ZLIB
+#define CACHE_DIR TESTSUITE_ROOTFS "test-file-cache"
+#define MODULE_GZ TESTSUITE_ROOTFS \
+	"test-depmod/modules-order-compressed/lib/modules/4.4.4/kernel/drivers/block/cciss.ko.gz"
+
+static void cache_dir_remove(void)
+{
+	DIR *d = opendir(CACHE_DIR);
+	struct dirent *de;
+
+	if (d != NULL) {
+		while ((de = readdir(d)) != NULL) {
+			if (!streq(de->d_name, ".") && !streq(de->d_name, ".."))
+				unlinkat(dirfd(d), de->d_name, 0);
+		}
+		closedir(d);
+	}
+	rmdir(CACHE_DIR);
+}
+
+/* Number of entries in the cache, the last one in @st */
+static int cache_dir_entries(struct stat *st)
+{
+	DIR *d = opendir(CACHE_DIR);
+	struct dirent *de;
+	int n = 0;
+
+	if (d == NULL)
+		return -errno;
+
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (fstatat(dirfd(d), de->d_name, st, 0) < 0)
+			break;
+		n++;
+	}
+	closedir(d);
+
+	return n;
+}
+
+static void cache_dir_chmod_entries(mode_t mode)
+{
+	DIR *d = opendir(CACHE_DIR);
+	struct dirent *de;
+
+	if (d == NULL)
+		return;
+
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] != '.')
+			fchmodat(dirfd(d), de->d_name, mode, 0);
+	}
+	closedir(d);
+}
+
+/* Number of modinfo entries, read with a new context using the cache */
+static int module_info_count(void)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	struct kmod_module *mod;
+	struct kmod_list *list = NULL, *l;
+	int err, n = 0;
+
+	ctx = kmod_new(NULL, &null_config);
+	if (ctx == NULL)
+		return -ENOMEM;
+
+	err = kmod_set_file_cache_dir(ctx, CACHE_DIR);
+	if (err < 0)
+		goto out;
+
+	err = kmod_module_new_from_path(ctx, MODULE_GZ, &mod);
+	if (err < 0)
+		goto out;
+
+	err = kmod_module_get_info(mod, &list);
+	kmod_list_foreach(l, list)
+		n++;
+	kmod_module_info_free_list(list);
+	kmod_module_unref(mod);
+
+out:
+	kmod_unref(ctx);
+	return err < 0 ? err : n;
+}
+
+static int test_file_cache_reuse(const struct test *t)
+{
+	struct stat st1, st2;
+	int n1, n2;
+
+	cache_dir_remove();
+	assert_return(mkdir(CACHE_DIR, 0755) == 0, EXIT_FAILURE);
+
+	n1 = module_info_count();
+	assert_return(n1 > 0, EXIT_FAILURE);
+	assert_return(cache_dir_entries(&st1) == 1, EXIT_FAILURE);
+
+	/* found in the cache: the entry isn't written again */
+	n2 = module_info_count();
+	assert_return(n2 == n1, EXIT_FAILURE);
+	assert_return(cache_dir_entries(&st2) == 1, EXIT_FAILURE);
+	assert_return(st1.st_ino == st2.st_ino, EXIT_FAILURE);
+
+	cache_dir_remove();
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_file_cache_reuse,
+	.description = "test decompressed modules are reused from the cache");
+
+static int test_file_cache_untrusted(const struct test *t)
+{
+	const char *null_config = NULL;
+	struct kmod_ctx *ctx;
+	struct stat st1, st2;
+	int err;
+
+	cache_dir_remove();
+	assert_return(mkdir(CACHE_DIR, 0755) == 0, EXIT_FAILURE);
+	assert_return(chmod(CACHE_DIR, 0777) == 0, EXIT_FAILURE);
+
+	ctx = kmod_new(NULL, &null_config);
+	assert_return(ctx != NULL, EXIT_FAILURE);
+	err = kmod_set_file_cache_dir(ctx, CACHE_DIR);
+	kmod_unref(ctx);
+	assert_return(err == -EPERM, EXIT_FAILURE);
+
+	/* an entry others could have written is replaced */
+	assert_return(chmod(CACHE_DIR, 0755) == 0, EXIT_FAILURE);
+	assert_return(module_info_count() > 0, EXIT_FAILURE);
+	assert_return(cache_dir_entries(&st1) == 1, EXIT_FAILURE);
+	cache_dir_chmod_entries(0666);
+
+	assert_return(module_info_count() > 0, EXIT_FAILURE);
+	assert_return(cache_dir_entries(&st2) == 1, EXIT_FAILURE);
+	assert_return(st1.st_ino != st2.st_ino, EXIT_FAILURE);
+	assert_return((st2.st_mode & 0022) == 0, EXIT_FAILURE);
+
+	cache_dir_remove();
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(test_file_cache_untrusted,
+	.description = "test cache directories and entries others can write are not used");
+#endif
+
+TESTSUITE_MAIN();
@@ -279,4 +279,18 @@ static int test_hash_massive_add_del(const struct test *t)
 DEFINE_TEST(test_hash_massive_add_del,
 		.description = "test multiple adds followed by multiple dels")
 
+static int test_hash_str_seeded(const struct test *t)
+{
+	/* values are stored in the index files, they must never change */
+	assert_return(hash_str_seeded("", 0) == 0xab3e7c0b, EXIT_FAILURE);
+	assert_return(hash_str_seeded("ext4", 0) == 0x58e96b56, EXIT_FAILURE);
+	assert_return(hash_str_seeded("ext4", 1) == 0x7b438baf, EXIT_FAILURE);
+	assert_return(hash_str_seeded("snd_hda_intel", 42) == 0xaa47ffc3,
+								EXIT_FAILURE);
+
+	return 0;
+}
+DEFINE_TEST(test_hash_str_seeded,
+		.description = "test hash_str_seeded is stable")
+
 TESTSUITE_MAIN();
@@ -70,6 +70,117 @@ DEFINE_TEST(modprobe_show_depends2,
 	});
 
 
+static noreturn int modprobe_show_depends_index_v3(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"--show-depends", "pci:v0000103Cd00003230sv0000103Csd0000323Dbc01sc04i00",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(modprobe_show_depends_index_v3,
+	.description = "check if modprobe --show-depends works with indexes in format v3",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/index-v3",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/index-v3/correct.txt",
+	});
+
+/*
+ * "wild:ab" has '*', '?' and '[' children: each pattern must be matched
+ * once, with the same result in both formats
+ */
+static noreturn void resolve_wildcards(void)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"--resolve-alias", "wild:abcd",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+
+static noreturn int modprobe_resolve_wildcards(const struct test *t)
+{
+	resolve_wildcards();
+}
+DEFINE_TEST(modprobe_resolve_wildcards,
+	.description = "check modprobe --resolve-alias with wildcard siblings in format v2",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/wildcards-v2",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/wildcards-v2/correct.txt",
+	});
+
+static noreturn int modprobe_resolve_wildcards_index_v3(const struct test *t)
+{
+	resolve_wildcards();
+}
+DEFINE_TEST(modprobe_resolve_wildcards_index_v3,
+	.description = "check modprobe --resolve-alias with wildcard siblings in format v3",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/wildcards-v3",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/wildcards-v3/correct.txt",
+	});
+
+static noreturn int modprobe_show_depends_bundle(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"--show-depends", "pci:v0000103Cd00003230sv0000103Csd0000323Dbc01sc04i00",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(modprobe_show_depends_bundle,
+	.description = "check if modprobe --show-depends works with only the modules.idx bundle",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/bundle",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/bundle/correct.txt",
+	});
+
+static noreturn int modprobe_show_depends_bundle_stale(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"--show-depends", "pci:v0000103Cd00003230sv0000103Csd0000323Dbc01sc04i00",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+DEFINE_TEST(modprobe_show_depends_bundle_stale,
+	.description = "check if modprobe ignores a modules.idx older than the other indexes",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/bundle-stale",
+	},
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-modprobe/bundle-stale/correct.txt",
+	});
+
 static noreturn int modprobe_show_alias_to_none(const struct test *t)
 {
 	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
@@ -327,6 +438,30 @@ DEFINE_TEST(modprobe_force,
 	.modules_loaded = "mod-simple",
 	);
 
+static noreturn int modprobe_compressed(const struct test *t)
+{
+	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
+	const char *const args[] = {
+		progname,
+		"mod-simple",
+		NULL,
+	};
+
+	test_spawn_prog(progname, args);
+	exit(EXIT_FAILURE);
+}
+#ifdef ENABLE_ZLIB
+DEFINE_TEST(modprobe_compressed,
+	.description = "check modprobe hands a compressed module to the kernel",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-modprobe/compressed",
+		[TC_INIT_MODULE_RETCODES] = "",
+	},
+	.modules_loaded = "mod-simple",
+	);
+#endif
+
 static noreturn int modprobe_oldkernel(const struct test *t)
 {
 	const char *progname = ABS_TOP_BUILDDIR "/tools/modprobe";
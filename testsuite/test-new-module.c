@@ -17,6 +17,7 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -115,4 +116,229 @@ DEFINE_TEST(from_alias,
 		.out = TESTSUITE_ROOTFS "test-new-module/from_alias/correct.txt",
 	});
 
+static int from_lookup_many(const struct test *t)
+{
+	static const char *const aliases[] = {
+		"pci:v0000103Cd00003230sv0000103Csd0000323Dbc01sc04i00",
+		"symbol:dummy_export",
+		"ext4",
+		"balbalbalbbalbalbalbalbalbalbal",
+		"pci:v0000103Cd00003230sv0000103Csd0000323Dbc01sc04i00",
+		"scsi_mod",
+		"pci:v0000103Cd00003238sv0000103Csd00003215bc01sc00i00",
+		"scsi",
+	};
+	const unsigned int n = sizeof(aliases) / sizeof(aliases[0]);
+	struct kmod_list *lists[sizeof(aliases) / sizeof(aliases[0])] = { };
+	struct kmod_ctx *ctx;
+	unsigned int i;
+	int err;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	err = kmod_module_new_from_lookup_many(ctx, aliases, n, lists);
+	if (err < 0)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < n; i++) {
+		struct kmod_list *l;
+
+		printf("%s:", aliases[i]);
+		kmod_list_foreach(l, lists[i]) {
+			struct kmod_module *m;
+			m = kmod_module_get_module(l);
+
+			printf(" %s", kmod_module_get_name(m));
+			kmod_module_unref(m);
+		}
+		printf("\n");
+		kmod_module_unref_list(lists[i]);
+	}
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(from_lookup_many,
+	.description = "check if a batch of aliases is resolved like one by one",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/from_lookup_many/",
+	},
+	.need_spawn = true,
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-new-module/from_lookup_many/correct.txt",
+	});
+
+static int lookup_names(struct kmod_ctx *ctx, const char *alias, char *buf,
+								size_t size)
+{
+	struct kmod_list *l, *list = NULL;
+	size_t len = 0;
+	int err;
+
+	buf[0] = '\0';
+	err = kmod_module_new_from_lookup(ctx, alias, &list);
+	if (err < 0)
+		return err;
+
+	kmod_list_foreach(l, list) {
+		struct kmod_module *m = kmod_module_get_module(l);
+
+		len += snprintf(buf + len, size - len, " %s",
+						kmod_module_get_name(m));
+		kmod_module_unref(m);
+	}
+	kmod_module_unref_list(list);
+
+	return 0;
+}
+
+static int from_lookup_cache(const struct test *t)
+{
+	static const char *const aliases[] = {
+		"pci:v0000103Cd00003230sv0000103Csd0000323Dbc01sc04i00",
+		"balbalbalbbalbalbalbalbalbalbal",
+	};
+	char first[256], second[256];
+	struct kmod_ctx *ctx;
+	uint64_t hits, misses;
+	unsigned int i;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	/* not cached without the resources loaded */
+	if (lookup_names(ctx, aliases[0], first, sizeof(first)) < 0)
+		exit(EXIT_FAILURE);
+	kmod_get_lookup_cache_stats(ctx, &hits, &misses);
+	if (hits != 0 || misses != 0)
+		exit(EXIT_FAILURE);
+
+	if (kmod_load_resources(ctx) < 0)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < 2; i++) {
+		if (lookup_names(ctx, aliases[i], first, sizeof(first)) < 0 ||
+		    lookup_names(ctx, aliases[i], second, sizeof(second)) < 0)
+			exit(EXIT_FAILURE);
+
+		printf("%s:%s\n", aliases[i], first);
+		if (strcmp(first, second) != 0)
+			exit(EXIT_FAILURE);
+	}
+
+	kmod_get_lookup_cache_stats(ctx, &hits, &misses);
+	if (hits != 2 || misses != 2)
+		exit(EXIT_FAILURE);
+
+	/* unloading the resources flushes the cache */
+	kmod_unload_resources(ctx);
+	kmod_load_resources(ctx);
+	if (lookup_names(ctx, aliases[0], first, sizeof(first)) < 0)
+		exit(EXIT_FAILURE);
+	kmod_get_lookup_cache_stats(ctx, &hits, &misses);
+	if (hits != 2 || misses != 3)
+		exit(EXIT_FAILURE);
+
+	kmod_unref(ctx);
+
+	return EXIT_SUCCESS;
+}
+DEFINE_TEST(from_lookup_cache,
+	.description = "check if lookups are cached while the resources are loaded",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/from_lookup_many/",
+	},
+	.need_spawn = true,
+	.output = {
+		.out = TESTSUITE_ROOTFS "test-new-module/from_lookup_many/correct-cache.txt",
+	});
+
+static void *lookup_thread(void *data)
+{
+	static const char *const aliases[] = {
+		"pci:v0000103Cd00003230sv0000103Csd0000323Dbc01sc04i00",
+		"symbol:dummy_export",
+		"balbalbalbbalbalbalbalbalbalbal",
+		"hpsa",
+	};
+	static const char *const expected[] = {
+		" hpsa cciss",
+		" scsi_mod",
+		"",
+		" hpsa",
+	};
+	struct kmod_ctx *ctx = data;
+	char buf[256];
+	unsigned int i;
+
+	for (i = 0; i < 1000; i++) {
+		unsigned int n = i % 4;
+		struct kmod_module *mod;
+		const char *path;
+
+		if (lookup_names(ctx, aliases[n], buf, sizeof(buf)) < 0 ||
+					strcmp(buf, expected[n]) != 0)
+			return (void *) 1;
+
+		if (kmod_module_new_from_name(ctx, "hpsa", &mod) < 0)
+			return (void *) 1;
+
+		path = kmod_module_get_path(mod);
+		if (path == NULL || strcmp(path,
+			"/lib/modules/4.4.4/kernel/drivers/scsi/hpsa.ko") != 0) {
+			kmod_module_unref(mod);
+			return (void *) 1;
+		}
+
+		kmod_module_unref(mod);
+	}
+
+	return NULL;
+}
+
+static int from_lookup_threads(const struct test *t)
+{
+	pthread_t threads[8];
+	struct kmod_ctx *ctx;
+	unsigned int i;
+	int ret = EXIT_SUCCESS;
+
+	ctx = kmod_new(NULL, NULL);
+	if (ctx == NULL)
+		exit(EXIT_FAILURE);
+
+	kmod_set_thread_safe(ctx, true);
+	kmod_set_lazy_resources(ctx, true);
+
+	for (i = 0; i < 8; i++) {
+		if (pthread_create(&threads[i], NULL, lookup_thread, ctx) != 0)
+			exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < 8; i++) {
+		void *r;
+
+		pthread_join(threads[i], &r);
+		if (r != NULL)
+			ret = EXIT_FAILURE;
+	}
+
+	kmod_unref(ctx);
+
+	return ret;
+}
+DEFINE_TEST(from_lookup_threads,
+	.description = "check if a thread-safe context can be shared by threads",
+	.config = {
+		[TC_UNAME_R] = "4.4.4",
+		[TC_ROOTFS] = TESTSUITE_ROOTFS "test-new-module/from_lookup_many/",
+	},
+	.need_spawn = true);
+
 TESTSUITE_MAIN();
@@ -353,7 +353,8 @@ static inline bool test_run_parent_check_outputs(const struct test *t,
 	}
 
 	start_usec = now_usec();
-	end_usec = start_usec + TEST_TIMEOUT_USEC;
+	end_usec = start_usec + (t->timeout > 0 ?
+			t->timeout * USEC_PER_SEC : TEST_TIMEOUT_USEC);
 
 	for (err = 0; fdmonitor >= 0 || fdout >= 0 || fderr >= 0;) {
 		int fdcount, i, timeout;
@@ -651,7 +652,8 @@ static char **read_loaded_modules(const struct test *t, char **buf, int *count)
 	}
 	bufsz = 0;
 	while ((dirent = readdir(dir))) {
-		if (dirent->d_name[0] == '.')
+		/* files such as compression aren't modules */
+		if (dirent->d_name[0] == '.' || dirent->d_type == DT_REG)
 			continue;
 		len++;
 		bufsz += strlen(dirent->d_name) + 1;
@@ -676,7 +678,7 @@ static char **read_loaded_modules(const struct test *t, char **buf, int *count)
 	while ((dirent = readdir(dir))) {
 		int size;
 
-		if (dirent->d_name[0] == '.')
+		if (dirent->d_name[0] == '.' || dirent->d_type == DT_REG)
 			continue;
 		size = strlen(dirent->d_name) + 1;
 		memcpy(p, dirent->d_name, size);
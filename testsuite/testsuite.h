@@ -104,6 +104,8 @@ struct test {
 	bool need_spawn;
 	bool expected_fail;
 	bool print_outputs;
+	/* in seconds, for tests that need more than the default */
+	unsigned int timeout;
 } __attribute__((aligned(8)));
 
 
@@ -21,21 +21,30 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
 
+#include <shared/arena.h>
 #include <shared/array.h>
+#include <shared/dirwalk.h>
 #include <shared/hash.h>
 #include <shared/macro.h>
 #include <shared/util.h>
 #include <shared/scratchbuf.h>
+#include <shared/strbuf.h>
 
 #include <libkmod/libkmod-internal.h>
 
@@ -55,11 +64,12 @@ static const char *default_cfg_paths[] = {
 	NULL
 };
 
-static const char cmdopts_s[] = "aAb:C:E:F:euqrvnP:wmVh";
+static const char cmdopts_s[] = "aAb:cC:E:F:euqrvnP:I:BsS::j:wmVh";
 static const struct option cmdopts[] = {
 	{ "all", no_argument, 0, 'a' },
 	{ "quick", no_argument, 0, 'A' },
 	{ "basedir", required_argument, 0, 'b' },
+	{ "cache", no_argument, 0, 'c' },
 	{ "config", required_argument, 0, 'C' },
 	{ "symvers", required_argument, 0, 'E' },
 	{ "filesyms", required_argument, 0, 'F' },
@@ -71,6 +81,11 @@ static const struct option cmdopts[] = {
 	{ "show", no_argument, 0, 'n' },
 	{ "dry-run", no_argument, 0, 'n' },
 	{ "symbol-prefix", required_argument, 0, 'P' },
+	{ "index-version", required_argument, 0, 'I' },
+	{ "bundle", no_argument, 0, 'B' },
+	{ "sync", no_argument, 0, 's' },
+	{ "stats", optional_argument, 0, 'S' },
+	{ "jobs", required_argument, 0, 'j' },
 	{ "warn", no_argument, 0, 'w' },
 	{ "map", no_argument, 0, 'm' }, /* deprecated */
 	{ "version", no_argument, 0, 'V' },
@@ -96,6 +111,9 @@ static void help(void)
 		"\t-C, --config=PATH    Read configuration from PATH\n"
 		"\t-v, --verbose        Enable verbose mode\n"
 		"\t-w, --warn           Warn on duplicates\n"
+		"\t-j, --jobs=N         Parse modules and write indexes using N threads\n"
+		"\t-S, --stats[=FORMAT] Print the time and memory each step took,\n"
+		"\t                     as text (default) or json\n"
 		"\t-V, --version        show version\n"
 		"\t-h, --help           show this help\n"
 		"\n"
@@ -104,7 +122,16 @@ static void help(void)
 		"\t-F, --filesyms=FILE  Use the file instead of the\n"
 		"\t                     current kernel symbols.\n"
 		"\t-E, --symvers=FILE   Use Module.symvers file to check\n"
-		"\t                     symbol versions.\n",
+		"\t                     symbol versions.\n"
+		"\t-I, --index-version=N  Write the binary indexes in format\n"
+		"\t                     version N: 2 (default) or 3, which\n"
+		"\t                     needs kmod >= 25 to be read.\n"
+		"\t-B, --bundle         Also write all the binary indexes to\n"
+		"\t                     a single modules.idx file.\n"
+		"\t-c, --cache          Reuse the data of unchanged modules\n"
+		"\t                     from modules.cache and update it.\n"
+		"\t-s, --sync           Flush the new files to disk before\n"
+		"\t                     putting them in place.\n",
 		program_invocation_short_name);
 }
 
@@ -152,6 +179,28 @@ static inline void _show(const char *fmt, ...)
 #define INDEX_VERSION_MAJOR 0x0002
 #define INDEX_VERSION_MINOR 0x0001
 #define INDEX_VERSION ((INDEX_VERSION_MAJOR<<16)|INDEX_VERSION_MINOR)
+#define INDEX_VERSION_MAJOR_V3 0x0003
+#define INDEX_VERSION_MINOR_V3 0x0000
+#define INDEX_VERSION_V3 ((INDEX_VERSION_MAJOR_V3<<16)|INDEX_VERSION_MINOR_V3)
+/* Minor versions with a perfect hash table, see libkmod-index.c */
+#define INDEX_VERSION_MINOR_HASH 0x0002
+#define INDEX_VERSION_HASH ((INDEX_VERSION_MAJOR<<16)|INDEX_VERSION_MINOR_HASH)
+#define INDEX_VERSION_MINOR_V3_HASH 0x0001
+#define INDEX_VERSION_V3_HASH ((INDEX_VERSION_MAJOR_V3<<16)|INDEX_VERSION_MINOR_V3_HASH)
+#define INDEX_HASH_MAX_SEED (1U << 20)
+#define INDEX_BUNDLE_MAGIC 0xB007F4B1
+#define INDEX_BUNDLE_VERSION 0x00010000
+
+/* Program of a precompiled wildcard pattern, v3 only */
+enum index_wild_op {
+	INDEX_WILD_END = 0,
+	INDEX_WILD_LITERAL, /* followed by the char */
+	INDEX_WILD_ANY,
+	INDEX_WILD_STAR,
+	INDEX_WILD_CLASS, /* followed by a 256-bit bitmap */
+};
+#define INDEX_WILD_FNMATCH 0x80000000 /* not compiled, use fnmatch() */
+#define INDEX_ALIGN(x) (((x) + 3U) & ~3U)
 #define INDEX_CHILDMAX 128
 
 struct index_value {
@@ -164,9 +213,17 @@ struct index_value {
 struct index_node {
 	char *prefix;		/* path compression */
 	struct index_value *values;
+	unsigned char ch;	/* character leading to it from its parent */
 	unsigned char first;	/* range of child nodes */
 	unsigned char last;
-	struct index_node *children[INDEX_CHILDMAX]; /* indexed by character */
+	unsigned char n_children;
+	uint32_t offset;	/* set when written to the file */
+	uint32_t values_offset;	/* same, v3 only */
+	/*
+	 * Sorted by ch. The array has room for n_children rounded up to a
+	 * power of 2, so it's full when n_children is 0 or a power of 2.
+	 */
+	struct index_node **children;
 };
 
 
@@ -176,44 +233,72 @@ enum node_offset {
 	INDEX_NODE_PREFIX   = 0x80000000,
 	INDEX_NODE_VALUES = 0x40000000,
 	INDEX_NODE_CHILDS   = 0x20000000,
+	INDEX_NODE_WILDCARDS = 0x10000000, /* v3 only */
 
 	INDEX_NODE_MASK     = 0x0FFFFFFF, /* Offset value */
 };
 
-static struct index_node *index_create(void)
+enum index_write_flags {
+	INDEX_WRITE_HASH	= 1 << 0, /* perfect hash for exact lookups */
+	INDEX_WRITE_WILDCARDS	= 1 << 1, /* precompiled wildcards, v3 only */
+};
+
+/* nodes and values are allocated from @arena, releasing it destroys the index */
+static struct index_node *index_create(struct arena *arena)
 {
 	struct index_node *node;
 
-	node = NOFAIL(calloc(sizeof(struct index_node), 1));
-	node->prefix = NOFAIL(strdup(""));
+	node = NOFAIL(arena_zalloc(arena, sizeof(struct index_node)));
+	node->prefix = NOFAIL(arena_strdup(arena, ""));
 	node->first = INDEX_CHILDMAX;
 
 	return node;
 }
 
-static void index_values_free(struct index_value *values)
+static struct index_node *index__child(const struct index_node *node, int ch)
 {
-	while (values) {
-		struct index_value *value = values;
-
-		values = value->next;
-		free(value);
+	int lo = 0, hi = node->n_children;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		struct index_node *child = node->children[mid];
+
+		if (child->ch == ch)
+			return child;
+		if (child->ch < ch)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+
+	return NULL;
 }
 
-static void index_destroy(struct index_node *node)
+static void index__add_child(struct arena *arena, struct index_node *node,
+						struct index_node *child)
 {
-	int c;
+	unsigned int n = node->n_children;
+	unsigned int pos;
 
-	for (c = node->first; c <= node->last; c++) {
-		struct index_node *child = node->children[c];
+	if ((n & (n - 1)) == 0) {
+		struct index_node **children;
 
-		if (child)
-			index_destroy(child);
+		children = NOFAIL(arena_alloc(arena,
+				(n > 0 ? 2 * n : 1) * sizeof(*children)));
+		if (n > 0)
+			memcpy(children, node->children, n * sizeof(*children));
+		node->children = children;
 	}
-	index_values_free(node->values);
-	free(node->prefix);
-	free(node);
+
+	for (pos = n; pos > 0 && node->children[pos - 1]->ch > child->ch; pos--)
+		node->children[pos] = node->children[pos - 1];
+	node->children[pos] = child;
+	node->n_children++;
+
+	if (child->ch < node->first)
+		node->first = child->ch;
+	if (node->n_children == 1 || child->ch > node->last)
+		node->last = child->ch;
 }
 
 static void index__checkstring(const char *str)
@@ -229,7 +314,7 @@ static void index__checkstring(const char *str)
 	}
 }
 
-static int index_add_value(struct index_value **values,
+static int index_add_value(struct arena *arena, struct index_value **values,
 				const char *value, unsigned int priority)
 {
 	struct index_value *v;
@@ -247,7 +332,7 @@ static int index_add_value(struct index_value **values,
 		values = &(*values)->next;
 
 	len = strlen(value);
-	v = NOFAIL(calloc(sizeof(struct index_value) + len + 1, 1));
+	v = NOFAIL(arena_alloc(arena, sizeof(struct index_value) + len + 1));
 	v->next = *values;
 	v->priority = priority;
 	memcpy(v->value, value, len + 1);
@@ -256,8 +341,9 @@ static int index_add_value(struct index_value **values,
 	return duplicate;
 }
 
-static int index_insert(struct index_node *node, const char *key,
-			const char *value, unsigned int priority)
+static int index_insert(struct arena *arena, struct index_node *node,
+			const char *key, const char *value,
+			unsigned int priority)
 {
 	int i = 0; /* index within str */
 	int ch;
@@ -266,6 +352,7 @@ static int index_insert(struct index_node *node, const char *key,
 	index__checkstring(value);
 
 	while(1) {
+		struct index_node *child;
 		int j; /* index within node->prefix */
 
 		/* Ensure node->prefix is a prefix of &str[i].
@@ -275,20 +362,23 @@ static int index_insert(struct index_node *node, const char *key,
 
 			if (ch != key[i+j]) {
 				char *prefix = node->prefix;
+				unsigned char node_ch = node->ch;
 				struct index_node *n;
 
 				/* New child is copy of node with prefix[j+1..N] */
-				n = NOFAIL(calloc(sizeof(struct index_node), 1));
-				memcpy(n, node, sizeof(struct index_node));
-				n->prefix = NOFAIL(strdup(&prefix[j+1]));
+				n = NOFAIL(arena_memdup(arena, node,
+						sizeof(struct index_node)));
+				n->prefix = NOFAIL(arena_strdup(arena,
+								&prefix[j+1]));
+				n->ch = ch;
 
 				/* Parent has prefix[0..j], child at prefix[j] */
 				memset(node, 0, sizeof(struct index_node));
 				prefix[j] = '\0';
 				node->prefix = prefix;
-				node->first = ch;
-				node->last = ch;
-				node->children[ch] = n;
+				node->ch = node_ch;
+				node->first = INDEX_CHILDMAX;
+				index__add_child(arena, node, n);
 
 				break;
 			}
@@ -298,34 +388,31 @@ static int index_insert(struct index_node *node, const char *key,
 
 		ch = key[i];
 		if(ch == '\0')
-			return index_add_value(&node->values, value, priority);
-
-		if (!node->children[ch]) {
-			struct index_node *child;
-
-			if (ch < node->first)
-				node->first = ch;
-			if (ch > node->last)
-				node->last = ch;
-			node->children[ch] = NOFAIL(calloc(sizeof(struct index_node), 1));
-
-			child = node->children[ch];
-			child->prefix = NOFAIL(strdup(&key[i+1]));
+			return index_add_value(arena, &node->values, value,
+								priority);
+
+		child = index__child(node, ch);
+		if (!child) {
+			child = NOFAIL(arena_zalloc(arena,
+						sizeof(struct index_node)));
+			child->prefix = NOFAIL(arena_strdup(arena, &key[i+1]));
+			child->ch = ch;
 			child->first = INDEX_CHILDMAX;
-			index_add_value(&child->values, value, priority);
+			index__add_child(arena, node, child);
+			index_add_value(arena, &child->values, value, priority);
 
 			return 0;
 		}
 
 		/* Descend into child node and continue */
-		node = node->children[ch];
+		node = child;
 		i++;
 	}
 }
 
 static int index__haschildren(const struct index_node *node)
 {
-	return node->first < INDEX_CHILDMAX;
+	return node->n_children > 0;
 }
 
 /* Recursive post-order traversal
@@ -335,7 +422,7 @@ static int index__haschildren(const struct index_node *node)
    However, index reading is already fast enough.
    Pre-order is simpler for writing, and depmod is already slow.
  */
-static uint32_t index_write__node(const struct index_node *node, FILE *out)
+static uint32_t index_write__node(struct index_node *node, FILE *out)
 {
 	uint32_t *child_offs = NULL;
 	int child_count = 0;
@@ -346,15 +433,17 @@ static uint32_t index_write__node(const struct index_node *node, FILE *out)
 
 	/* Write children and save their offsets */
 	if (index__haschildren(node)) {
-		const struct index_node *child;
 		int i;
 
+		/* Offsets are written for the whole range, 0 for the gaps */
 		child_count = node->last - node->first + 1;
-		child_offs = NOFAIL(malloc(child_count * sizeof(uint32_t)));
+		child_offs = NOFAIL(calloc(child_count, sizeof(uint32_t)));
+
+		for (i = 0; i < node->n_children; i++) {
+			struct index_node *child = node->children[i];
 
-		for (i = 0; i < child_count; i++) {
-			child = node->children[node->first + i];
-			child_offs[i] = htonl(index_write__node(child, out));
+			child_offs[child->ch - node->first] =
+					htonl(index_write__node(child, out));
 		}
 	}
 
@@ -396,33 +485,653 @@ static uint32_t index_write__node(const struct index_node *node, FILE *out)
 		offset |= INDEX_NODE_VALUES;
 	}
 
+	node->offset = offset;
 	return offset;
 }
 
-static void index_write(const struct index_node *node, FILE *out)
+static void index_write_v3__str(const char *str, FILE *out)
+{
+	static const char zeros[4];
+	size_t len = strlen(str) + 1;
+
+	fwrite(str, 1, len, out);
+	fwrite(zeros, 1, INDEX_ALIGN(len) - len, out);
+}
+
+static uint32_t index_write_v3__values_size(const struct index_node *node)
+{
+	const struct index_value *v;
+	uint32_t size = sizeof(uint32_t);
+
+	for (v = node->values; v != NULL; v = v->next)
+		size += sizeof(uint32_t) + INDEX_ALIGN(strlen(v->value) + 1);
+
+	return size;
+}
+
+static bool index__is_wildcard(int ch)
+{
+	return ch == '*' || ch == '?' || ch == '[';
+}
+
+static bool index__prefix_has_wildcard(const char *prefix)
+{
+	return prefix[strcspn(prefix, "*?[")] != '\0';
+}
+
+static void index_wild__push_u32(struct strbuf *buf, uint32_t u)
+{
+	int i;
+
+	for (i = 24; i >= 0; i -= 8)
+		strbuf_pushchar(buf, (u >> i) & 0xff);
+}
+
+static void index_wild__align(struct strbuf *buf)
+{
+	while (buf->used % 4)
+		strbuf_pushchar(buf, '\0');
+}
+
+/*
+ * Compile a glob pattern to the program run by libkmod. Returns false if
+ * there's some construct we don't handle, in which case the pattern is
+ * stored as is to be matched with fnmatch().
+ *
+ * Bracket expressions are turned into a bitmap by asking fnmatch() about
+ * each byte, so they match exactly the same chars.
+ */
+static bool index_wild__compile(const char *pattern, struct strbuf *code)
+{
+	const char *p = pattern;
+
+	while (*p != '\0') {
+		if (*p == '*') {
+			while (*p == '*')
+				p++;
+			strbuf_pushchar(code, INDEX_WILD_STAR);
+		} else if (*p == '?') {
+			strbuf_pushchar(code, INDEX_WILD_ANY);
+			p++;
+		} else if (*p == '[') {
+			const char *end = p + 1;
+			uint8_t map[32] = { };
+			char bracket[256], s[2] = { };
+			size_t len;
+			int c;
+
+			if (*end == '!' || *end == '^')
+				end++;
+			if (*end == ']')
+				end++;
+			for (; *end != ']'; end++) {
+				if (*end == '\0')
+					return false;
+				if (*end == '[' && strchr(":=.", end[1]))
+					return false;
+				if (*end == '\\' && *++end == '\0')
+					return false;
+			}
+
+			len = end - p + 1;
+			if (len >= sizeof(bracket))
+				return false;
+			memcpy(bracket, p, len);
+			bracket[len] = '\0';
+
+			for (c = 1; c < 256; c++) {
+				s[0] = c;
+				if (fnmatch(bracket, s, 0) == 0)
+					map[c / 8] |= 1 << (c % 8);
+			}
+
+			strbuf_pushchar(code, INDEX_WILD_CLASS);
+			for (c = 0; c < 32; c++)
+				strbuf_pushchar(code, map[c]);
+			p = end + 1;
+		} else {
+			if (*p == '\\' && *++p == '\0')
+				return false;
+			strbuf_pushchar(code, INDEX_WILD_LITERAL);
+			strbuf_pushchar(code, *p);
+			p++;
+		}
+	}
+
+	strbuf_pushchar(code, INDEX_WILD_END);
+	return true;
+}
+
+static void index_wild__add_entry(struct strbuf *bucket, const char *pattern,
+						uint32_t values_offset)
+{
+	struct strbuf code;
+	uint32_t len;
+
+	strbuf_init(&code);
+	if (index_wild__compile(pattern, &code)) {
+		len = code.used;
+	} else {
+		strbuf_clear(&code);
+		strbuf_pushchars(&code, pattern);
+		strbuf_pushchar(&code, '\0');
+		len = code.used | INDEX_WILD_FNMATCH;
+	}
+
+	index_wild__push_u32(bucket, values_offset);
+	index_wild__push_u32(bucket, len);
+	for (len = 0; len < code.used; len++)
+		strbuf_pushchar(bucket, code.bytes[len]);
+	index_wild__align(bucket);
+
+	strbuf_release(&code);
+}
+
+/* Same traversal as index_mm_searchwild_all() in libkmod */
+static void index_wild__collect(const struct index_node *node, int j,
+				struct strbuf *pattern, struct strbuf *bucket,
+				uint32_t *n_entries)
+{
+	int i, pushed;
+
+	pushed = strbuf_pushchars(pattern, &node->prefix[j]);
+
+	for (i = 0; i < node->n_children; i++) {
+		const struct index_node *child = node->children[i];
+
+		strbuf_pushchar(pattern, child->ch);
+		index_wild__collect(child, 0, pattern, bucket, n_entries);
+		strbuf_popchar(pattern);
+	}
+
+	if (node->values) {
+		index_wild__add_entry(bucket, strbuf_str(pattern),
+							node->values_offset);
+		(*n_entries)++;
+	}
+
+	strbuf_popchars(pattern, pushed);
+}
+
+/*
+ * Append to @area the bucket of @node: all the patterns libkmod would match
+ * against the rest of the key when reaching this node, in the same order.
+ */
+static void index_wild__bucket(const struct index_node *node,
+							struct strbuf *area)
+{
+	static const char wildcards[] = "*?[";
+	struct strbuf pattern;
+	uint32_t n_entries = 0;
+	unsigned int start = area->used;
+	const char *w;
+	int i;
+
+	/* placeholder for the number of entries */
+	index_wild__push_u32(area, 0);
+
+	strbuf_init(&pattern);
+	if (index__prefix_has_wildcard(node->prefix)) {
+		index_wild__collect(node, strcspn(node->prefix, wildcards),
+					&pattern, area, &n_entries);
+	} else {
+		for (w = wildcards; *w != '\0'; w++) {
+			const struct index_node *child = index__child(node, *w);
+
+			if (!child)
+				continue;
+
+			strbuf_pushchar(&pattern, *w);
+			index_wild__collect(child, 0, &pattern, area,
+								&n_entries);
+			strbuf_popchar(&pattern);
+		}
+	}
+	strbuf_release(&pattern);
+
+	for (i = 0; i < 4; i++)
+		area->bytes[start + i] = (n_entries >> (24 - 8 * i)) & 0xff;
+}
+
+/*
+ * Nodes are written in breadth-first order, so parents come before their
+ * children: the offsets of all nodes are computed in a first pass and the
+ * file is written in a second one. Since children are queued in order,
+ * the children of the n-th node are always the next ones after the children
+ * of the (n-1)-th node.
+ *
+ * With @wildcards, the nodes libkmod visits while searching for a key that
+ * have wildcards right below them get a precompiled bucket of patterns.
+ */
+static uint32_t index_write_v3(struct index_node *root, FILE *out,
+							bool wildcards)
+{
+	struct array queue;
+	struct strbuf area;
+	uint32_t *offsets, *wild_offsets;
+	bool *inside_wildcard;
+	uint32_t offset, u;
+	size_t i, next_child;
+	long start;
+	int j, ch;
+
+	start = ftell(out);
+	assert(start >= 0 && start % 4 == 0);
+
+	array_init(&queue, 256);
+	if (array_append(&queue, root) < 0)
+		CRIT("Module index: out of memory\n");
+
+	for (i = 0; i < queue.count; i++) {
+		const struct index_node *node = queue.array[i];
+
+		for (j = 0; j < node->n_children; j++) {
+			if (array_append(&queue, node->children[j]) < 0)
+				CRIT("Module index: out of memory\n");
+		}
+	}
+
+	offsets = NOFAIL(malloc(queue.count * sizeof(uint32_t)));
+	wild_offsets = NOFAIL(calloc(queue.count, sizeof(uint32_t)));
+	inside_wildcard = NOFAIL(calloc(queue.count, sizeof(bool)));
+
+	/*
+	 * Nodes below a wildcard are never visited by libkmod's search, the
+	 * bucket of the node above them has all their patterns
+	 */
+	for (i = 0, next_child = 1; wildcards && i < queue.count; i++) {
+		const struct index_node *node = queue.array[i];
+		bool inside = inside_wildcard[i] ||
+				index__prefix_has_wildcard(node->prefix);
+		bool bucket = index__prefix_has_wildcard(node->prefix);
+
+		for (j = 0; j < node->n_children; j++) {
+			bool wild = index__is_wildcard(node->children[j]->ch);
+
+			if (wild)
+				bucket = true;
+			inside_wildcard[next_child++] = inside || wild;
+		}
+
+		if (bucket && !inside_wildcard[i])
+			wild_offsets[i] = 1;
+	}
+
+	/* First pass: lay out the nodes after the header, then the values */
+	offset = start;
+
+	for (i = 0; i < queue.count; i++) {
+		struct index_node *node = queue.array[i];
+
+		offsets[i] = offset;
+
+		if (node->values) {
+			offsets[i] |= INDEX_NODE_VALUES;
+			offset += sizeof(uint32_t);
+		}
+
+		if (index__haschildren(node)) {
+			offsets[i] |= INDEX_NODE_CHILDS;
+			offset += (4 + node->n_children) * sizeof(uint32_t);
+		}
+
+		if (node->prefix[0]) {
+			offsets[i] |= INDEX_NODE_PREFIX;
+			offset += INDEX_ALIGN(strlen(node->prefix) + 1);
+		}
+
+		if (wild_offsets[i]) {
+			offsets[i] |= INDEX_NODE_WILDCARDS;
+			offset += sizeof(uint32_t);
+		}
+
+		node->offset = offsets[i];
+	}
+
+	for (i = 0; i < queue.count; i++) {
+		struct index_node *node = queue.array[i];
+
+		if (!node->values)
+			continue;
+
+		node->values_offset = offset;
+		offset += index_write_v3__values_size(node);
+	}
+
+	/* Buckets go after the values, they point to them */
+	strbuf_init(&area);
+	for (i = 0; i < queue.count; i++) {
+		if (!wild_offsets[i])
+			continue;
+
+		wild_offsets[i] = offset + area.used;
+		index_wild__bucket(queue.array[i], &area);
+	}
+
+	/* Second pass: write everything */
+	next_child = 1;
+
+	for (i = 0; i < queue.count; i++) {
+		const struct index_node *node = queue.array[i];
+
+		if (node->values) {
+			u = htonl(node->values_offset);
+			fwrite(&u, sizeof(u), 1, out);
+		}
+
+		if (index__haschildren(node)) {
+			uint32_t child_map[4] = { };
+			int w;
+
+			for (j = 0; j < node->n_children; j++) {
+				ch = node->children[j]->ch;
+				child_map[ch / 32] |= 1U << (ch % 32);
+			}
+
+			for (w = 0; w < 4; w++) {
+				u = htonl(child_map[w]);
+				fwrite(&u, sizeof(u), 1, out);
+			}
+
+			for (j = 0; j < node->n_children; j++) {
+				u = htonl(offsets[next_child++]);
+				fwrite(&u, sizeof(u), 1, out);
+			}
+		}
+
+		if (node->prefix[0])
+			index_write_v3__str(node->prefix, out);
+
+		if (wild_offsets[i]) {
+			u = htonl(wild_offsets[i]);
+			fwrite(&u, sizeof(u), 1, out);
+		}
+	}
+
+	for (i = 0; i < queue.count; i++) {
+		const struct index_node *node = queue.array[i];
+		const struct index_value *v;
+		unsigned int value_count = 0;
+
+		if (!node->values)
+			continue;
+
+		for (v = node->values; v != NULL; v = v->next)
+			value_count++;
+		u = htonl(value_count);
+		fwrite(&u, sizeof(u), 1, out);
+
+		for (v = node->values; v != NULL; v = v->next) {
+			u = htonl(v->priority);
+			fwrite(&u, sizeof(u), 1, out);
+			index_write_v3__str(v->value, out);
+		}
+	}
+
+	fwrite(area.bytes, 1, area.used, out);
+
+	u = offsets[0];
+	strbuf_release(&area);
+	free(inside_wildcard);
+	free(wild_offsets);
+	free(offsets);
+	array_free_array(&queue);
+
+	return u;
+}
+
+struct index_hash_key {
+	char *key;
+	uint32_t node_offset;
+	uint32_t bucket;
+};
+
+struct index_hash_bucket {
+	uint32_t idx;
+	uint32_t size;
+	uint32_t first; /* position of its first key in the sorted keys */
+};
+
+static void index_hash__collect(const struct index_node *node,
+				struct strbuf *buf, struct array *keys)
+{
+	int i, pushed;
+
+	pushed = strbuf_pushchars(buf, node->prefix);
+
+	if (node->values) {
+		struct index_hash_key *k = NOFAIL(malloc(sizeof(*k)));
+
+		k->key = NOFAIL(strdup(strbuf_str(buf)));
+		k->node_offset = node->offset;
+		if (array_append(keys, k) < 0)
+			CRIT("Module index: out of memory\n");
+	}
+
+	for (i = 0; i < node->n_children; i++) {
+		const struct index_node *child = node->children[i];
+
+		strbuf_pushchar(buf, child->ch);
+		index_hash__collect(child, buf, keys);
+		strbuf_popchar(buf);
+	}
+
+	strbuf_popchars(buf, pushed);
+}
+
+static int index_hash__key_cmp(const void *pa, const void *pb)
+{
+	const struct index_hash_key *a = *(const struct index_hash_key **)pa;
+	const struct index_hash_key *b = *(const struct index_hash_key **)pb;
+
+	if (a->bucket != b->bucket)
+		return a->bucket < b->bucket ? -1 : 1;
+	return strcmp(a->key, b->key);
+}
+
+static int index_hash__bucket_cmp(const void *pa, const void *pb)
+{
+	const struct index_hash_bucket *a = pa;
+	const struct index_hash_bucket *b = pb;
+
+	if (a->size != b->size)
+		return a->size > b->size ? -1 : 1;
+	return a->idx < b->idx ? -1 : 1;
+}
+
+/*
+ * Find a seed for each bucket, biggest buckets first, so that all of its
+ * keys land in empty slots. Returns false if some bucket couldn't be placed.
+ */
+static bool index_hash__place(struct array *keys, uint32_t n_buckets,
+		uint32_t *seeds, const struct index_hash_key **slots)
+{
+	struct index_hash_bucket *buckets;
+	uint32_t n_keys = keys->count;
+	uint32_t *pos;
+	uint32_t i, j;
+	bool ok = true;
+
+	buckets = NOFAIL(calloc(n_buckets, sizeof(*buckets)));
+	pos = NOFAIL(malloc(n_keys * sizeof(*pos)));
+
+	array_sort(keys, index_hash__key_cmp);
+	for (i = 0; i < n_buckets; i++)
+		buckets[i].idx = i;
+	for (i = 0; i < n_keys; i++) {
+		const struct index_hash_key *k = keys->array[i];
+
+		if (buckets[k->bucket].size++ == 0)
+			buckets[k->bucket].first = i;
+	}
+	qsort(buckets, n_buckets, sizeof(*buckets), index_hash__bucket_cmp);
+
+	for (i = 0; i < n_buckets && buckets[i].size > 0; i++) {
+		const struct index_hash_bucket *b = &buckets[i];
+		uint32_t seed;
+
+		for (seed = 1; seed < INDEX_HASH_MAX_SEED; seed++) {
+			for (j = 0; j < b->size; j++) {
+				const struct index_hash_key *k =
+						keys->array[b->first + j];
+
+				pos[j] = hash_str_seeded(k->key, seed) % n_keys;
+				if (slots[pos[j]] != NULL)
+					break;
+				slots[pos[j]] = k;
+			}
+
+			if (j == b->size)
+				break;
+
+			/* undo, keys of the same bucket may collide */
+			while (j--)
+				slots[pos[j]] = NULL;
+		}
+
+		if (seed == INDEX_HASH_MAX_SEED) {
+			ok = false;
+			break;
+		}
+
+		seeds[b->idx] = seed;
+	}
+
+	free(pos);
+	free(buckets);
+	return ok;
+}
+
+/*
+ * Write a minimal perfect hash of all the keys in the index, mapping each one
+ * to its node. Buckets are chosen with a first hash and each of them gets a
+ * seed for a second hash that puts its keys in distinct slots ("hash and
+ * displace"). Returns the offset of the table or 0 if none was written.
+ */
+static uint32_t index_write__hash(const struct index_node *root, FILE *out)
+{
+	const struct index_hash_key **slots = NULL;
+	uint32_t *seeds = NULL;
+	struct array keys;
+	struct strbuf buf;
+	uint32_t n_keys, n_buckets, key_offset, u, i;
+	long offset = 0;
+
+	array_init(&keys, 256);
+	strbuf_init(&buf);
+	index_hash__collect(root, &buf, &keys);
+	strbuf_release(&buf);
+
+	n_keys = keys.count;
+	if (n_keys == 0)
+		goto done;
+
+	/* ~4 keys per bucket keeps the table small and is quick to build */
+	n_buckets = n_keys / 4 + 1;
+	seeds = NOFAIL(calloc(n_buckets, sizeof(*seeds)));
+	slots = NOFAIL(calloc(n_keys, sizeof(*slots)));
+
+	for (i = 0; i < n_keys; i++) {
+		struct index_hash_key *k = keys.array[i];
+
+		k->bucket = hash_str_seeded(k->key, 0) % n_buckets;
+	}
+
+	if (!index_hash__place(&keys, n_buckets, seeds, slots)) {
+		INF("Module index: could not build a perfect hash table\n");
+		n_keys = 0;
+		goto done;
+	}
+
+	offset = ftell(out);
+	assert(offset >= 0);
+	for (; offset % 4; offset++)
+		fputc('\0', out);
+
+	u = htonl(n_keys);
+	fwrite(&u, sizeof(u), 1, out);
+	u = htonl(n_buckets);
+	fwrite(&u, sizeof(u), 1, out);
+
+	for (i = 0; i < n_buckets; i++) {
+		u = htonl(seeds[i]);
+		fwrite(&u, sizeof(u), 1, out);
+	}
+
+	key_offset = offset + sizeof(uint32_t) * (2 + n_buckets + 2 * n_keys);
+	for (i = 0; i < n_keys; i++) {
+		u = htonl(key_offset);
+		fwrite(&u, sizeof(u), 1, out);
+		u = htonl(slots[i]->node_offset);
+		fwrite(&u, sizeof(u), 1, out);
+		key_offset += strlen(slots[i]->key) + 1;
+	}
+
+	for (i = 0; i < n_keys; i++) {
+		fputs(slots[i]->key, out);
+		fputc('\0', out);
+	}
+
+done:
+	for (i = 0; i < keys.count; i++) {
+		struct index_hash_key *k = keys.array[i];
+
+		free(k->key);
+		free(k);
+	}
+	array_free_array(&keys);
+	free(seeds);
+	free(slots);
+
+	return n_keys > 0 ? offset : 0;
+}
+
+static void index_write(struct index_node *node, FILE *out,
+				unsigned int version, unsigned int flags)
 {
+	bool with_hash = flags & INDEX_WRITE_HASH;
 	long initial_offset, final_offset;
-	uint32_t u;
+	uint32_t u, root_offset, hash_offset = 0;
 
 	u = htonl(INDEX_MAGIC);
 	fwrite(&u, sizeof(u), 1, out);
-	u = htonl(INDEX_VERSION);
+	if (version == INDEX_VERSION_MAJOR_V3)
+		u = htonl(with_hash ? INDEX_VERSION_V3_HASH : INDEX_VERSION_V3);
+	else
+		u = htonl(with_hash ? INDEX_VERSION_HASH : INDEX_VERSION);
 	fwrite(&u, sizeof(u), 1, out);
 
-	/* Second word is reserved for the offset of the root node */
+	/*
+	 * Second word is reserved for the offset of the root node, third one
+	 * for the offset of the hash table
+	 */
 	initial_offset = ftell(out);
 	assert(initial_offset >= 0);
 	u = 0;
 	fwrite(&u, sizeof(uint32_t), 1, out);
+	if (with_hash)
+		fwrite(&u, sizeof(uint32_t), 1, out);
 
 	/* Dump trie */
-	u = htonl(index_write__node(node, out));
+	if (version == INDEX_VERSION_MAJOR_V3)
+		root_offset = index_write_v3(node, out,
+					flags & INDEX_WRITE_WILDCARDS);
+	else
+		root_offset = index_write__node(node, out);
+
+	if (with_hash)
+		hash_offset = index_write__hash(node, out);
 
 	/* Update first word */
 	final_offset = ftell(out);
 	assert(final_offset >= 0);
 	(void)fseek(out, initial_offset, SEEK_SET);
+	u = htonl(root_offset);
 	fwrite(&u, sizeof(uint32_t), 1, out);
+	if (with_hash) {
+		u = htonl(hash_offset);
+		fwrite(&u, sizeof(uint32_t), 1, out);
+	}
 	(void)fseek(out, final_offset, SEEK_SET);
 }
 
@@ -451,6 +1160,11 @@ struct cfg {
 	uint8_t check_symvers;
 	uint8_t print_unknown;
 	uint8_t warn_dups;
+	uint8_t index_version;
+	uint8_t bundle;
+	uint8_t cache;
+	uint8_t sync;
+	unsigned int jobs;
 	struct cfg_override *overrides;
 	struct cfg_search *searches;
 };
@@ -789,6 +1503,14 @@ static void cfg_free(struct cfg *cfg)
 
 /* depmod calculations ***********************************************/
 struct vertex;
+/* identifies the file a modules.cache entry was created from */
+struct mod_stamp {
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t ctime;
+	uint64_t ino;
+};
+
 struct mod {
 	struct kmod_module *kmod;
 	char *path;
@@ -796,13 +1518,18 @@ struct mod {
 	char *uncrelpath; /* same as relpath but ending in .ko */
 	struct kmod_list *info_list;
 	struct kmod_list *dep_sym_list;
+	struct kmod_list *sym_list; /* exported symbols */
+	int sym_err;
+	bool parsed; /* lists above are loaded, from the file or the cache */
+	bool stamped;
+	struct mod_stamp stamp;
 	struct array deps; /* struct symbol */
 	size_t baselen; /* points to start of basename/filename */
 	size_t modnamesz;
 	int sort_idx; /* sort index using modules.order */
 	int dep_sort_idx; /* topological sort index */
-	uint16_t idx; /* index in depmod->modules.array */
-	uint16_t users; /* how many modules depend on this one */
+	uint32_t idx; /* index in depmod->modules.array */
+	uint32_t users; /* how many modules depend on this one */
 	bool visited; /* helper field to report cycles */
 	struct vertex *vertex; /* helper field to report cycles */
 	char modname[];
@@ -814,25 +1541,328 @@ struct symbol {
 	char name[];
 };
 
-struct depmod {
-	const struct cfg *cfg;
-	struct kmod_ctx *ctx;
-	struct array modules;
-	struct hash *modules_by_uncrelpath;
-	struct hash *modules_by_name;
-	struct hash *symbols;
+/*
+ * modules.manifest lists the directories seen by the last full search, with
+ * their modification time and the modules and subdirectories in them, in
+ * the order readdir() returned them. A directory whose mtime didn't change
+ * since then has the same entries, so -A doesn't need to look into it and
+ * the search can take its entries from here. Like modules.cache it uses
+ * native byte order and is written with the cache_write_*() helpers.
+ *
+ * header: magic, version, number of directories
+ * directory: relpath (ending in '/', empty for the top one), mtime or 0 if
+ *            it can't be trusted, n_entries * { type, name }
+ */
+#define MANIFEST_MAGIC 0xB007D125
+#define MANIFEST_VERSION 1
+
+enum manifest_type {
+	MANIFEST_MODULE = 0,
+	MANIFEST_DIR = 1,
 };
 
-static void mod_free(struct mod *mod)
+struct cache_reader {
+	const char *p;
+	const char *end;
+};
+
+static bool cache_read_u32(struct cache_reader *r, uint32_t *v)
 {
-	DBG("free %p kmod=%p, path=%s\n", mod, mod->kmod, mod->path);
-	array_free_array(&mod->deps);
-	kmod_module_unref(mod->kmod);
-	kmod_module_info_free_list(mod->info_list);
+	if (r->end - r->p < (ptrdiff_t) sizeof(*v))
+		return false;
+	memcpy(v, r->p, sizeof(*v));
+	r->p += sizeof(*v);
+	return true;
+}
+
+static bool cache_read_u64(struct cache_reader *r, uint64_t *v)
+{
+	if (r->end - r->p < (ptrdiff_t) sizeof(*v))
+		return false;
+	memcpy(v, r->p, sizeof(*v));
+	r->p += sizeof(*v);
+	return true;
+}
+
+static bool cache_read_str(struct cache_reader *r, const char **str,
+								uint32_t *len)
+{
+	uint32_t size;
+
+	if (!cache_read_u32(r, &size) || size == 0 ||
+			r->end - r->p < (ptrdiff_t) size || r->p[size - 1] != '\0')
+		return false;
+	*str = r->p;
+	*len = size - 1;
+	r->p += size;
+	return true;
+}
+
+/* modules.manifest of the last run, mapped */
+struct manifest {
+	void *map;
+	size_t size;
+	struct hash *dirs; /* relpath -> rest of its record */
+};
+
+/* a directory seen by this run, to write the next modules.manifest */
+struct manifest_dir {
+	const char *relpath;
+	uint64_t mtime;
+	struct array entries; /* struct manifest_entry */
+};
+
+struct manifest_entry {
+	uint32_t type;
+	char name[];
+};
+
+static void manifest_close(struct manifest *m)
+{
+	hash_free(m->dirs);
+	if (m->map != NULL)
+		munmap(m->map, m->size);
+	memset(m, 0, sizeof(*m));
+}
+
+static int manifest_open(struct manifest *m, const char *dirname)
+{
+	char path[PATH_MAX];
+	struct cache_reader r;
+	uint32_t magic, version, n, i;
+	struct stat st;
+	int fd, err;
+
+	memset(m, 0, sizeof(*m));
+
+	snprintf(path, sizeof(path), "%s/modules.manifest", dirname);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		err = -errno;
+		if (err != -ENOENT)
+			WRN("could not open %s: %m\n", path);
+		return err;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	m->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m->map == MAP_FAILED) {
+		err = -errno;
+		WRN("could not mmap %s: %m\n", path);
+		m->map = NULL;
+		return err;
+	}
+	m->size = st.st_size;
+
+	m->dirs = hash_new(256, NULL);
+	if (m->dirs == NULL) {
+		err = -errno;
+		manifest_close(m);
+		return err;
+	}
+
+	r.p = m->map;
+	r.end = r.p + m->size;
+	if (!cache_read_u32(&r, &magic) || magic != MANIFEST_MAGIC ||
+			!cache_read_u32(&r, &version) ||
+			version != MANIFEST_VERSION ||
+			!cache_read_u32(&r, &n)) {
+		DBG("ignoring %s: not written by this depmod\n", path);
+		manifest_close(m);
+		return -EINVAL;
+	}
+
+	/* check the whole file now, so lookups can't fail later */
+	for (i = 0; i < n; i++) {
+		const char *relpath, *record, *name;
+		uint32_t len, n_entries, type, j;
+		uint64_t mtime;
+
+		if (!cache_read_str(&r, &relpath, &len))
+			goto corrupted;
+		record = r.p;
+		if (!cache_read_u64(&r, &mtime) ||
+				!cache_read_u32(&r, &n_entries))
+			goto corrupted;
+		for (j = 0; j < n_entries; j++) {
+			if (!cache_read_u32(&r, &type) || type > MANIFEST_DIR ||
+					!cache_read_str(&r, &name, &len))
+				goto corrupted;
+		}
+
+		if (hash_add(m->dirs, relpath, record) < 0)
+			goto corrupted;
+	}
+
+	return 0;
+
+corrupted:
+	WRN("%s is corrupted, ignoring it\n", path);
+	manifest_close(m);
+	return -EINVAL;
+}
+
+/*
+ * Find the record of @relpath, leaving @r at its first entry. The file was
+ * checked when opened, so reading the entries can't fail.
+ */
+static bool manifest_find(const struct manifest *m, const char *relpath,
+			uint64_t *mtime, uint32_t *n_entries,
+			struct cache_reader *r)
+{
+	const char *record;
+
+	if (m->dirs == NULL)
+		return false;
+
+	record = hash_find(m->dirs, relpath);
+	if (record == NULL)
+		return false;
+
+	r->p = record;
+	r->end = (const char *)m->map + m->size;
+	return cache_read_u64(r, mtime) && cache_read_u32(r, n_entries);
+}
+
+static void manifest_read_entry(struct cache_reader *r, uint32_t *type,
+							const char **name)
+{
+	uint32_t len;
+
+	if (!cache_read_u32(r, type) || !cache_read_str(r, name, &len)) {
+		*type = MANIFEST_MODULE;
+		*name = "";
+	}
+}
+
+/*
+ * Only an mtime older than when the directory was read tells it didn't
+ * change since: one made within the filesystem's timestamp granularity
+ * could be kept by a later change.
+ */
+static uint64_t manifest_dir_mtime(const struct stat *st)
+{
+	if (st->st_mtim.tv_sec + 1 >= time(NULL))
+		return 0;
+
+	return ts_usec(&st->st_mtim);
+}
+
+enum depmod_phase {
+	DEPMOD_PHASE_CHECK, /* -A */
+	DEPMOD_PHASE_CONFIG,
+	DEPMOD_PHASE_SEARCH,
+	DEPMOD_PHASE_BUILD_ARRAY,
+	DEPMOD_PHASE_SORT,
+	DEPMOD_PHASE_LOAD_MODULES,
+	DEPMOD_PHASE_LOAD_DEPENDENCIES,
+	DEPMOD_PHASE_CALCULATE_DEPENDENCIES,
+	DEPMOD_PHASE_OUTPUT,
+	_DEPMOD_PHASE_COUNT,
+};
+
+static const char *const depmod_phase_names[] = {
+	[DEPMOD_PHASE_CHECK] = "check",
+	[DEPMOD_PHASE_CONFIG] = "config",
+	[DEPMOD_PHASE_SEARCH] = "search",
+	[DEPMOD_PHASE_BUILD_ARRAY] = "build_array",
+	[DEPMOD_PHASE_SORT] = "sort",
+	[DEPMOD_PHASE_LOAD_MODULES] = "load_modules",
+	[DEPMOD_PHASE_LOAD_DEPENDENCIES] = "load_dependencies",
+	[DEPMOD_PHASE_CALCULATE_DEPENDENCIES] = "calculate_dependencies",
+	[DEPMOD_PHASE_OUTPUT] = "output",
+};
+
+#define DEPMOD_STATS_MAX_OUTPUTS 16
+
+/* What --stats reports, times are in microseconds */
+struct depmod_stats {
+	bool json;
+	uint64_t wall_start; /* of the running phase */
+	uint64_t cpu_start;
+	struct {
+		bool ran;
+		uint64_t wall;
+		uint64_t cpu; /* of all threads */
+		long maxrss; /* KiB, peak of the process so far */
+	} phases[_DEPMOD_PHASE_COUNT];
+	struct {
+		const char *name;
+		uint64_t size;
+		uint64_t write_time;
+	} outputs[DEPMOD_STATS_MAX_OUTPUTS];
+	unsigned int n_outputs;
+};
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_usec(&ts);
+}
+
+static uint64_t cpu_usec(long *maxrss)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return 0;
+	if (maxrss != NULL)
+		*maxrss = ru.ru_maxrss;
+
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+				ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void depmod_stats_begin(struct depmod_stats *stats)
+{
+	if (stats == NULL)
+		return;
+
+	stats->wall_start = now_usec();
+	stats->cpu_start = cpu_usec(NULL);
+}
+
+static void depmod_stats_end(struct depmod_stats *stats,
+						enum depmod_phase phase)
+{
+	if (stats == NULL)
+		return;
+
+	stats->phases[phase].ran = true;
+	stats->phases[phase].wall = now_usec() - stats->wall_start;
+	stats->phases[phase].cpu = cpu_usec(&stats->phases[phase].maxrss) -
+							stats->cpu_start;
+}
+
+struct depmod {
+	const struct cfg *cfg;
+	struct kmod_ctx *ctx;
+	struct arena arena; /* struct mod and struct symbol, with their strings */
+	struct array modules;
+	struct hash *modules_by_uncrelpath;
+	struct hash *modules_by_name;
+	struct hash *symbols;
+	struct manifest manifest; /* from the last run, while searching */
+	struct array manifest_dirs; /* struct manifest_dir, for the next run */
+	bool manifest_incomplete; /* some directory couldn't be listed */
+	struct depmod_stats *stats; /* NULL without --stats */
+};
+
+static void mod_free(struct mod *mod)
+{
+	DBG("free %p kmod=%p, path=%s\n", mod, mod->kmod, mod->path);
+	array_free_array(&mod->deps);
+	kmod_module_unref(mod->kmod);
+	kmod_module_info_free_list(mod->info_list);
 	kmod_module_dependency_symbols_free_list(mod->dep_sym_list);
-	free(mod->uncrelpath);
-	free(mod->path);
-	free(mod);
+	kmod_module_symbols_free_list(mod->sym_list);
 }
 
 static int mod_add_dependency(struct mod *mod, struct symbol *sym)
@@ -856,13 +1886,6 @@ static int mod_add_dependency(struct mod *mod, struct symbol *sym)
 	return 0;
 }
 
-static void symbol_free(struct symbol *sym)
-{
-	DBG("free %p sym=%s, owner=%p %s\n", sym, sym->name, sym->owner,
-	    sym->owner != NULL ? sym->owner->path : "");
-	free(sym);
-}
-
 static int depmod_init(struct depmod *depmod, struct cfg *cfg,
 							struct kmod_ctx *ctx)
 {
@@ -871,7 +1894,11 @@ static int depmod_init(struct depmod *depmod, struct cfg *cfg,
 	depmod->cfg = cfg;
 	depmod->ctx = ctx;
 
+	arena_init(&depmod->arena, 0);
 	array_init(&depmod->modules, 128);
+	array_init(&depmod->manifest_dirs, 64);
+	memset(&depmod->manifest, 0, sizeof(depmod->manifest));
+	depmod->manifest_incomplete = false;
 
 	depmod->modules_by_uncrelpath = hash_new(512, NULL);
 	if (depmod->modules_by_uncrelpath == NULL) {
@@ -885,7 +1912,7 @@ static int depmod_init(struct depmod *depmod, struct cfg *cfg,
 		goto modules_by_name_failed;
 	}
 
-	depmod->symbols = hash_new(2048, (void (*)(void *))symbol_free);
+	depmod->symbols = hash_new(2048, NULL);
 	if (depmod->symbols == NULL) {
 		err = -errno;
 		goto symbols_failed;
@@ -915,6 +1942,16 @@ static void depmod_shutdown(struct depmod *depmod)
 		mod_free(depmod->modules.array[i]);
 	array_free_array(&depmod->modules);
 
+	manifest_close(&depmod->manifest);
+	for (i = 0; i < depmod->manifest_dirs.count; i++) {
+		struct manifest_dir *dir = depmod->manifest_dirs.array[i];
+
+		array_free_array(&dir->entries);
+	}
+	array_free_array(&depmod->manifest_dirs);
+
+	arena_release(&depmod->arena);
+
 	kmod_unref(depmod->ctx);
 }
 
@@ -929,7 +1966,7 @@ static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 	modname = kmod_module_get_name(kmod);
 	modnamesz = strlen(modname) + 1;
 
-	mod = calloc(1, sizeof(struct mod) + modnamesz);
+	mod = arena_zalloc(&depmod->arena, sizeof(struct mod) + modnamesz);
 	if (mod == NULL)
 		return -ENOMEM;
 	mod->kmod = kmod;
@@ -940,7 +1977,7 @@ static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 
 	array_init(&mod->deps, 4);
 
-	mod->path = strdup(kmod_module_get_path(kmod));
+	mod->path = arena_strdup(&depmod->arena, kmod_module_get_path(kmod));
 	lastslash = strrchr(mod->path, '/');
 	mod->baselen = lastslash - mod->path;
 	if (strncmp(mod->path, cfg->dirname, cfg->dirnamelen) == 0 &&
@@ -958,7 +1995,8 @@ static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 	if (mod->relpath != NULL) {
 		size_t uncrelpathlen = lastslash - mod->relpath + modnamesz
 				       + strlen(KMOD_EXTENSION_UNCOMPRESSED);
-		mod->uncrelpath = memdup(mod->relpath, uncrelpathlen + 1);
+		mod->uncrelpath = arena_memdup(&depmod->arena, mod->relpath,
+							uncrelpathlen + 1);
 		mod->uncrelpath[uncrelpathlen] = '\0';
 		err = hash_add_unique(depmod->modules_by_uncrelpath,
 				      mod->uncrelpath, mod);
@@ -975,8 +2013,7 @@ static int depmod_module_add(struct depmod *depmod, struct kmod_module *kmod)
 	return 0;
 
 fail:
-	free(mod->uncrelpath);
-	free(mod);
+	/* memory is only given back to the arena in depmod_shutdown() */
 	return err;
 }
 
@@ -1108,75 +2145,154 @@ add:
 	return 0;
 }
 
-static int depmod_modules_search_dir(struct depmod *depmod, DIR *d, size_t baselen, char *path)
+static bool depmod_dirent_skip(const char *name)
+{
+	if (name[0] == '.' && (name[1] == '\0' ||
+			       (name[1] == '.' && name[2] == '\0')))
+		return true;
+	return streq(name, "build") || streq(name, "source");
+}
+
+/* 1 for a directory, 0 for a regular file, < 0 for anything else */
+static int depmod_entry_is_dir(int dfd, const struct dir_entry *de,
+							const char *path)
+{
+	int type = dir_entry_type(dfd, de, NULL);
+
+	if (type < 0) {
+		ERR("fstatat(%d, %s): %s\n", dfd, de->name, strerror(-type));
+		return type;
+	}
+	if (type == DT_REG)
+		return 0;
+	if (type == DT_DIR)
+		return 1;
+
+	ERR("unsupported file type %s: %o\n", path, DTTOIF(type));
+	return -EINVAL;
+}
+
+static struct manifest_dir *depmod_manifest_dir_new(struct depmod *depmod,
+							const char *relpath)
+{
+	struct manifest_dir *dir;
+
+	dir = NOFAIL(arena_alloc(&depmod->arena, sizeof(*dir)));
+	dir->relpath = NOFAIL(arena_strdup(&depmod->arena, relpath));
+	dir->mtime = 0;
+	array_init(&dir->entries, 16);
+
+	return dir;
+}
+
+static void manifest_dir_add(struct depmod *depmod, struct manifest_dir *dir,
+				enum manifest_type type, const char *name,
+				size_t namelen)
+{
+	struct manifest_entry *entry;
+
+	entry = NOFAIL(arena_alloc(&depmod->arena,
+					sizeof(*entry) + namelen + 1));
+	entry->type = type;
+	memcpy(entry->name, name, namelen + 1);
+	if (array_append(&dir->entries, entry) < 0)
+		depmod->manifest_incomplete = true;
+}
+
+/*
+ * Entries come from the directory, or from the manifest of the last run if
+ * it didn't change since then, which also saves finding their type.
+ */
+static int depmod_modules_search_dir(struct depmod *depmod, struct dir_reader *r, size_t baselen, char *path)
 {
-	struct dirent *de;
-	int err = 0, dfd = dirfd(d);
+	const char *relpath = path + depmod->cfg->dirnamelen + 1;
+	struct manifest_dir *dir;
+	struct cache_reader old;
+	uint32_t i = 0, n_old;
+	uint64_t old_mtime;
+	bool reuse = false;
+	struct stat st;
+	int err = 0, dfd = r->fd;
+
+	dir = depmod_manifest_dir_new(depmod, relpath);
+	if (fstat(dfd, &st) == 0) {
+		dir->mtime = manifest_dir_mtime(&st);
+		reuse = dir->mtime != 0 &&
+			manifest_find(&depmod->manifest, relpath, &old_mtime,
+							&n_old, &old) &&
+			old_mtime == dir->mtime;
+	}
 
-	while ((de = readdir(d)) != NULL) {
-		const char *name = de->d_name;
+	while (1) {
+		struct dir_entry de;
+		const char *name;
 		size_t namelen;
-		uint8_t is_dir;
+		int is_dir = 0;
+
+		if (reuse) {
+			uint32_t type;
+
+			if (i++ == n_old)
+				break;
+			manifest_read_entry(&old, &type, &name);
+			is_dir = type == MANIFEST_DIR;
+		} else {
+			int ret = dir_reader_next(r, &de);
+
+			if (ret < 0) {
+				ERR("getdents64(%d=%s): %s\n", dfd, path,
+							strerror(-ret));
+				depmod->manifest_incomplete = true;
+			}
+			if (ret <= 0)
+				break;
+			name = de.name;
+			if (depmod_dirent_skip(name))
+				continue;
+		}
 
-		if (name[0] == '.' && (name[1] == '\0' ||
-				       (name[1] == '.' && name[2] == '\0')))
-			continue;
-		if (streq(name, "build") || streq(name, "source"))
-			continue;
 		namelen = strlen(name);
 		if (baselen + namelen + 2 >= PATH_MAX) {
 			path[baselen] = '\0';
 			ERR("path is too long %s%s\n", path, name);
+			depmod->manifest_incomplete = true;
 			continue;
 		}
 		memcpy(path + baselen, name, namelen + 1);
 
-		if (de->d_type == DT_REG)
-			is_dir = 0;
-		else if (de->d_type == DT_DIR)
-			is_dir = 1;
-		else {
-			struct stat st;
-			if (fstatat(dfd, name, &st, 0) < 0) {
-				ERR("fstatat(%d, %s): %m\n", dfd, name);
-				continue;
-			} else if (S_ISREG(st.st_mode))
-				is_dir = 0;
-			else if (S_ISDIR(st.st_mode))
-				is_dir = 1;
-			else {
-				ERR("unsupported file type %s: %o\n",
-				    path, st.st_mode & S_IFMT);
+		if (!reuse) {
+			is_dir = depmod_entry_is_dir(dfd, &de, path);
+			if (is_dir < 0)
 				continue;
-			}
 		}
 
 		if (is_dir) {
-			int fd;
-			DIR *subdir;
+			struct dir_reader subdir;
+
+			manifest_dir_add(depmod, dir, MANIFEST_DIR, name,
+								namelen);
 			if (baselen + namelen + 2 + NAME_MAX >= PATH_MAX) {
 				ERR("directory path is too long %s\n", path);
+				depmod->manifest_incomplete = true;
 				continue;
 			}
-			fd = openat(dfd, name, O_RDONLY);
-			if (fd < 0) {
-				ERR("openat(%d, %s, O_RDONLY): %m\n",
-				    dfd, name);
-				continue;
-			}
-			subdir = fdopendir(fd);
-			if (subdir == NULL) {
-				ERR("fdopendir(%d): %m\n", fd);
-				close(fd);
+			err = dir_reader_open(&subdir, dfd, name);
+			if (err < 0) {
+				ERR("openat(%d, %s, O_RDONLY): %s\n",
+				    dfd, name, strerror(-err));
+				depmod->manifest_incomplete = true;
 				continue;
 			}
 			path[baselen + namelen] = '/';
 			path[baselen + namelen + 1] = '\0';
-			err = depmod_modules_search_dir(depmod, subdir,
+			err = depmod_modules_search_dir(depmod, &subdir,
 							baselen + namelen + 1,
 							path);
-			closedir(subdir);
+			dir_reader_close(&subdir);
 		} else {
+			if (path_ends_with_kmod_ext(name, namelen))
+				manifest_dir_add(depmod, dir, MANIFEST_MODULE,
+							name, namelen);
 			err = depmod_modules_search_file(depmod, baselen,
 							 namelen, path);
 		}
@@ -1188,18 +2304,28 @@ static int depmod_modules_search_dir(struct depmod *depmod, DIR *d, size_t basel
 		}
 	}
 
+	path[baselen] = '\0';
+	if (reuse)
+		DBG("reused the entries of %s\n", path);
+
+	if (array_append(&depmod->manifest_dirs, dir) < 0)
+		depmod->manifest_incomplete = true;
+
 	return err;
 }
 
 static int depmod_modules_search(struct depmod *depmod)
 {
 	char path[PATH_MAX];
-	DIR *d = opendir(depmod->cfg->dirname);
+	struct dir_reader r;
 	size_t baselen;
-	int err;
-	if (d == NULL) {
-		err = -errno;
-		ERR("could not open directory %s: %m\n", depmod->cfg->dirname);
+	int err, fd;
+
+	fd = open(depmod->cfg->dirname, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0 || (err = dir_reader_init(&r, fd)) < 0) {
+		err = fd < 0 ? -errno : err;
+		ERR("could not open directory %s: %s\n", depmod->cfg->dirname,
+							strerror(-err));
 		return err;
 	}
 
@@ -1209,8 +2335,10 @@ static int depmod_modules_search(struct depmod *depmod)
 	baselen++;
 	path[baselen] = '\0';
 
-	err = depmod_modules_search_dir(depmod, d, baselen, path);
-	closedir(d);
+	manifest_open(&depmod->manifest, depmod->cfg->dirname);
+	err = depmod_modules_search_dir(depmod, &r, baselen, path);
+	manifest_close(&depmod->manifest);
+	dir_reader_close(&r);
 	return err;
 }
 
@@ -1303,7 +2431,7 @@ static int depmod_symbol_add(struct depmod *depmod, const char *name,
 		name++;
 
 	namelen = strlen(name) + 1;
-	sym = malloc(sizeof(struct symbol) + namelen);
+	sym = arena_alloc(&depmod->arena, sizeof(struct symbol) + namelen);
 	if (sym == NULL)
 		return -ENOMEM;
 
@@ -1312,10 +2440,8 @@ static int depmod_symbol_add(struct depmod *depmod, const char *name,
 	memcpy(sym->name, name, namelen);
 
 	err = hash_add(depmod->symbols, sym->name, sym);
-	if (err < 0) {
-		free(sym);
+	if (err < 0)
 		return err;
-	}
 
 	DBG("add %p sym=%s, owner=%p %s\n", sym, sym->name, owner,
 	    owner != NULL ? owner->path : "");
@@ -1333,89 +2459,402 @@ static struct symbol *depmod_symbol_find(const struct depmod *depmod,
 	return hash_find(depmod->symbols, name);
 }
 
-static int depmod_load_modules(struct depmod *depmod)
+/*
+ * Parse everything depmod needs from the module's ELF file. It only touches
+ * @mod and @kmod, so it can run in parallel for different modules as long as
+ * each thread uses its own context.
+ */
+static void depmod_parse_module(struct mod *mod, struct kmod_module *kmod)
 {
-	struct mod **itr, **itr_end;
+	mod->sym_err = kmod_module_get_symbols(kmod, &mod->sym_list);
+	kmod_module_get_info(kmod, &mod->info_list);
+	kmod_module_get_dependency_symbols(kmod, &mod->dep_sym_list);
+	mod->parsed = true;
+}
 
-	DBG("load symbols (%zd modules)\n", depmod->modules.count);
+struct depmod_worker {
+	const struct depmod *depmod;
+	struct kmod_ctx *ctx; /* NULL to use the modules from depmod->ctx */
+	size_t *next;
+	pthread_t thread;
+};
 
-	itr = (struct mod **)depmod->modules.array;
-	itr_end = itr + depmod->modules.count;
-	for (; itr < itr_end; itr++) {
-		struct mod *mod = *itr;
-		struct kmod_list *l, *list = NULL;
-		int err = kmod_module_get_symbols(mod->kmod, &list);
-		if (err < 0) {
-			if (err == -ENOENT)
-				DBG("ignoring %s: no symbols\n", mod->path);
-			else
-				ERR("failed to load symbols from %s: %s\n",
-						mod->path, strerror(-err));
-			goto load_info;
-		}
-		kmod_list_foreach(l, list) {
-			const char *name = kmod_module_symbol_get_symbol(l);
-			uint64_t crc = kmod_module_symbol_get_crc(l);
-			depmod_symbol_add(depmod, name, false, crc, mod);
+static void *depmod_worker_run(void *data)
+{
+	struct depmod_worker *w = data;
+	struct mod **mods = (struct mod **)w->depmod->modules.array;
+	size_t count = w->depmod->modules.count;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(w->next, 1, __ATOMIC_RELAXED)) < count) {
+		struct mod *mod = mods[i];
+		struct kmod_module *kmod;
+
+		if (mod->parsed)
+			continue;
+
+		if (w->ctx == NULL) {
+			depmod_parse_module(mod, mod->kmod);
+			/* drop it now so its file is closed */
+			kmod_module_unref(mod->kmod);
+			mod->kmod = NULL;
+			continue;
 		}
-		kmod_module_symbols_free_list(list);
 
-load_info:
-		kmod_module_get_info(mod->kmod, &mod->info_list);
-		kmod_module_get_dependency_symbols(mod->kmod,
-						   &mod->dep_sym_list);
-		kmod_module_unref(mod->kmod);
-		mod->kmod = NULL;
+		mod->sym_err = kmod_module_new_from_path(w->ctx, mod->path,
+									&kmod);
+		if (mod->sym_err < 0)
+			continue;
+		depmod_parse_module(mod, kmod);
+		kmod_module_unref(kmod);
 	}
 
-	DBG("loaded symbols (%zd modules, %u symbols)\n",
-	    depmod->modules.count, hash_get_count(depmod->symbols));
-
-	return 0;
+	return NULL;
 }
 
-static int depmod_load_module_dependencies(struct depmod *depmod, struct mod *mod)
+/*
+ * Parse the modules with cfg->jobs threads. Each extra thread gets its own
+ * context so they don't contend on the module pool, while the calling thread
+ * takes its share using depmod->ctx. If threads can't be created, the ones
+ * that are running pick up the remaining modules.
+ */
+static void depmod_parse_modules(struct depmod *depmod)
 {
 	const struct cfg *cfg = depmod->cfg;
-	struct kmod_list *l;
-
-	DBG("do dependencies of %s\n", mod->path);
-	kmod_list_foreach(l, mod->dep_sym_list) {
-		const char *name = kmod_module_dependency_symbol_get_symbol(l);
-		uint64_t crc = kmod_module_dependency_symbol_get_crc(l);
-		int bindtype = kmod_module_dependency_symbol_get_bind(l);
-		struct symbol *sym = depmod_symbol_find(depmod, name);
-		uint8_t is_weak = bindtype == KMOD_SYMBOL_WEAK;
+	const char *null_kmod_config = NULL;
+	struct depmod_worker self, *workers;
+	unsigned int i, n_workers = 0;
+	size_t next = 0;
+
+	workers = calloc(cfg->jobs - 1, sizeof(*workers));
+	if (workers == NULL)
+		WRN("could not allocate workers, parsing modules serially\n");
+
+	for (i = 0; workers != NULL && i < cfg->jobs - 1; i++) {
+		struct depmod_worker *w = &workers[n_workers];
+		int err;
+
+		w->depmod = depmod;
+		w->next = &next;
+		w->ctx = kmod_new(cfg->dirname, &null_kmod_config);
+		if (w->ctx == NULL)
+			break;
+		log_setup_kmod_log(w->ctx, verbose);
 
-		if (sym == NULL) {
-			DBG("%s needs (%c) unknown symbol %s\n",
-			    mod->path, bindtype, name);
-			if (cfg->print_unknown && !is_weak)
-				WRN("%s needs unknown symbol %s\n",
-				    mod->path, name);
-			continue;
+		err = pthread_create(&w->thread, NULL, depmod_worker_run, w);
+		if (err != 0) {
+			WRN("could not create thread: %s\n", strerror(err));
+			kmod_unref(w->ctx);
+			break;
 		}
+		n_workers++;
+	}
 
-		if (cfg->check_symvers && sym->crc != crc && !is_weak) {
-			DBG("symbol %s (%#"PRIx64") module %s (%#"PRIx64")\n",
-			    sym->name, sym->crc, mod->path, crc);
-			if (cfg->print_unknown)
-				WRN("%s disagrees about version of symbol %s\n",
-				    mod->path, name);
-		}
+	DBG("parsing modules with %u extra threads\n", n_workers);
 
-		mod_add_dependency(mod, sym);
+	self.depmod = depmod;
+	self.ctx = NULL;
+	self.next = &next;
+	depmod_worker_run(&self);
+
+	for (i = 0; i < n_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		kmod_unref(workers[i].ctx);
 	}
 
-	return 0;
+	free(workers);
 }
 
-static int depmod_load_dependencies(struct depmod *depmod)
-{
-	struct mod **itr, **itr_end;
+/*
+ * modules.cache keeps what depmod_parse_module() extracts from each module,
+ * so unchanged modules don't need to be opened again. It's only meant to be
+ * used on the machine that wrote it: numbers are in native byte order and a
+ * cache with a different magic or version is ignored. Strings are stored
+ * with their length, including the terminating NUL.
+ *
+ * header: magic, version, number of entries
+ * entry: relpath, size, mtime, ctime, inode, symbols error,
+ *        n_symbols * { crc, symbol },
+ *        n_info * { key, value },
+ *        n_dependency_symbols * { crc, bind, symbol }
+ */
+#define CACHE_MAGIC 0xB007CAC4
+#define CACHE_VERSION 1
 
-	DBG("load dependencies (%zd modules, %u symbols)\n",
-	    depmod->modules.count, hash_get_count(depmod->symbols));
+/*
+ * Read the lists of an entry into @mod, or just skip over them if @mod is
+ * NULL. On failure nothing is added to @mod.
+ */
+static bool cache_read_lists(struct cache_reader *r, struct mod *mod)
+{
+	struct kmod_list *sym_list = NULL, *info_list = NULL;
+	struct kmod_list *dep_sym_list = NULL;
+	uint32_t sym_err, i, n, len, bind;
+	const char *str, *value;
+	uint64_t crc;
+
+	if (!cache_read_u32(r, &sym_err) || !cache_read_u32(r, &n))
+		goto fail;
+	for (i = 0; i < n; i++) {
+		if (!cache_read_u64(r, &crc) || !cache_read_str(r, &str, &len))
+			goto fail;
+		if (mod != NULL &&
+			kmod_module_symbols_append(&sym_list, crc, str) == NULL)
+			goto fail;
+	}
+
+	if (!cache_read_u32(r, &n))
+		goto fail;
+	for (i = 0; i < n; i++) {
+		uint32_t valuelen;
+
+		if (!cache_read_str(r, &str, &len) ||
+				!cache_read_str(r, &value, &valuelen))
+			goto fail;
+		if (mod != NULL && kmod_module_info_append(&info_list, str, len,
+						value, valuelen) == NULL)
+			goto fail;
+	}
+
+	if (!cache_read_u32(r, &n))
+		goto fail;
+	for (i = 0; i < n; i++) {
+		if (!cache_read_u64(r, &crc) || !cache_read_u32(r, &bind) ||
+				!cache_read_str(r, &str, &len))
+			goto fail;
+		if (mod != NULL && kmod_module_dependency_symbols_append(
+				&dep_sym_list, crc, bind, str) == NULL)
+			goto fail;
+	}
+
+	if (mod != NULL) {
+		mod->sym_err = (int32_t) sym_err;
+		mod->sym_list = sym_list;
+		mod->info_list = info_list;
+		mod->dep_sym_list = dep_sym_list;
+		mod->parsed = true;
+	}
+	return true;
+
+fail:
+	kmod_module_symbols_free_list(sym_list);
+	kmod_module_info_free_list(info_list);
+	kmod_module_dependency_symbols_free_list(dep_sym_list);
+	return false;
+}
+
+static void depmod_stamp_modules(struct depmod *depmod)
+{
+	struct mod **itr, **itr_end;
+
+	itr = (struct mod **)depmod->modules.array;
+	itr_end = itr + depmod->modules.count;
+	for (; itr < itr_end; itr++) {
+		struct mod *mod = *itr;
+		struct stat st;
+
+		if (mod->relpath == NULL || stat(mod->path, &st) < 0)
+			continue;
+
+		mod->stamp.size = st.st_size;
+		mod->stamp.mtime = ts_usec(&st.st_mtim);
+		mod->stamp.ctime = ts_usec(&st.st_ctim);
+		mod->stamp.ino = st.st_ino;
+		mod->stamped = true;
+	}
+}
+
+/* Fill the modules that didn't change since modules.cache was written */
+static void depmod_cache_load(struct depmod *depmod)
+{
+	const struct cfg *cfg = depmod->cfg;
+	struct mod **itr, **itr_end;
+	struct cache_reader r;
+	uint32_t magic, version, n, i;
+	unsigned int hits = 0;
+	char path[PATH_MAX];
+	struct hash *by_relpath;
+	struct stat st;
+	void *p;
+	int fd;
+
+	depmod_stamp_modules(depmod);
+
+	if (snprintf(path, sizeof(path), "%s/modules.cache",
+					cfg->dirname) >= (int)sizeof(path))
+		return;
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			WRN("could not open %s: %m\n", path);
+		return;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		WRN("could not mmap %s: %m\n", path);
+		return;
+	}
+
+	by_relpath = hash_new(512, NULL);
+	if (by_relpath == NULL) {
+		munmap(p, st.st_size);
+		return;
+	}
+
+	itr = (struct mod **)depmod->modules.array;
+	itr_end = itr + depmod->modules.count;
+	for (; itr < itr_end; itr++) {
+		if ((*itr)->stamped)
+			hash_add(by_relpath, (*itr)->relpath, *itr);
+	}
+
+	r.p = p;
+	r.end = r.p + st.st_size;
+	if (!cache_read_u32(&r, &magic) || magic != CACHE_MAGIC ||
+			!cache_read_u32(&r, &version) || version != CACHE_VERSION ||
+			!cache_read_u32(&r, &n)) {
+		DBG("ignoring %s: not a cache written by this depmod\n", path);
+		goto done;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct mod_stamp stamp;
+		const char *relpath;
+		uint32_t len;
+		struct mod *mod;
+
+		if (!cache_read_str(&r, &relpath, &len) ||
+				!cache_read_u64(&r, &stamp.size) ||
+				!cache_read_u64(&r, &stamp.mtime) ||
+				!cache_read_u64(&r, &stamp.ctime) ||
+				!cache_read_u64(&r, &stamp.ino))
+			goto corrupted;
+
+		mod = hash_find(by_relpath, relpath);
+		if (mod != NULL && (mod->parsed ||
+				memcmp(&mod->stamp, &stamp, sizeof(stamp)) != 0))
+			mod = NULL;
+
+		if (!cache_read_lists(&r, mod))
+			goto corrupted;
+		if (mod != NULL)
+			hits++;
+	}
+
+done:
+	DBG("reusing %u of %zd modules from %s\n", hits,
+					depmod->modules.count, path);
+	hash_free(by_relpath);
+	munmap(p, st.st_size);
+	return;
+
+corrupted:
+	WRN("%s is corrupted, ignoring the rest of it\n", path);
+	goto done;
+}
+
+static int depmod_load_modules(struct depmod *depmod)
+{
+	struct mod **itr, **itr_end;
+
+	DBG("load symbols (%zd modules)\n", depmod->modules.count);
+
+	if (depmod->cfg->cache)
+		depmod_cache_load(depmod);
+
+	if (depmod->cfg->jobs > 1)
+		depmod_parse_modules(depmod);
+
+	/*
+	 * Symbols are always merged in the modules' order, so the result
+	 * doesn't depend on how the parsing was scheduled.
+	 */
+	itr = (struct mod **)depmod->modules.array;
+	itr_end = itr + depmod->modules.count;
+	for (; itr < itr_end; itr++) {
+		struct mod *mod = *itr;
+		struct kmod_list *l;
+
+		if (!mod->parsed)
+			depmod_parse_module(mod, mod->kmod);
+
+		if (mod->sym_err < 0) {
+			if (mod->sym_err == -ENOENT)
+				DBG("ignoring %s: no symbols\n", mod->path);
+			else
+				ERR("failed to load symbols from %s: %s\n",
+					mod->path, strerror(-mod->sym_err));
+		}
+		kmod_list_foreach(l, mod->sym_list) {
+			const char *name = kmod_module_symbol_get_symbol(l);
+			uint64_t crc = kmod_module_symbol_get_crc(l);
+			depmod_symbol_add(depmod, name, false, crc, mod);
+		}
+		/* still needed to write modules.cache */
+		if (!depmod->cfg->cache) {
+			kmod_module_symbols_free_list(mod->sym_list);
+			mod->sym_list = NULL;
+		}
+
+		kmod_module_unref(mod->kmod);
+		mod->kmod = NULL;
+	}
+
+	DBG("loaded symbols (%zd modules, %u symbols)\n",
+	    depmod->modules.count, hash_get_count(depmod->symbols));
+
+	return 0;
+}
+
+static int depmod_load_module_dependencies(struct depmod *depmod, struct mod *mod)
+{
+	const struct cfg *cfg = depmod->cfg;
+	struct kmod_list *l;
+
+	DBG("do dependencies of %s\n", mod->path);
+	kmod_list_foreach(l, mod->dep_sym_list) {
+		const char *name = kmod_module_dependency_symbol_get_symbol(l);
+		uint64_t crc = kmod_module_dependency_symbol_get_crc(l);
+		int bindtype = kmod_module_dependency_symbol_get_bind(l);
+		struct symbol *sym = depmod_symbol_find(depmod, name);
+		uint8_t is_weak = bindtype == KMOD_SYMBOL_WEAK;
+
+		if (sym == NULL) {
+			DBG("%s needs (%c) unknown symbol %s\n",
+			    mod->path, bindtype, name);
+			if (cfg->print_unknown && !is_weak)
+				WRN("%s needs unknown symbol %s\n",
+				    mod->path, name);
+			continue;
+		}
+
+		if (cfg->check_symvers && sym->crc != crc && !is_weak) {
+			DBG("symbol %s (%#"PRIx64") module %s (%#"PRIx64")\n",
+			    sym->name, sym->crc, mod->path, crc);
+			if (cfg->print_unknown)
+				WRN("%s disagrees about version of symbol %s\n",
+				    mod->path, name);
+		}
+
+		mod_add_dependency(mod, sym);
+	}
+
+	return 0;
+}
+
+static int depmod_load_dependencies(struct depmod *depmod)
+{
+	struct mod **itr, **itr_end;
+
+	DBG("load dependencies (%zd modules, %u symbols)\n",
+	    depmod->modules.count, hash_get_count(depmod->symbols));
 
 	itr = (struct mod **)depmod->modules.array;
 	itr_end = itr + depmod->modules.count;
@@ -1622,14 +3061,14 @@ static int depmod_report_cycles_from_root(struct depmod *depmod,
 	return 0;
 }
 
-static void depmod_report_cycles(struct depmod *depmod, uint16_t n_mods,
-				 uint16_t *users)
+static void depmod_report_cycles(struct depmod *depmod, uint32_t n_mods,
+				 uint32_t *users)
 {
 	int num_cyclic = 0;
 	struct kmod_list *roots = NULL; /* struct mod */
 	struct kmod_list *l;
 	size_t n_r; /* local n_roots */
-	int i;
+	uint32_t i;
 	int err;
 	_cleanup_free_ void **stack = NULL;
 	struct mod *m;
@@ -1683,19 +3122,23 @@ err:
 static int depmod_calculate_dependencies(struct depmod *depmod)
 {
 	const struct mod **itrm;
-	uint16_t *users, *roots, *sorted;
-	uint16_t i, n_roots = 0, n_sorted = 0, n_mods = depmod->modules.count;
+	uint32_t *users, *roots, *sorted;
+	uint32_t i, n_roots = 0, n_sorted = 0, n_mods;
 	int ret = 0;
 
-	users = malloc(sizeof(uint16_t) * n_mods * 3);
+	if (depmod->modules.count >= UINT32_MAX) {
+		ERR("too many modules: %zu\n", depmod->modules.count);
+		return -E2BIG;
+	}
+	n_mods = depmod->modules.count;
+
+	users = malloc(sizeof(uint32_t) * n_mods * 3);
 	if (users == NULL)
 		return -ENOMEM;
 	roots = users + n_mods;
 	sorted = roots + n_mods;
 
-	DBG("calculate dependencies and ordering (%hu modules)\n", n_mods);
-
-	assert(depmod->modules.count < UINT16_MAX);
+	DBG("calculate dependencies and ordering (%u modules)\n", n_mods);
 
 	/* populate modules users (how many modules uses it) */
 	itrm = (const struct mod **)depmod->modules.array;
@@ -1712,7 +3155,7 @@ static int depmod_calculate_dependencies(struct depmod *depmod)
 	while (n_roots > 0) {
 		const struct mod **itr_dst, **itr_dst_end;
 		struct mod *src;
-		uint16_t src_idx = roots[--n_roots];
+		uint32_t src_idx = roots[--n_roots];
 
 		src = depmod->modules.array[src_idx];
 		src->dep_sort_idx = n_sorted;
@@ -1723,7 +3166,7 @@ static int depmod_calculate_dependencies(struct depmod *depmod)
 		itr_dst_end = itr_dst + src->deps.count;
 		for (; itr_dst < itr_dst_end; itr_dst++) {
 			const struct mod *dst = *itr_dst;
-			uint16_t dst_idx = dst->idx;
+			uint32_t dst_idx = dst->idx;
 			assert(users[dst_idx] > 0);
 			users[dst_idx]--;
 			if (users[dst_idx] == 0) {
@@ -1741,7 +3184,7 @@ static int depmod_calculate_dependencies(struct depmod *depmod)
 
 	depmod_sort_dependencies(depmod);
 
-	DBG("calculated dependencies and ordering (%hu modules)\n", n_mods);
+	DBG("calculated dependencies and ordering (%u modules)\n", n_mods);
 
 exit:
 	free(users);
@@ -1752,17 +3195,23 @@ static int depmod_load(struct depmod *depmod)
 {
 	int err;
 
+	depmod_stats_begin(depmod->stats);
 	err = depmod_load_modules(depmod);
 	if (err < 0)
 		return err;
+	depmod_stats_end(depmod->stats, DEPMOD_PHASE_LOAD_MODULES);
 
+	depmod_stats_begin(depmod->stats);
 	err = depmod_load_dependencies(depmod);
 	if (err < 0)
 		return err;
+	depmod_stats_end(depmod->stats, DEPMOD_PHASE_LOAD_DEPENDENCIES);
 
+	depmod_stats_begin(depmod->stats);
 	err = depmod_calculate_dependencies(depmod);
 	if (err < 0)
 		return err;
+	depmod_stats_end(depmod->stats, DEPMOD_PHASE_CALCULATE_DEPENDENCIES);
 
 	return 0;
 }
@@ -1872,14 +3321,18 @@ static int output_deps(struct depmod *depmod, FILE *out)
 static int output_deps_bin(struct depmod *depmod, FILE *out)
 {
 	struct index_node *idx;
+	struct arena arena;
 	size_t i;
 
 	if (out == stdout)
 		return 0;
 
-	idx = index_create();
-	if (idx == NULL)
+	arena_init(&arena, 0);
+	idx = index_create(&arena);
+	if (idx == NULL) {
+		arena_release(&arena);
 		return -ENOMEM;
+	}
 
 	for (i = 0; i < depmod->modules.count; i++) {
 		const struct mod **deps, *mod = depmod->modules.array[i];
@@ -1928,15 +3381,16 @@ static int output_deps_bin(struct depmod *depmod, FILE *out)
 		}
 		line[linepos] = '\0';
 
-		duplicate = index_insert(idx, mod->modname, line, mod->idx);
+		duplicate = index_insert(&arena, idx, mod->modname, line,
+								mod->idx);
 		if (duplicate && depmod->cfg->warn_dups)
 			WRN("duplicate module deps:\n%s\n", line);
 		free(line);
 		free(deps);
 	}
 
-	index_write(idx, out);
-	index_destroy(idx);
+	index_write(idx, out, depmod->cfg->index_version, INDEX_WRITE_HASH);
+	arena_release(&arena);
 
 	return 0;
 }
@@ -1968,14 +3422,18 @@ static int output_aliases(struct depmod *depmod, FILE *out)
 static int output_aliases_bin(struct depmod *depmod, FILE *out)
 {
 	struct index_node *idx;
+	struct arena arena;
 	size_t i;
 
 	if (out == stdout)
 		return 0;
 
-	idx = index_create();
-	if (idx == NULL)
+	arena_init(&arena, 0);
+	idx = index_create(&arena);
+	if (idx == NULL) {
+		arena_release(&arena);
 		return -ENOMEM;
+	}
 
 	for (i = 0; i < depmod->modules.count; i++) {
 		const struct mod *mod = depmod->modules.array[i];
@@ -1997,16 +3455,17 @@ static int output_aliases_bin(struct depmod *depmod, FILE *out)
 			}
 			alias = buf;
 
-			duplicate = index_insert(idx, alias, mod->modname,
-						 mod->idx);
+			duplicate = index_insert(&arena, idx, alias,
+						 mod->modname, mod->idx);
 			if (duplicate && depmod->cfg->warn_dups)
 				WRN("duplicate module alias:\n%s %s\n",
 				    alias, mod->modname);
 		}
 	}
 
-	index_write(idx, out);
-	index_destroy(idx);
+	index_write(idx, out, depmod->cfg->index_version,
+						INDEX_WRITE_WILDCARDS);
+	arena_release(&arena);
 
 	return 0;
 }
@@ -2059,6 +3518,7 @@ static int output_symbols(struct depmod *depmod, FILE *out)
 static int output_symbols_bin(struct depmod *depmod, FILE *out)
 {
 	struct index_node *idx;
+	struct arena arena;
 	char alias[1024];
 	_cleanup_(scratchbuf_release) struct scratchbuf salias =
 		SCRATCHBUF_INITIALIZER(alias);
@@ -2070,9 +3530,12 @@ static int output_symbols_bin(struct depmod *depmod, FILE *out)
 	if (out == stdout)
 		return 0;
 
-	idx = index_create();
-	if (idx == NULL)
+	arena_init(&arena, 0);
+	idx = index_create(&arena);
+	if (idx == NULL) {
+		arena_release(&arena);
 		return -ENOMEM;
+	}
 
 	memcpy(alias, "symbol:", baselen);
 
@@ -2093,7 +3556,8 @@ static int output_symbols_bin(struct depmod *depmod, FILE *out)
 			goto err_scratchbuf;
 		}
 		memcpy(scratchbuf_str(&salias) + baselen, sym->name, len + 1);
-		duplicate = index_insert(idx, alias, sym->owner->modname,
+		duplicate = index_insert(&arena, idx, alias,
+							sym->owner->modname,
 							sym->owner->idx);
 
 		if (duplicate && depmod->cfg->warn_dups)
@@ -2101,10 +3565,10 @@ static int output_symbols_bin(struct depmod *depmod, FILE *out)
 						alias, sym->owner->modname);
 	}
 
-	index_write(idx, out);
+	index_write(idx, out, depmod->cfg->index_version, 0);
 
 err_scratchbuf:
-	index_destroy(idx);
+	arena_release(&arena);
 
 	if (ret < 0)
 		ERR("output symbols: %s\n", strerror(-ret));
@@ -2116,6 +3580,7 @@ static int output_builtin_bin(struct depmod *depmod, FILE *out)
 {
 	FILE *in;
 	struct index_node *idx;
+	struct arena arena;
 	char infile[PATH_MAX], line[PATH_MAX], modname[PATH_MAX];
 
 	if (out == stdout)
@@ -2129,8 +3594,10 @@ static int output_builtin_bin(struct depmod *depmod, FILE *out)
 		return 0;
 	}
 
-	idx = index_create();
+	arena_init(&arena, 0);
+	idx = index_create(&arena);
 	if (idx == NULL) {
+		arena_release(&arena);
 		fclose(in);
 		return -ENOMEM;
 	}
@@ -2142,11 +3609,11 @@ static int output_builtin_bin(struct depmod *depmod, FILE *out)
 		}
 
 		path_to_modname(line, modname, NULL);
-		index_insert(idx, modname, "", 0);
+		index_insert(&arena, idx, modname, "", 0);
 	}
 
-	index_write(idx, out);
-	index_destroy(idx);
+	index_write(idx, out, depmod->cfg->index_version, INDEX_WRITE_HASH);
+	arena_release(&arena);
 	fclose(in);
 
 	return 0;
@@ -2209,162 +3676,794 @@ static int output_devname(struct depmod *depmod, FILE *out)
 	return 0;
 }
 
-static int depmod_output(struct depmod *depmod, FILE *out)
+static void cache_write_u32(FILE *out, uint32_t v)
 {
-	static const struct depfile {
-		const char *name;
-		int (*cb)(struct depmod *depmod, FILE *out);
-	} *itr, depfiles[] = {
-		{ "modules.dep", output_deps },
-		{ "modules.dep.bin", output_deps_bin },
-		{ "modules.alias", output_aliases },
-		{ "modules.alias.bin", output_aliases_bin },
-		{ "modules.softdep", output_softdeps },
-		{ "modules.symbols", output_symbols },
-		{ "modules.symbols.bin", output_symbols_bin },
-		{ "modules.builtin.bin", output_builtin_bin },
-		{ "modules.devname", output_devname },
-		{ }
-	};
-	const char *dname = depmod->cfg->dirname;
-	int dfd, err = 0;
+	fwrite(&v, sizeof(v), 1, out);
+}
 
-	if (out != NULL)
-		dfd = -1;
-	else {
-		dfd = open(dname, O_RDONLY);
-		if (dfd < 0) {
-			err = -errno;
-			CRIT("could not open directory %s: %m\n", dname);
-			return err;
-		}
-	}
+static void cache_write_u64(FILE *out, uint64_t v)
+{
+	fwrite(&v, sizeof(v), 1, out);
+}
 
-	for (itr = depfiles; itr->name != NULL; itr++) {
-		FILE *fp = out;
-		char tmp[NAME_MAX] = "";
-		int r, ferr;
+static void cache_write_str(FILE *out, const char *str)
+{
+	uint32_t size = strlen(str) + 1;
 
-		if (fp == NULL) {
-			int flags = O_CREAT | O_TRUNC | O_WRONLY;
-			int mode = 0644;
-			int fd;
+	cache_write_u32(out, size);
+	fwrite(str, 1, size, out);
+}
 
-			snprintf(tmp, sizeof(tmp), "%s.tmp", itr->name);
-			fd = openat(dfd, tmp, flags, mode);
-			if (fd < 0) {
-				ERR("openat(%s, %s, %o, %o): %m\n",
-				    dname, tmp, flags, mode);
-				continue;
-			}
-			fp = fdopen(fd, "wb");
-			if (fp == NULL) {
-				ERR("fdopen(%d=%s/%s): %m\n", fd, dname, tmp);
-				close(fd);
-				continue;
-			}
-		}
+/* transient errors are not cached, so the module is parsed again next time */
+static bool mod_is_cacheable(const struct mod *mod)
+{
+	return mod->stamped && mod->parsed &&
+				(mod->sym_err >= 0 || mod->sym_err == -ENOENT);
+}
 
-		r = itr->cb(depmod, fp);
-		if (fp == out)
-			continue;
+static int output_cache(struct depmod *depmod, FILE *out)
+{
+	struct mod **itr, **itr_end;
+	uint32_t n = 0;
 
-		ferr = ferror(fp) | fclose(fp);
+	itr = (struct mod **)depmod->modules.array;
+	itr_end = itr + depmod->modules.count;
+	for (; itr < itr_end; itr++) {
+		if (mod_is_cacheable(*itr))
+			n++;
+	}
 
-		if (r < 0) {
-			if (unlinkat(dfd, tmp, 0) != 0)
-				ERR("unlinkat(%s, %s): %m\n", dname, tmp);
+	cache_write_u32(out, CACHE_MAGIC);
+	cache_write_u32(out, CACHE_VERSION);
+	cache_write_u32(out, n);
 
-			ERR("Could not write index '%s': %s\n", itr->name,
-								strerror(-r));
-			err = -errno;
-			break;
+	for (itr = (struct mod **)depmod->modules.array; itr < itr_end; itr++) {
+		const struct mod *mod = *itr;
+		const struct kmod_list *l;
+
+		if (!mod_is_cacheable(mod))
+			continue;
+
+		cache_write_str(out, mod->relpath);
+		cache_write_u64(out, mod->stamp.size);
+		cache_write_u64(out, mod->stamp.mtime);
+		cache_write_u64(out, mod->stamp.ctime);
+		cache_write_u64(out, mod->stamp.ino);
+		cache_write_u32(out, mod->sym_err);
+
+		n = 0;
+		kmod_list_foreach(l, mod->sym_list)
+			n++;
+		cache_write_u32(out, n);
+		kmod_list_foreach(l, mod->sym_list) {
+			cache_write_u64(out, kmod_module_symbol_get_crc(l));
+			cache_write_str(out, kmod_module_symbol_get_symbol(l));
 		}
 
-		unlinkat(dfd, itr->name, 0);
-		if (renameat(dfd, tmp, dfd, itr->name) != 0) {
-			err = -errno;
-			CRIT("renameat(%s, %s, %s, %s): %m\n",
-					dname, tmp, dname, itr->name);
-			break;
+		n = 0;
+		kmod_list_foreach(l, mod->info_list)
+			n++;
+		cache_write_u32(out, n);
+		kmod_list_foreach(l, mod->info_list) {
+			cache_write_str(out, kmod_module_info_get_key(l));
+			cache_write_str(out, kmod_module_info_get_value(l));
 		}
 
-		if (ferr) {
-			err = -ENOSPC;
-			ERR("Could not create index '%s'. Output is truncated: %s\n",
-						itr->name, strerror(-err));
-			break;
+		n = 0;
+		kmod_list_foreach(l, mod->dep_sym_list)
+			n++;
+		cache_write_u32(out, n);
+		kmod_list_foreach(l, mod->dep_sym_list) {
+			cache_write_u64(out,
+				kmod_module_dependency_symbol_get_crc(l));
+			cache_write_u32(out,
+				kmod_module_dependency_symbol_get_bind(l));
+			cache_write_str(out,
+				kmod_module_dependency_symbol_get_symbol(l));
 		}
 	}
 
-	if (dfd >= 0)
-		close(dfd);
-
-	return err;
-}
-
-static void depmod_add_fake_syms(struct depmod *depmod)
-{
-	/* __this_module is magic inserted by kernel loader. */
-	depmod_symbol_add(depmod, "__this_module", true, 0, NULL);
-	/* On S390, this is faked up too */
-	depmod_symbol_add(depmod, "_GLOBAL_OFFSET_TABLE_", true, 0, NULL);
-	/* On PowerPC64 ABIv2, .TOC. is more or less _GLOBAL_OFFSET_TABLE_ */
-	depmod_symbol_add(depmod, "TOC.", true, 0, NULL);
+	return 0;
 }
 
-static int depmod_load_symvers(struct depmod *depmod, const char *filename)
+static int output_manifest(struct depmod *depmod, FILE *out)
 {
-	char line[10240];
-	FILE *fp;
-	unsigned int linenum = 0;
-
-	fp = fopen(filename, "r");
-	if (fp == NULL) {
-		int err = -errno;
-		DBG("load symvers: %s: %m\n", filename);
-		return err;
-	}
-	DBG("load symvers: %s\n", filename);
-
-	/* eg. "0xb352177e\tfind_first_bit\tvmlinux\tEXPORT_SYMBOL" */
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		const char *ver, *sym, *where;
-		char *verend;
-		uint64_t crc;
+	size_t i, j;
 
-		linenum++;
+	cache_write_u32(out, MANIFEST_MAGIC);
+	cache_write_u32(out, MANIFEST_VERSION);
+	cache_write_u32(out, depmod->manifest_dirs.count);
 
-		ver = strtok(line, " \t");
-		sym = strtok(NULL, " \t");
-		where = strtok(NULL, " \t");
-		if (!ver || !sym || !where)
-			continue;
+	for (i = 0; i < depmod->manifest_dirs.count; i++) {
+		const struct manifest_dir *dir = depmod->manifest_dirs.array[i];
 
-		if (!streq(where, "vmlinux"))
-			continue;
+		cache_write_str(out, dir->relpath);
+		cache_write_u64(out, dir->mtime);
+		cache_write_u32(out, dir->entries.count);
+		for (j = 0; j < dir->entries.count; j++) {
+			const struct manifest_entry *entry =
+						dir->entries.array[j];
 
-		crc = strtoull(ver, &verend, 16);
-		if (verend[0] != '\0') {
-			ERR("%s:%u Invalid symbol version %s: %m\n",
-			    filename, linenum, ver);
-			continue;
+			cache_write_u32(out, entry->type);
+			cache_write_str(out, entry->name);
 		}
-
-		depmod_symbol_add(depmod, sym, false, crc, NULL);
 	}
-	depmod_add_fake_syms(depmod);
-
-	DBG("loaded symvers: %s\n", filename);
 
-	fclose(fp);
 	return 0;
 }
 
-static int depmod_load_system_map(struct depmod *depmod, const char *filename)
-{
-	const char ksymstr[] = "__ksymtab_";
-	const size_t ksymstr_len = sizeof(ksymstr) - 1;
+static const struct depfile {
+	const char *name;
+	int (*cb)(struct depmod *depmod, FILE *out);
+} depfiles[] = {
+	{ "modules.dep", output_deps },
+	{ "modules.dep.bin", output_deps_bin },
+	{ "modules.alias", output_aliases },
+	{ "modules.alias.bin", output_aliases_bin },
+	{ "modules.softdep", output_softdeps },
+	{ "modules.symbols", output_symbols },
+	{ "modules.symbols.bin", output_symbols_bin },
+	{ "modules.builtin.bin", output_builtin_bin },
+	{ "modules.devname", output_devname },
+};
+
+/*
+ * Outputs are written to unnamed files created with O_TMPFILE, or to
+ * <name>.tmp where that isn't supported, and only linked in place by
+ * depmod_output_publish() once all of them were written. An interrupted run
+ * leaves neither temporary files behind nor a mix of old and new indexes.
+ */
+struct depmod_output {
+	const char *name;
+	int fd; /* -1 if not written */
+	bool named; /* created as <name>.tmp */
+	char *buf; /* stdio buffer while writing */
+	uint64_t write_time; /* start, then duration, in usec */
+};
+
+#define OUTPUT_BUF_SIZE (256 * 1024)
+
+static int depmod_output_create(struct depmod *depmod, int dfd,
+						struct depmod_output *o)
+{
+	char tmp[NAME_MAX];
+	int err;
+
+	o->named = false;
+#ifdef O_TMPFILE
+	o->fd = openat(dfd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+	if (o->fd >= 0)
+		return 0;
+#endif
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", o->name);
+	o->fd = openat(dfd, tmp, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+	if (o->fd < 0) {
+		err = -errno;
+		ERR("openat(%s, %s): %m\n", depmod->cfg->dirname, tmp);
+		return err;
+	}
+	o->named = true;
+
+	return 0;
+}
+
+static void depmod_output_discard(int dfd, struct depmod_output *o)
+{
+	char tmp[NAME_MAX];
+
+	if (o->fd < 0)
+		return;
+
+	close(o->fd);
+	o->fd = -1;
+	if (o->named) {
+		snprintf(tmp, sizeof(tmp), "%s.tmp", o->name);
+		unlinkat(dfd, tmp, 0);
+	}
+}
+
+/*
+ * Create @o and a stream in @fp to write it. The stream has its own
+ * descriptor, o->fd is kept open for publishing.
+ */
+static int depmod_output_begin(struct depmod *depmod, int dfd,
+					struct depmod_output *o, FILE **fp)
+{
+	int fd, err;
+
+	err = depmod_output_create(depmod, dfd, o);
+	if (err < 0)
+		return err;
+
+	fd = fcntl(o->fd, F_DUPFD_CLOEXEC, 0);
+	*fp = fd < 0 ? NULL : fdopen(fd, "wb");
+	if (*fp == NULL) {
+		err = -errno;
+		ERR("fdopen(%d=%s/%s): %m\n", o->fd, depmod->cfg->dirname,
+								o->name);
+		if (fd >= 0)
+			close(fd);
+		depmod_output_discard(dfd, o);
+		return err;
+	}
+
+	o->buf = malloc(OUTPUT_BUF_SIZE);
+	if (o->buf != NULL)
+		setvbuf(*fp, o->buf, _IOFBF, OUTPUT_BUF_SIZE);
+	o->write_time = now_usec();
+
+	return 0;
+}
+
+/* Close @fp, and drop @o if writing it failed, @r telling how it went */
+static int depmod_output_end(int dfd, struct depmod_output *o, FILE *fp,
+									int r)
+{
+	int ferr = ferror(fp) | fclose(fp);
+
+	free(o->buf);
+	o->buf = NULL;
+	o->write_time = now_usec() - o->write_time;
+
+	if (r == 0 && ferr)
+		r = -ENOSPC;
+	if (r < 0) {
+		ERR("Could not write '%s': %s\n", o->name, strerror(-r));
+		depmod_output_discard(dfd, o);
+	}
+
+	return r;
+}
+
+/* Copy the content of @fd to the new file @tmp in @dfd */
+/* The copy is made after depmod_output_sync(), so with @sync flush it here */
+static int depmod_output_copy(int fd, int dfd, const char *tmp, bool sync)
+{
+	char buf[BUFSIZ];
+	off_t off = 0;
+	ssize_t r;
+	int out, err = 0;
+
+	out = openat(dfd, tmp, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+	if (out < 0)
+		return -errno;
+
+	while ((r = pread(fd, buf, sizeof(buf), off)) > 0) {
+		ssize_t w = write_str_safe(out, buf, r);
+
+		if (w < 0) {
+			err = w;
+			break;
+		}
+		off += r;
+	}
+	if (r < 0)
+		err = -errno;
+	if (sync && err == 0 && fdatasync(out) < 0)
+		err = -errno;
+	if (close(out) < 0 && err == 0)
+		err = -errno;
+
+	if (err < 0)
+		unlinkat(dfd, tmp, 0);
+
+	return err;
+}
+
+/* Give the unnamed file @fd the name @tmp in @dfd */
+static int depmod_output_link(int fd, int dfd, const char *tmp, bool sync)
+{
+	char proc[64];
+
+	/* left by a run with no O_TMPFILE, or interrupted while publishing */
+	unlinkat(dfd, tmp, 0);
+
+	/* AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, going through /proc doesn't */
+	if (linkat(fd, "", dfd, tmp, AT_EMPTY_PATH) == 0)
+		return 0;
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	if (linkat(AT_FDCWD, proc, dfd, tmp, AT_SYMLINK_FOLLOW) == 0)
+		return 0;
+
+	/* and without /proc mounted, there's no way around a copy */
+	return depmod_output_copy(fd, dfd, tmp, sync);
+}
+
+/*
+ * Rename @o over the old file. An unnamed file is linked as <name>.tmp first,
+ * since linkat() can't replace an existing file.
+ */
+static int depmod_output_publish(struct depmod *depmod, int dfd,
+						struct depmod_output *o)
+{
+	const char *dname = depmod->cfg->dirname;
+	char tmp[NAME_MAX];
+	int err;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", o->name);
+	if (!o->named) {
+		err = depmod_output_link(o->fd, dfd, tmp,
+						depmod->cfg->sync);
+		if (err < 0) {
+			CRIT("linkat(%d, %s, %s): %s\n", o->fd, dname, tmp,
+							strerror(-err));
+			depmod_output_discard(dfd, o);
+			return err;
+		}
+		o->named = true;
+	}
+
+	if (renameat(dfd, tmp, dfd, o->name) != 0) {
+		err = -errno;
+		CRIT("renameat(%s, %s, %s, %s): %m\n", dname, tmp, dname,
+								o->name);
+		depmod_output_discard(dfd, o);
+		return err;
+	}
+
+	close(o->fd);
+	o->fd = -1;
+
+	return 0;
+}
+
+/*
+ * With --sync, flush all the outputs before any is published, so a crash
+ * can't leave an index that is in place but empty. Writeback is started on
+ * all of them before waiting on the first one, so they are written together.
+ */
+static int depmod_output_sync(struct depmod *depmod, struct depmod_output *outs,
+								size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (outs[i].fd >= 0)
+			sync_file_range(outs[i].fd, 0, 0,
+						SYNC_FILE_RANGE_WRITE);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (outs[i].fd >= 0 && fdatasync(outs[i].fd) < 0) {
+			int err = -errno;
+
+			ERR("fdatasync(%s/%s): %m\n", depmod->cfg->dirname,
+								outs[i].name);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Failing to create the file for @df is only reported, the old index is
+ * kept then.
+ */
+static int depmod_output_file(struct depmod *depmod, int dfd,
+			const struct depfile *df, struct depmod_output *o)
+{
+	FILE *fp;
+
+	if (depmod_output_begin(depmod, dfd, o, &fp) < 0)
+		return 0;
+
+	return depmod_output_end(dfd, o, fp, df->cb(depmod, fp));
+}
+
+struct depmod_output_worker {
+	struct depmod *depmod;
+	int dfd;
+	size_t *next;
+	struct depmod_output *outs; /* one per depfile */
+	int *results;
+	bool *failed;
+	pthread_t thread;
+};
+
+static void *depmod_output_worker_run(void *data)
+{
+	struct depmod_output_worker *w = data;
+	size_t i;
+
+	while (!__atomic_load_n(w->failed, __ATOMIC_RELAXED) &&
+		(i = __atomic_fetch_add(w->next, 1, __ATOMIC_RELAXED)) <
+							ARRAY_SIZE(depfiles)) {
+		w->results[i] = depmod_output_file(w->depmod, w->dfd,
+						&depfiles[i], &w->outs[i]);
+		if (w->results[i] < 0)
+			__atomic_store_n(w->failed, true, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+/*
+ * The outputs only read the finished depmod, so with cfg->jobs > 1 they are
+ * written by up to that many threads. Like with a single one, no new file is
+ * started after an error and the first error in depfiles order is returned.
+ */
+static int depmod_output_files(struct depmod *depmod, int dfd,
+						struct depmod_output *outs)
+{
+	const struct cfg *cfg = depmod->cfg;
+	int results[sizeof(depfiles) / sizeof(depfiles[0])] = { };
+	struct depmod_output_worker self, *workers = NULL;
+	unsigned int i, n_threads = 0;
+	bool failed = false;
+	size_t next = 0;
+
+	self.depmod = depmod;
+	self.dfd = dfd;
+	self.next = &next;
+	self.outs = outs;
+	self.results = results;
+	self.failed = &failed;
+
+	if (cfg->jobs > 1) {
+		n_threads = cfg->jobs - 1;
+		if (n_threads > ARRAY_SIZE(depfiles) - 1)
+			n_threads = ARRAY_SIZE(depfiles) - 1;
+
+		workers = calloc(n_threads, sizeof(*workers));
+		if (workers == NULL) {
+			WRN("could not allocate workers, writing indexes serially\n");
+			n_threads = 0;
+		}
+	}
+
+	for (i = 0; i < n_threads; i++) {
+		int err;
+
+		workers[i] = self;
+		err = pthread_create(&workers[i].thread, NULL,
+					depmod_output_worker_run, &workers[i]);
+		if (err != 0) {
+			WRN("could not create thread: %s\n", strerror(err));
+			n_threads = i;
+			break;
+		}
+	}
+
+	depmod_output_worker_run(&self);
+
+	for (i = 0; i < n_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	free(workers);
+
+	for (i = 0; i < ARRAY_SIZE(depfiles); i++) {
+		if (results[i] < 0)
+			return results[i];
+	}
+
+	return 0;
+}
+
+
+static const struct bundle_section {
+	enum kmod_index id;
+	const char *name;
+} bundle_sections[] = {
+	{ KMOD_INDEX_MODULES_DEP, "modules.dep.bin" },
+	{ KMOD_INDEX_MODULES_ALIAS, "modules.alias.bin" },
+	{ KMOD_INDEX_MODULES_SYMBOL, "modules.symbols.bin" },
+	{ KMOD_INDEX_MODULES_BUILTIN, "modules.builtin.bin" },
+};
+
+static int output_bundle_pad(FILE *out, long *pos)
+{
+	static const char zeros[8];
+	long pad = ((*pos + 7) & ~7L) - *pos;
+
+	if (pad > 0 && fwrite(zeros, 1, pad, out) != (size_t) pad)
+		return -EIO;
+
+	*pos += pad;
+	return 0;
+}
+
+/* The @name just written if there is one, otherwise the one in @dfd */
+static int output_bundle_open(int dfd, const struct depmod_output *outs,
+							const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(depfiles); i++) {
+		if (outs[i].fd >= 0 && streq(outs[i].name, name))
+			return fcntl(outs[i].fd, F_DUPFD_CLOEXEC, 0);
+	}
+
+	return openat(dfd, name, O_RDONLY|O_CLOEXEC);
+}
+
+/*
+ * Concatenate the binary indexes in @outs to @out, with a table of sections
+ * in front so libkmod can map all of them at once. See "Bundle" in
+ * libkmod/libkmod-index.c.
+ */
+static int output_bundle(struct depmod *depmod, int dfd,
+			const struct depmod_output *outs, FILE *out)
+{
+	const size_t n_sections = ARRAY_SIZE(bundle_sections);
+	uint32_t table[3 + 3 * sizeof(bundle_sections) /
+						sizeof(bundle_sections[0])] = { };
+	long pos;
+	size_t i;
+	int err;
+
+	pos = sizeof(table);
+	if (fwrite(table, sizeof(table), 1, out) != 1)
+		return -EIO;
+
+	table[0] = htonl(INDEX_BUNDLE_MAGIC);
+	table[1] = htonl(INDEX_BUNDLE_VERSION);
+	table[2] = htonl(n_sections);
+
+	for (i = 0; i < n_sections; i++) {
+		const struct bundle_section *sec = &bundle_sections[i];
+		char buf[BUFSIZ];
+		long start;
+		ssize_t r;
+		int fd;
+
+		err = output_bundle_pad(out, &pos);
+		if (err < 0)
+			return err;
+		start = pos;
+
+		fd = output_bundle_open(dfd, outs, sec->name);
+		if (fd < 0) {
+			err = -errno;
+			ERR("openat(%s, %s): %m\n", depmod->cfg->dirname,
+								sec->name);
+			return err;
+		}
+
+		while ((r = pread(fd, buf, sizeof(buf), pos - start)) > 0) {
+			if (fwrite(buf, 1, r, out) != (size_t) r) {
+				r = -1;
+				errno = EIO;
+				break;
+			}
+			pos += r;
+		}
+		err = -errno;
+		close(fd);
+
+		if (r < 0) {
+			ERR("could not copy %s: %m\n", sec->name);
+			return err;
+		}
+
+		table[3 + 3 * i] = htonl(sec->id);
+		table[3 + 3 * i + 1] = htonl(start);
+		table[3 + 3 * i + 2] = htonl(pos - start);
+	}
+
+	if (fseek(out, 0, SEEK_SET) < 0 ||
+			fwrite(table, sizeof(table), 1, out) != 1)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Write modules.idx if asked to, otherwise remove any previous one so
+ * libkmod doesn't prefer it over the indexes just written.
+ */
+static int depmod_output_bundle(struct depmod *depmod, int dfd,
+			struct depmod_output *outs, struct depmod_output *o)
+{
+	FILE *fp;
+	int r;
+
+	if (!depmod->cfg->bundle) {
+		if (unlinkat(dfd, o->name, 0) != 0 && errno != ENOENT) {
+			r = -errno;
+			ERR("unlinkat(%s, %s): %m\n", depmod->cfg->dirname,
+								o->name);
+			return r;
+		}
+		return 0;
+	}
+
+	r = depmod_output_begin(depmod, dfd, o, &fp);
+	if (r < 0)
+		return r;
+
+	return depmod_output_end(dfd, o, fp, output_bundle(depmod, dfd, outs, fp));
+}
+
+/* the cache is just an optimization for the next run, errors are ignored */
+static void depmod_output_cache(struct depmod *depmod, int dfd,
+						struct depmod_output *o)
+{
+	FILE *fp;
+
+	if (!depmod->cfg->cache)
+		return;
+
+	if (depmod_output_begin(depmod, dfd, o, &fp) < 0)
+		return;
+
+	depmod_output_end(dfd, o, fp, output_cache(depmod, fp));
+}
+
+/* and so is the manifest */
+static void depmod_output_manifest(struct depmod *depmod, int dfd,
+						struct depmod_output *o)
+{
+	FILE *fp;
+
+	/* no search was done, what the last one saw is still valid */
+	if (depmod->manifest_dirs.count == 0)
+		return;
+
+	/* a directory missing from it would never be checked by -A */
+	if (depmod->manifest_incomplete) {
+		unlinkat(dfd, o->name, 0);
+		return;
+	}
+
+	if (depmod_output_begin(depmod, dfd, o, &fp) < 0)
+		return;
+
+	depmod_output_end(dfd, o, fp, output_manifest(depmod, fp));
+}
+
+static void depmod_stats_outputs(struct depmod_stats *stats,
+				const struct depmod_output *outs, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n && stats->n_outputs < DEPMOD_STATS_MAX_OUTPUTS; i++) {
+		struct stat st;
+
+		if (outs[i].fd < 0 || fstat(outs[i].fd, &st) < 0)
+			continue;
+
+		stats->outputs[stats->n_outputs].name = outs[i].name;
+		stats->outputs[stats->n_outputs].size = st.st_size;
+		stats->outputs[stats->n_outputs].write_time = outs[i].write_time;
+		stats->n_outputs++;
+	}
+}
+
+static int depmod_output(struct depmod *depmod, FILE *out)
+{
+	const char *dname = depmod->cfg->dirname;
+	const size_t n_depfiles = ARRAY_SIZE(depfiles);
+	struct depmod_output outs[sizeof(depfiles) / sizeof(depfiles[0]) + 3];
+	struct depmod_output *bundle = &outs[n_depfiles];
+	struct depmod_output *cache = bundle + 1;
+	struct depmod_output *manifest = bundle + 2;
+	int dfd, err;
+	size_t i;
+
+	if (out != NULL) {
+		for (i = 0; i < n_depfiles; i++)
+			depfiles[i].cb(depmod, out);
+		return 0;
+	}
+
+	dfd = open(dname, O_RDONLY);
+	if (dfd < 0) {
+		err = -errno;
+		CRIT("could not open directory %s: %m\n", dname);
+		return err;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(outs); i++) {
+		outs[i].fd = -1;
+		outs[i].buf = NULL;
+		if (i < n_depfiles)
+			outs[i].name = depfiles[i].name;
+	}
+	bundle->name = "modules.idx";
+	cache->name = "modules.cache";
+	manifest->name = "modules.manifest";
+
+	err = depmod_output_files(depmod, dfd, outs);
+	if (err == 0)
+		err = depmod_output_bundle(depmod, dfd, outs, bundle);
+	if (err == 0) {
+		depmod_output_cache(depmod, dfd, cache);
+		depmod_output_manifest(depmod, dfd, manifest);
+	}
+
+	if (err == 0 && depmod->stats != NULL)
+		depmod_stats_outputs(depmod->stats, outs, ARRAY_SIZE(outs));
+
+	if (err == 0 && depmod->cfg->sync)
+		err = depmod_output_sync(depmod, outs, ARRAY_SIZE(outs));
+
+	/* all written, now put them in place one right after the other */
+	for (i = 0; err == 0 && i <= n_depfiles; i++) {
+		if (outs[i].fd >= 0)
+			err = depmod_output_publish(depmod, dfd, &outs[i]);
+	}
+	if (err == 0) {
+		if (cache->fd >= 0)
+			depmod_output_publish(depmod, dfd, cache);
+		if (manifest->fd >= 0)
+			depmod_output_publish(depmod, dfd, manifest);
+	}
+
+	if (err == 0 && depmod->cfg->sync && fsync(dfd) < 0) {
+		err = -errno;
+		ERR("fsync(%s): %m\n", dname);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(outs); i++)
+		depmod_output_discard(dfd, &outs[i]);
+	close(dfd);
+
+	return err;
+}
+
+static void depmod_add_fake_syms(struct depmod *depmod)
+{
+	/* __this_module is magic inserted by kernel loader. */
+	depmod_symbol_add(depmod, "__this_module", true, 0, NULL);
+	/* On S390, this is faked up too */
+	depmod_symbol_add(depmod, "_GLOBAL_OFFSET_TABLE_", true, 0, NULL);
+	/* On PowerPC64 ABIv2, .TOC. is more or less _GLOBAL_OFFSET_TABLE_ */
+	depmod_symbol_add(depmod, "TOC.", true, 0, NULL);
+}
+
+static int depmod_load_symvers(struct depmod *depmod, const char *filename)
+{
+	char line[10240];
+	FILE *fp;
+	unsigned int linenum = 0;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		int err = -errno;
+		DBG("load symvers: %s: %m\n", filename);
+		return err;
+	}
+	DBG("load symvers: %s\n", filename);
+
+	/* eg. "0xb352177e\tfind_first_bit\tvmlinux\tEXPORT_SYMBOL" */
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		const char *ver, *sym, *where;
+		char *verend;
+		uint64_t crc;
+
+		linenum++;
+
+		ver = strtok(line, " \t");
+		sym = strtok(NULL, " \t");
+		where = strtok(NULL, " \t");
+		if (!ver || !sym || !where)
+			continue;
+
+		if (!streq(where, "vmlinux"))
+			continue;
+
+		crc = strtoull(ver, &verend, 16);
+		if (verend[0] != '\0') {
+			ERR("%s:%u Invalid symbol version %s: %m\n",
+			    filename, linenum, ver);
+			continue;
+		}
+
+		depmod_symbol_add(depmod, sym, false, crc, NULL);
+	}
+	depmod_add_fake_syms(depmod);
+
+	DBG("loaded symvers: %s\n", filename);
+
+	fclose(fp);
+	return 0;
+}
+
+static int depmod_load_system_map(struct depmod *depmod, const char *filename)
+{
+	const char ksymstr[] = "__ksymtab_";
+	const size_t ksymstr_len = sizeof(ksymstr) - 1;
 	char line[10240];
 	FILE *fp;
 	unsigned int linenum = 0;
@@ -2419,118 +4518,201 @@ static int depmod_load_system_map(struct depmod *depmod, const char *filename)
 }
 
 
-static int depfile_up_to_date_dir(DIR *d, time_t mtime, size_t baselen, char *path)
+struct depfile_walk {
+	time_t mtime;
+	bool outdated;
+};
+
+static int depfile_up_to_date_entry(const struct dirwalk_entry *e, void *data)
 {
-	struct dirent *de;
-	int err = 1, dfd = dirfd(d);
+	struct depfile_walk *w = data;
+	const struct stat *stp = e->st;
+	struct stat st;
 
-	while ((de = readdir(d)) != NULL) {
-		const char *name = de->d_name;
-		size_t namelen;
+	/* before the error: build and source are often dangling symlinks */
+	if (depmod_dirent_skip(e->name))
+		return DIRWALK_SKIP;
+
+	if (e->err < 0) {
+		if (e->err == -ENAMETOOLONG)
+			ERR("path is too long %s%s\n", e->path, e->name);
+		else
+			ERR("failed %s: %s\n", e->path, strerror(-e->err));
+		return DIRWALK_CONTINUE;
+	}
+
+	if (e->type == DT_DIR)
+		return DIRWALK_CONTINUE;
+	if (e->type != DT_REG) {
+		ERR("unsupported file type %s: %o\n", e->path, DTTOIF(e->type));
+		return DIRWALK_CONTINUE;
+	}
+	if (!path_ends_with_kmod_ext(e->name, e->namelen))
+		return DIRWALK_CONTINUE;
+
+	if (stp == NULL) {
+		if (fstatat(e->dfd, e->name, &st, 0) < 0) {
+			ERR("fstatat(%d, %s): %m\n", e->dfd, e->name);
+			return DIRWALK_CONTINUE;
+		}
+		stp = &st;
+	}
+	if (stp->st_mtime <= w->mtime)
+		return DIRWALK_CONTINUE;
+
+	DBG("%s %"PRIu64" is newer than %"PRIu64"\n", e->path,
+	    (uint64_t)stp->st_mtime, (uint64_t)w->mtime);
+	__atomic_store_n(&w->outdated, true, __ATOMIC_RELAXED);
+	return DIRWALK_STOP;
+}
+
+/*
+ * Compare the directory @relpath, which changed since the manifest was
+ * written, with the entries it had then. The modules in it are also checked,
+ * in case one was replaced and the new one kept the name.
+ */
+static int depfile_up_to_date_listing(int dfd, const char *relpath,
+				struct cache_reader *r, uint32_t n,
+				time_t mtime)
+{
+	struct dir_reader d;
+	struct dir_entry de;
+	uint32_t i = 0;
+	int err = 1, ret;
+
+	ret = dir_reader_open(&d, dfd, relpath[0] ? relpath : ".");
+	if (ret < 0)
+		return ret;
+
+	while (err == 1 && (ret = dir_reader_next(&d, &de)) > 0) {
+		const char *name = de.name;
+		uint32_t type;
+		const char *old;
 		struct stat st;
+		int is_dir;
 
-		if (name[0] == '.' && (name[1] == '\0' ||
-				       (name[1] == '.' && name[2] == '\0')))
+		if (depmod_dirent_skip(name))
 			continue;
-		if (streq(name, "build") || streq(name, "source"))
+		is_dir = depmod_entry_is_dir(d.fd, &de, name);
+		if (is_dir < 0 ||
+			(!is_dir && !path_ends_with_kmod_ext(name, de.namelen)))
 			continue;
-		namelen = strlen(name);
-		if (baselen + namelen + 2 >= PATH_MAX) {
-			path[baselen] = '\0';
-			ERR("path is too long %s%s\n", path, name);
-			continue;
-		}
 
-		if (fstatat(dfd, name, &st, 0) < 0) {
-			ERR("fstatat(%d, %s): %m\n", dfd, name);
-			continue;
+		if (i++ == n) {
+			DBG("%s%s is new\n", relpath, name);
+			err = 0;
+			break;
 		}
 
-		if (S_ISDIR(st.st_mode)) {
-			int fd;
-			DIR *subdir;
-			memcpy(path + baselen, name, namelen + 1);
-			if (baselen + namelen + 2 + NAME_MAX >= PATH_MAX) {
-				ERR("directory path is too long %s\n", path);
+		manifest_read_entry(r, &type, &old);
+		if (!streq(name, old) || is_dir != (type == MANIFEST_DIR)) {
+			DBG("entries of %s changed\n", relpath);
+			err = 0;
+		} else if (!is_dir) {
+			if (fstatat(d.fd, name, &st, 0) < 0) {
+				ERR("fstatat(%d, %s): %m\n", d.fd, name);
 				continue;
 			}
-			fd = openat(dfd, name, O_RDONLY);
-			if (fd < 0) {
-				ERR("openat(%d, %s, O_RDONLY): %m\n",
-				    dfd, name);
-				continue;
-			}
-			subdir = fdopendir(fd);
-			if (subdir == NULL) {
-				ERR("fdopendir(%d): %m\n", fd);
-				close(fd);
-				continue;
-			}
-			path[baselen + namelen] = '/';
-			path[baselen + namelen + 1] = '\0';
-			err = depfile_up_to_date_dir(subdir, mtime,
-						     baselen + namelen + 1,
-						     path);
-			closedir(subdir);
-		} else if (S_ISREG(st.st_mode)) {
-			if (!path_ends_with_kmod_ext(name, namelen))
-				continue;
-
-			memcpy(path + baselen, name, namelen + 1);
-			err = st.st_mtime <= mtime;
-			if (err == 0) {
-				DBG("%s %"PRIu64" is newer than %"PRIu64"\n",
-				    path, (uint64_t)st.st_mtime,
+			if (st.st_mtime > mtime) {
+				DBG("%s%s %"PRIu64" is newer than %"PRIu64"\n",
+				    relpath, name, (uint64_t)st.st_mtime,
 				    (uint64_t)mtime);
+				err = 0;
 			}
-		} else {
-			ERR("unsupported file type %s: %o\n",
-			    path, st.st_mode & S_IFMT);
-			continue;
 		}
+	}
 
-		if (err == 0)
-			break; /* outdated! */
-		else if (err < 0) {
-			path[baselen + namelen] = '\0';
-			ERR("failed %s: %s\n", path, strerror(-err));
-			err = 1; /* ignore errors */
+	if (ret < 0)
+		err = ret;
+	else if (err == 1 && i < n) {
+		DBG("entries of %s were removed\n", relpath);
+		err = 0;
+	}
+
+	dir_reader_close(&d);
+	return err;
+}
+
+/*
+ * Check only the directories that changed since the last full search.
+ * uptodate: 1, outdated: 0, errors < 0
+ */
+static int depfile_up_to_date_manifest(const struct manifest *m, int dfd,
+								time_t mtime)
+{
+	struct hash_iter iter;
+	const char *relpath;
+	unsigned int changed = 0;
+	int err = 1;
+
+	hash_iter_init(m->dirs, &iter);
+	while (err == 1 && hash_iter_next(&iter, &relpath, NULL)) {
+		struct cache_reader r;
+		uint64_t old_mtime;
+		uint32_t n;
+		struct stat st;
+
+		manifest_find(m, relpath, &old_mtime, &n, &r);
+
+		if (fstatat(dfd, relpath[0] ? relpath : ".", &st, 0) < 0) {
+			DBG("%s is gone: %m\n", relpath);
+			return 0;
 		}
+		if (old_mtime != 0 && ts_usec(&st.st_mtim) == old_mtime)
+			continue;
+
+		changed++;
+		err = depfile_up_to_date_listing(dfd, relpath, &r, n, mtime);
 	}
 
+	DBG("checked %u of %u directories\n", changed,
+						hash_get_count(m->dirs));
+
 	return err;
 }
 
-/* uptodate: 1, outdated: 0, errors < 0 */
-static int depfile_up_to_date(const char *dirname)
+/*
+ * With a manifest, only the directories that changed are listed. Otherwise
+ * all of the tree is walked, by @jobs threads.
+ * uptodate: 1, outdated: 0, errors < 0
+ */
+static int depfile_up_to_date(const char *dirname, unsigned int jobs)
 {
-	char path[PATH_MAX];
-	DIR *d = opendir(dirname);
+	struct depfile_walk w = { };
+	struct manifest m;
 	struct stat st;
-	size_t baselen;
-	int err;
-	if (d == NULL) {
+	int err, dfd;
+
+	dfd = open(dirname, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (dfd < 0) {
 		err = -errno;
 		ERR("could not open directory %s: %m\n", dirname);
 		return err;
 	}
 
-	if (fstatat(dirfd(d), "modules.dep", &st, 0) != 0) {
+	if (fstatat(dfd, "modules.dep", &st, 0) != 0) {
 		err = -errno;
 		ERR("could not fstatat(%s, modules.dep): %m\n", dirname);
-		closedir(d);
+		close(dfd);
 		return err;
 	}
 
-	baselen = strlen(dirname);
-	memcpy(path, dirname, baselen);
-	path[baselen] = '/';
-	baselen++;
-	path[baselen] = '\0';
+	if (manifest_open(&m, dirname) == 0) {
+		err = depfile_up_to_date_manifest(&m, dfd, st.st_mtime);
+		manifest_close(&m);
+		if (err >= 0) {
+			close(dfd);
+			return err;
+		}
+	}
 
-	err = depfile_up_to_date_dir(d, st.st_mtime, baselen, path);
-	closedir(d);
-	return err;
+	w.mtime = st.st_mtime;
+	err = dirwalk(dfd, dirname, jobs, depfile_up_to_date_entry, &w);
+	close(dfd);
+	if (err < 0)
+		return err;
+
+	return w.outdated ? 0 : 1;
 }
 
 static int is_version_number(const char *version)
@@ -2539,6 +4721,125 @@ static int is_version_number(const char *version)
 	return (sscanf(version, "%u.%u", &d1, &d2) == 2);
 }
 
+static unsigned int depmod_count_aliases(const struct depmod *depmod)
+{
+	unsigned int n = 0;
+	size_t i;
+
+	for (i = 0; i < depmod->modules.count; i++) {
+		const struct mod *mod = depmod->modules.array[i];
+		struct kmod_list *l;
+
+		kmod_list_foreach(l, mod->info_list) {
+			if (streq(kmod_module_info_get_key(l), "alias"))
+				n++;
+		}
+	}
+
+	return n;
+}
+
+/* Print @str as a JSON string, quotes included */
+static void json_print_str(FILE *out, const char *str)
+{
+	const unsigned char *p;
+
+	fputc('"', out);
+	for (p = (const unsigned char *)str; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(out, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(out, "\\u%04x", *p);
+		else
+			fputc(*p, out);
+	}
+	fputc('"', out);
+}
+
+/* @depmod isn't initialized when -A found the indexes up to date */
+static void depmod_stats_print(const struct depmod *depmod,
+				const struct cfg *cfg,
+				const struct depmod_stats *stats, FILE *out)
+{
+	unsigned int n_symbols, n_aliases, i;
+	uint64_t wall = 0, cpu = 0;
+	long maxrss = 0;
+	const char *sep = "";
+
+	n_symbols = depmod->symbols != NULL ? hash_get_count(depmod->symbols) : 0;
+	n_aliases = depmod_count_aliases(depmod);
+
+	if (stats->json) {
+		fputs("{\"kernel\":", out);
+		json_print_str(out, cfg->kversion);
+		fprintf(out, ",\"jobs\":%u,\"phases\":[",
+					cfg->jobs > 0 ? cfg->jobs : 1);
+	} else {
+		fprintf(out, "%-24s %12s %12s %12s\n", "phase", "wall ms",
+							"cpu ms", "maxrss KiB");
+	}
+
+	for (i = 0; i < _DEPMOD_PHASE_COUNT; i++) {
+		if (!stats->phases[i].ran)
+			continue;
+
+		wall += stats->phases[i].wall;
+		cpu += stats->phases[i].cpu;
+		maxrss = stats->phases[i].maxrss;
+
+		if (stats->json) {
+			fprintf(out, "%s{\"name\":", sep);
+			json_print_str(out, depmod_phase_names[i]);
+			fprintf(out, ",\"wall_us\":%"PRIu64",\"cpu_us\":%"PRIu64
+				",\"maxrss_kib\":%ld}",
+				stats->phases[i].wall, stats->phases[i].cpu,
+				stats->phases[i].maxrss);
+			sep = ",";
+		} else {
+			fprintf(out, "%-24s %12.3f %12.3f %12ld\n",
+				depmod_phase_names[i],
+				stats->phases[i].wall / 1000.0,
+				stats->phases[i].cpu / 1000.0,
+				stats->phases[i].maxrss);
+		}
+	}
+
+	if (stats->json) {
+		fprintf(out, "],\"wall_us\":%"PRIu64",\"cpu_us\":%"PRIu64
+			",\"maxrss_kib\":%ld,\"modules\":%zu,\"symbols\":%u"
+			",\"aliases\":%u,\"outputs\":[",
+			wall, cpu, maxrss, depmod->modules.count, n_symbols,
+			n_aliases);
+	} else {
+		fprintf(out, "%-24s %12.3f %12.3f %12ld\n", "total",
+			wall / 1000.0, cpu / 1000.0, maxrss);
+		fprintf(out, "\nmodules: %zu, symbols: %u, aliases: %u\n",
+			depmod->modules.count, n_symbols, n_aliases);
+		if (stats->n_outputs > 0)
+			fprintf(out, "\n%-24s %12s %12s\n", "output", "bytes",
+								"write ms");
+	}
+
+	sep = "";
+	for (i = 0; i < stats->n_outputs; i++) {
+		if (stats->json) {
+			fprintf(out, "%s{\"name\":", sep);
+			json_print_str(out, stats->outputs[i].name);
+			fprintf(out, ",\"size\":%"PRIu64",\"write_us\":%"PRIu64
+				"}", stats->outputs[i].size,
+				stats->outputs[i].write_time);
+			sep = ",";
+		} else {
+			fprintf(out, "%-24s %12"PRIu64" %12.3f\n",
+				stats->outputs[i].name, stats->outputs[i].size,
+				stats->outputs[i].write_time / 1000.0);
+		}
+	}
+
+	if (stats->json)
+		fputs("]}\n", out);
+}
+
 static int do_depmod(int argc, char *argv[])
 {
 	FILE *out = NULL;
@@ -2550,9 +4851,11 @@ static int do_depmod(int argc, char *argv[])
 	const char *null_kmod_config = NULL;
 	struct utsname un;
 	struct kmod_ctx *ctx = NULL;
+	struct depmod_stats stats;
 	struct cfg cfg;
 	struct depmod depmod;
 
+	memset(&stats, 0, sizeof(stats));
 	memset(&cfg, 0, sizeof(cfg));
 	memset(&depmod, 0, sizeof(depmod));
 
@@ -2609,6 +4912,45 @@ static int do_depmod(int argc, char *argv[])
 			}
 			cfg.sym_prefix = optarg[0];
 			break;
+		case 'I':
+			if (streq(optarg, "2"))
+				cfg.index_version = INDEX_VERSION_MAJOR;
+			else if (streq(optarg, "3"))
+				cfg.index_version = INDEX_VERSION_MAJOR_V3;
+			else {
+				CRIT("-I only takes 2 or 3\n");
+				goto cmdline_failed;
+			}
+			break;
+		case 'B':
+			cfg.bundle = 1;
+			break;
+		case 's':
+			cfg.sync = 1;
+			break;
+		case 'S':
+			if (optarg != NULL && streq(optarg, "json"))
+				stats.json = true;
+			else if (optarg != NULL && !streq(optarg, "text")) {
+				CRIT("--stats takes text or json\n");
+				goto cmdline_failed;
+			}
+			depmod.stats = &stats;
+			break;
+		case 'c':
+			cfg.cache = 1;
+			break;
+		case 'j': {
+			char *end;
+			unsigned long jobs = strtoul(optarg, &end, 10);
+
+			if (*end != '\0' || jobs == 0 || jobs > 1024) {
+				CRIT("-j takes a number of jobs between 1 and 1024\n");
+				goto cmdline_failed;
+			}
+			cfg.jobs = jobs;
+			break;
+		}
 		case 'w':
 			cfg.warn_dups = 1;
 			break;
@@ -2664,11 +5006,19 @@ static int do_depmod(int argc, char *argv[])
 		if (out == stdout)
 			goto done;
 		/* ignore up-to-date errors (< 0) */
-		if (depfile_up_to_date(cfg.dirname) == 1)
+		depmod_stats_begin(depmod.stats);
+		err = depfile_up_to_date(cfg.dirname, cfg.jobs);
+		depmod_stats_end(depmod.stats, DEPMOD_PHASE_CHECK);
+		if (err == 1) {
+			err = 0;
 			goto done;
+		}
+		err = 0;
 		all = 1;
 	}
 
+	depmod_stats_begin(depmod.stats);
+
 	ctx = kmod_new(cfg.dirname, &null_kmod_config);
 	if (ctx == NULL) {
 		CRIT("kmod_new(\"%s\", {NULL}) failed: %m\n", cfg.dirname);
@@ -2709,6 +5059,11 @@ static int do_depmod(int argc, char *argv[])
 			CRIT("could not load configuration files\n");
 			goto cmdline_modules_failed;
 		}
+	}
+	depmod_stats_end(depmod.stats, DEPMOD_PHASE_CONFIG);
+
+	depmod_stats_begin(depmod.stats);
+	if (all) {
 		err = depmod_modules_search(&depmod);
 		if (err < 0) {
 			CRIT("could not search modules: %s\n", strerror(-err));
@@ -2743,21 +5098,34 @@ static int do_depmod(int argc, char *argv[])
 		}
 	}
 
+	depmod_stats_end(depmod.stats, DEPMOD_PHASE_SEARCH);
+
+	depmod_stats_begin(depmod.stats);
 	err = depmod_modules_build_array(&depmod);
 	if (err < 0) {
 		CRIT("could not build module array: %s\n",
 		     strerror(-err));
 		goto cmdline_modules_failed;
 	}
+	depmod_stats_end(depmod.stats, DEPMOD_PHASE_BUILD_ARRAY);
 
+	depmod_stats_begin(depmod.stats);
 	depmod_modules_sort(&depmod);
+	depmod_stats_end(depmod.stats, DEPMOD_PHASE_SORT);
+
 	err = depmod_load(&depmod);
 	if (err < 0)
 		goto cmdline_modules_failed;
 
+	depmod_stats_begin(depmod.stats);
 	err = depmod_output(&depmod, out);
+	depmod_stats_end(depmod.stats, DEPMOD_PHASE_OUTPUT);
 
 done:
+	/* with -n, stdout has the indexes */
+	if (depmod.stats != NULL)
+		depmod_stats_print(&depmod, &cfg, &stats,
+					out == stdout ? stderr : stdout);
 	depmod_shutdown(&depmod);
 	cfg_free(&cfg);
 	return err >= 0 ? EXIT_SUCCESS : EXIT_FAILURE;
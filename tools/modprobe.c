@@ -880,7 +880,7 @@ static int do_modprobe(int argc, char **orig_argv)
 
 	log_setup_kmod_log(ctx, verbose);
 
-	kmod_load_resources(ctx);
+	kmod_set_lazy_resources(ctx, true);
 
 	if (do_show_config)
 		err = show_config(ctx);